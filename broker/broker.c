@@ -19,12 +19,64 @@ CIRCLEQ_HEAD(broker_list, broker) broker_list_head;
 
 #define BROKER_OBJ_SET_DEL(f) \
 	(f |= BROKER_FLAGS_DELETE)
+
+/* Initial number of entries in the sequence log */
+#define BROKER_SEQ_LOG_MIN 64
+
+struct broker_seq_ent {
+	uint64_t id;
+	struct broker_obj *obj;
+};
+
+/* Number of snapshot entries taken at a time when resyncing a client */
+#define BROKER_RESYNC_BATCH 32
+
+/* Initial number of changed objects a snapshot has room to keep */
+#define BROKER_SNAP_SAVED_MIN 16
+
+struct broker_snapshot {
+	LIST_ENTRY(broker_snapshot) snap_list;
+	struct broker *broker;
+	/* Everything with this id or above has been handed out */
+	uint64_t pos;
+	/* Marks how far the walk of the object list has got */
+	struct broker_obj cursor;
+	/* Objects that changed or went before they were handed out */
+	struct broker_snapshot_ent *saved;
+	size_t saved_count;
+	size_t saved_size;
+	/* Could not save an object, so hands out nothing more */
+	bool failed;
+	/* Most objects to save, 0 for no limit */
+	size_t saved_max;
+	/*
+	 * Objects with ids from skip_lo to skip_hi are left out, and not
+	 * saved when they change. While the mark is in the list the walk
+	 * jumps to it on getting down to them, so it never walks them.
+	 */
+	uint64_t skip_lo;
+	uint64_t skip_hi;
+	struct broker_obj mark;
+	bool marked;
+};
+
+static inline bool broker_is_seq_log(struct broker *broker)
+{
+	return broker->create_flags & BROKER_CREATE_SEQ_LOG;
+}
+
 /*
  * type_count: how many different types of object will be stored in this
  *             broker.
  */
 struct broker *broker_create(const struct broker_ops *broker_ops,
 			     size_t type_count)
+{
+	return broker_create_flags(broker_ops, type_count, 0);
+}
+
+struct broker *broker_create_flags(const struct broker_ops *broker_ops,
+				   size_t type_count, unsigned int flags)
 {
 	struct broker *broker;
 	static bool inited;
@@ -32,7 +84,8 @@ struct broker *broker_create(const struct broker_ops *broker_ops,
 	if (!broker_ops ||
 	    !broker_ops->obj_to_broker_obj ||
 	    !broker_ops->broker_obj_to_obj ||
-	    !broker_ops->lock_obj || !broker_ops->unlock_obj || type_count == 0)
+	    !broker_ops->lock_obj || !broker_ops->unlock_obj ||
+	    (broker_ops->get_data && !broker_ops->put_data) || type_count == 0)
 		return NULL;
 
 	broker = calloc(1, sizeof(*broker));
@@ -46,9 +99,12 @@ struct broker *broker_create(const struct broker_ops *broker_ops,
 	CIRCLEQ_INSERT_HEAD(&broker_list_head, broker, brokers_list);
 
 	CIRCLEQ_INIT(&broker->b_obj_list_head);
+	TAILQ_INIT(&broker->b_tomb_list_head);
 	CIRCLEQ_INIT(&broker->b_client_list_head);
+	LIST_INIT(&broker->b_snap_list_head);
 	broker->ops = *broker_ops;
 	broker->type_count = type_count;
+	broker->create_flags = flags;
 
 	return broker;
 }
@@ -64,10 +120,300 @@ int broker_delete(struct broker *broker)
 	if (!CIRCLEQ_EMPTY(&broker->b_obj_list_head))
 		return -ENOTEMPTY;
 
+	assert(TAILQ_EMPTY(&broker->b_tomb_list_head));
+	assert(LIST_EMPTY(&broker->b_snap_list_head));
+	CIRCLEQ_REMOVE(&broker_list_head, broker, brokers_list);
+	free(broker->seq_log);
+	free(broker->client_heap);
 	free(broker);
 	return 0;
 }
 
+/*
+ * The clients of a broker are kept in a binary min-heap keyed on the id
+ * of their position in the object list, so that the id of the slowest
+ * client can be found without walking all of the clients.
+ */
+static inline uint64_t broker_heap_id(struct broker *broker, size_t idx)
+{
+	return broker->client_heap[idx]->broker_obj.id;
+}
+
+static void broker_heap_swap(struct broker *broker, size_t a, size_t b)
+{
+	struct broker_client *tmp = broker->client_heap[a];
+
+	broker->client_heap[a] = broker->client_heap[b];
+	broker->client_heap[b] = tmp;
+	broker->client_heap[a]->heap_idx = a;
+	broker->client_heap[b]->heap_idx = b;
+}
+
+static void broker_heap_up(struct broker *broker, size_t idx)
+{
+	size_t parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (broker_heap_id(broker, parent) <= broker_heap_id(broker, idx))
+			break;
+		broker_heap_swap(broker, parent, idx);
+		idx = parent;
+	}
+}
+
+static void broker_heap_down(struct broker *broker, size_t idx)
+{
+	size_t child;
+
+	while ((child = 2 * idx + 1) < broker->client_heap_count) {
+		if (child + 1 < broker->client_heap_count &&
+		    broker_heap_id(broker, child + 1) <
+		    broker_heap_id(broker, child))
+			child++;
+		if (broker_heap_id(broker, idx) <= broker_heap_id(broker, child))
+			break;
+		broker_heap_swap(broker, idx, child);
+		idx = child;
+	}
+}
+
+static int broker_heap_insert(struct broker *broker,
+			      struct broker_client *client)
+{
+	struct broker_client **heap;
+	size_t size;
+
+	if (broker->client_heap_count == broker->client_heap_size) {
+		size = broker->client_heap_size ?
+			broker->client_heap_size * 2 : 4;
+		heap = realloc(broker->client_heap, size * sizeof(*heap));
+		if (!heap)
+			return -ENOMEM;
+		broker->client_heap = heap;
+		broker->client_heap_size = size;
+	}
+
+	client->heap_idx = broker->client_heap_count++;
+	broker->client_heap[client->heap_idx] = client;
+	broker_heap_up(broker, client->heap_idx);
+	return 0;
+}
+
+static void broker_heap_remove(struct broker *broker,
+			       struct broker_client *client)
+{
+	size_t idx = client->heap_idx;
+	size_t last = --broker->client_heap_count;
+
+	if (idx == last)
+		return;
+
+	broker_heap_swap(broker, idx, last);
+	broker_heap_up(broker, idx);
+	broker_heap_down(broker, idx);
+}
+
+/* Move a client to a new position, keeping the heap in order. */
+static void broker_client_set_id(struct broker_client *client, uint64_t id)
+{
+	client->broker_obj.id = id;
+	broker_heap_down(client->broker, client->heap_idx);
+	if (id > client->broker->seen_id)
+		client->broker->seen_id = id;
+}
+
+/* The id of the slowest client, or UINT64_MAX if there are no clients */
+static uint64_t broker_min_client_id(struct broker *broker)
+{
+	if (!broker->client_heap_count)
+		return UINT64_MAX;
+
+	return broker_heap_id(broker, 0);
+}
+
+/* Index of the first log entry with an id greater than 'id' */
+static size_t broker_seq_upper(struct broker *broker, uint64_t id)
+{
+	size_t lo = 0;
+	size_t hi = broker->seq_log_count;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (broker->seq_log[mid].id <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Squeeze out the entries of objects that have moved or gone. */
+static void broker_seq_compact(struct broker *broker)
+{
+	size_t i;
+	size_t j = 0;
+
+	for (i = 0; i < broker->seq_log_count; i++) {
+		if (broker->seq_log[i].obj)
+			broker->seq_log[j++] = broker->seq_log[i];
+	}
+	broker->seq_log_count = j;
+	broker->seq_log_gen++;
+}
+
+/*
+ * Make room at the end of the log for one more entry. If the log can not
+ * grow it is squeezed instead, so this only fails when every entry is in
+ * use, and so never for an object that has just had its entry cleared.
+ */
+static int broker_seq_reserve(struct broker *broker)
+{
+	struct broker_seq_ent *log;
+	size_t size;
+
+	if (broker->seq_log_count < broker->seq_log_size)
+		return 0;
+
+	/* At least half is dead, so compacting frees a good part of it */
+	if (broker->seq_log_size &&
+	    broker->seq_log_count - broker->seq_log_live >=
+	    broker->seq_log_live) {
+		broker_seq_compact(broker);
+		return 0;
+	}
+
+	size = broker->seq_log_size ?
+		broker->seq_log_size * 2 : BROKER_SEQ_LOG_MIN;
+	log = realloc(broker->seq_log, size * sizeof(*log));
+	if (!log) {
+		if (broker->seq_log_count == broker->seq_log_live)
+			return -ENOMEM;
+		broker_seq_compact(broker);
+		return 0;
+	}
+	broker->seq_log = log;
+	broker->seq_log_size = size;
+	return 0;
+}
+
+/* Add an object at the end of the log, which must have room for it. */
+static void broker_seq_append(struct broker *broker, struct broker_obj *obj)
+{
+	assert(broker->seq_log_count < broker->seq_log_size);
+	broker->seq_log[broker->seq_log_count].id = obj->id;
+	broker->seq_log[broker->seq_log_count].obj = obj;
+	broker->seq_log_count++;
+	broker->seq_log_live++;
+}
+
+/* Drop the log entry for an object that is moving or going. */
+static void broker_seq_clear(struct broker *broker, struct broker_obj *obj)
+{
+	size_t idx = broker_seq_upper(broker, obj->id - 1);
+
+	assert(idx < broker->seq_log_count);
+	assert(broker->seq_log[idx].obj == obj);
+	broker->seq_log[idx].obj = NULL;
+	broker->seq_log_live--;
+}
+
+/*
+ * Find the next object in the log for a client. Only reads the log, the
+ * client remembers where it got to so that it does not need to search
+ * again unless the log has been compacted since.
+ */
+static struct broker_obj *broker_seq_client_next(struct broker_client *client,
+						 size_t *pos)
+{
+	struct broker *broker = client->broker;
+	size_t i;
+
+	if (client->seq_gen == broker->seq_log_gen)
+		i = client->seq_pos;
+	else
+		i = broker_seq_upper(broker, client->broker_obj.id);
+
+	for (; i < broker->seq_log_count; i++) {
+		if (broker->seq_log[i].obj) {
+			*pos = i;
+			return broker->seq_log[i].obj;
+		}
+	}
+
+	*pos = i;
+	return NULL;
+}
+
+/* Fill in a snapshot entry from the object as it is now */
+static void broker_snapshot_ent_fill(struct broker *broker,
+				     struct broker_snapshot_ent *ent,
+				     struct broker_obj *entry)
+{
+	ent->id = entry->id;
+	ent->obj_type = entry->obj_type;
+	ent->flags = entry->flags;
+	ent->obj = entry;
+	broker->ops.lock_obj(entry);
+	ent->data = broker->ops.get_data ? broker->ops.get_data(entry) : NULL;
+}
+
+/*
+ * Give up on a snapshot that has missed a change. What it saved is let
+ * go, and with nothing left to hand out nothing more is saved for it.
+ */
+static void broker_snapshot_fail(struct broker *broker,
+				 struct broker_snapshot *snap)
+{
+	broker_snapshot_put(broker, snap->saved, snap->saved_count);
+	free(snap->saved);
+	snap->saved = NULL;
+	snap->saved_count = 0;
+	snap->saved_size = 0;
+	snap->pos = 0;
+	snap->failed = true;
+}
+
+/*
+ * An object is about to change or go. Any snapshot that has not handed
+ * it out yet keeps hold of it as it is now, its data included, so this
+ * must be called before the data is changed.
+ */
+static void broker_snapshot_save(struct broker *broker,
+				 struct broker_obj *entry)
+{
+	struct broker_snapshot *snap;
+	struct broker_snapshot_ent *saved;
+	size_t size;
+
+	LIST_FOREACH(snap, &broker->b_snap_list_head, snap_list) {
+		if (entry->id >= snap->pos ||
+		    (entry->id >= snap->skip_lo && entry->id <= snap->skip_hi))
+			continue;
+
+		if (snap->saved_max && snap->saved_count == snap->saved_max) {
+			broker_snapshot_fail(broker, snap);
+			continue;
+		}
+
+		if (snap->saved_count == snap->saved_size) {
+			size = snap->saved_size ?
+				snap->saved_size * 2 : BROKER_SNAP_SAVED_MIN;
+			saved = realloc(snap->saved, size * sizeof(*saved));
+			if (!saved) {
+				broker_snapshot_fail(broker, snap);
+				continue;
+			}
+			snap->saved = saved;
+			snap->saved_size = size;
+		}
+
+		saved = &snap->saved[snap->saved_count++];
+		broker_snapshot_ent_fill(broker, saved, entry);
+	}
+}
+
 /*
  * If there are no clients then we can delete now.
  * If all clients have an ID >= obj then we can delete.
@@ -80,27 +426,36 @@ int broker_delete(struct broker *broker)
 static bool no_clients_need_this(struct broker *broker,
 				 struct broker_obj *entry)
 {
-	struct broker_client *client;
-	uint64_t id = ~0;
-
-	if (CIRCLEQ_EMPTY(&broker->b_client_list_head))
-		return true;
+	return broker_min_client_id(broker) >= entry->id;
+}
 
-	CIRCLEQ_FOREACH(client, &broker->b_client_list_head, client_list) {
-		if (client->broker_obj.id < id)
-			id = client->broker_obj.id;
-	}
+/* Has any client had this object, as it is now or in an earlier version */
+static bool broker_obj_seen(struct broker *broker, struct broker_obj *entry)
+{
+	return (entry->flags & BROKER_FLAGS_SEEN) ||
+		entry->id <= broker->seen_id;
+}
 
-	if (id >= entry->id)
-		return true;
+/* Is a snapshot still to hand out this object */
+static bool broker_snapshot_pending(struct broker *broker,
+				    struct broker_obj *entry)
+{
+	struct broker_snapshot *snap;
 
+	LIST_FOREACH(snap, &broker->b_snap_list_head, snap_list) {
+		if (entry->id < snap->pos)
+			return true;
+	}
 	return false;
 }
 
-void broker_add_obj(struct broker *broker, void *obj, int type)
+int broker_add_obj(struct broker *broker, void *obj, int type)
 {
 	struct broker_obj *new = broker->ops.obj_to_broker_obj(obj, type);
 
+	if (broker_is_seq_log(broker) && broker_seq_reserve(broker))
+		return -ENOMEM;
+
 	new->obj_type = type;
 	new->flags = BROKER_FLAGS_OBJ;
 	new->id = ++broker->id;
@@ -108,12 +463,70 @@ void broker_add_obj(struct broker *broker, void *obj, int type)
 	broker->ops.lock_obj(new);
 
 	CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head, new, b_obj_list);
+	if (broker_is_seq_log(broker))
+		broker_seq_append(broker, new);
+
+	broker_reclaim(broker, BROKER_RECLAIM_STEP);
+	return 0;
 }
 
-void broker_del_obj_now(struct broker *broker, struct broker_obj *entry)
+static void broker_tomb_remove(struct broker *broker, struct broker_obj *entry)
 {
+	TAILQ_REMOVE(&broker->b_tomb_list_head, entry, b_tomb_list);
+	broker->tomb_count--;
+}
+
+bool broker_del_obj_now(struct broker *broker, struct broker_obj *entry)
+{
+	bool seen = broker_obj_seen(broker, entry);
+
+	broker_snapshot_save(broker, entry);
+	if (entry->flags & (BROKER_FLAGS_DELETE | BROKER_FLAGS_RETIRED))
+		broker_tomb_remove(broker, entry);
+	if (broker_is_seq_log(broker))
+		broker_seq_clear(broker, entry);
 	CIRCLEQ_REMOVE(&broker->b_obj_list_head, entry, b_obj_list);
+	/* No longer in the broker, even if still locked by a snapshot */
+	entry->flags = 0;
 	broker->ops.unlock_obj(entry);
+	return seen;
+}
+
+/*
+ * The tombstones are freed in order, so one retired out of order can be
+ * held up by them for a while, but it is never freed early.
+ */
+bool broker_retire_obj(struct broker *broker, struct broker_obj *entry)
+{
+	if (no_clients_need_this(broker, entry))
+		return broker_del_obj_now(broker, entry);
+
+	entry->flags |= BROKER_FLAGS_RETIRED;
+	TAILQ_INSERT_TAIL(&broker->b_tomb_list_head, entry, b_tomb_list);
+	broker->tomb_count++;
+	return true;
+}
+
+/* Give an object a new id, making it the next thing clients will see */
+static void broker_move_to_top(struct broker *broker, struct broker_obj *entry)
+{
+	/* Clients may be past it now, but still need to hear of it going */
+	if (broker_obj_seen(broker, entry))
+		entry->flags |= BROKER_FLAGS_SEEN;
+
+	if (broker_is_seq_log(broker))
+		broker_seq_clear(broker, entry);
+
+	CIRCLEQ_REMOVE(&broker->b_obj_list_head, entry, b_obj_list);
+	CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head, entry, b_obj_list);
+	entry->id = ++broker->id;
+
+	if (broker_is_seq_log(broker)) {
+		/* The entry just cleared leaves room, if nothing else does */
+		if (broker_seq_reserve(broker))
+			assert(0);
+		broker_seq_append(broker, entry);
+	}
 }
 
 void broker_del_obj(struct broker *broker, void *obj, int type)
@@ -125,25 +538,109 @@ void broker_del_obj(struct broker *broker, void *obj, int type)
 		return;
 	}
 
+	/* Nobody needs to be told it went if nobody knew it was there */
+	if (!broker_obj_seen(broker, entry)) {
+		broker->unseen_dels++;
+		broker_del_obj_now(broker, entry);
+		return;
+	}
+
+	broker_snapshot_save(broker, entry);
+
+	/* Deleted again, so it moves to the end of the tombstones */
+	if (entry->flags & BROKER_FLAGS_DELETE)
+		broker_tomb_remove(broker, entry);
+
 	BROKER_OBJ_SET_DEL(entry->flags);
 
 	/* Move to the top so update can be picked up */
-	CIRCLEQ_REMOVE(&broker->b_obj_list_head, entry, b_obj_list);
-	CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head, entry, b_obj_list);
-	entry->id = ++broker->id;
+	broker_move_to_top(broker, entry);
+
+	TAILQ_INSERT_TAIL(&broker->b_tomb_list_head, entry, b_tomb_list);
+	broker->tomb_count++;
+
+	broker_reclaim(broker, BROKER_RECLAIM_STEP);
 }
 
 void broker_upd_obj(struct broker *broker, void *obj, int type)
 {
 	struct broker_obj *entry = broker->ops.obj_to_broker_obj(obj, type);
 
+	/*
+	 * Every client is still to get to this version, and will get the
+	 * new one, even if they had one before. A snapshot still to hand it
+	 * out would see it twice, so then it moves as normal, as does a
+	 * deleted object being recreated.
+	 */
+	if (entry->id > broker->seen_id &&
+	    !(entry->flags & BROKER_FLAGS_DELETE) &&
+	    !broker_snapshot_pending(broker, entry)) {
+		broker->unseen_upds++;
+		return;
+	}
+
+	broker_snapshot_save(broker, entry);
+
 	/* An update of a to-be-deleted object recreates it. */
-	if (entry->flags & BROKER_FLAGS_DELETE)
+	if (entry->flags & BROKER_FLAGS_DELETE) {
 		entry->flags &= ~BROKER_FLAGS_DELETE;
+		broker_tomb_remove(broker, entry);
+	}
 
-	CIRCLEQ_REMOVE(&broker->b_obj_list_head, entry, b_obj_list);
-	CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head, entry, b_obj_list);
-	entry->id = ++broker->id;
+	broker_move_to_top(broker, entry);
+
+	broker_reclaim(broker, BROKER_RECLAIM_STEP);
+}
+
+void broker_set_lag_limit(struct broker *broker, uint64_t limit)
+{
+	broker->lag_limit = limit;
+}
+
+/*
+ * Take the clients that are over the lag limit out of the heap, so that
+ * the others no longer wait behind them and the deleted objects they
+ * have not got to can be freed. They are told to flush when resynced, so
+ * only those that can be are taken out, stopping at the first that can
+ * not.
+ */
+static void broker_lag_check(struct broker *broker)
+{
+	struct broker_client *client;
+
+	if (!broker->lag_limit)
+		return;
+
+	while (broker->client_heap_count &&
+	       broker->id - broker_min_client_id(broker) > broker->lag_limit) {
+		client = broker->client_heap[0];
+		if (!client->client_ops.flush)
+			break;
+		broker_heap_remove(broker, client);
+		client->flags |= BROKER_CLIENT_OVERRUN;
+	}
+}
+
+/*
+ * The tombstone list is in id order, so the objects that no client needs
+ * any more are all at the front of it. Free at most 'budget' of them so
+ * that the time taken is bounded no matter how many have built up.
+ */
+bool broker_reclaim(struct broker *broker, unsigned int budget)
+{
+	struct broker_obj *entry;
+
+	broker_lag_check(broker);
+
+	while ((entry = TAILQ_FIRST(&broker->b_tomb_list_head))) {
+		if (!no_clients_need_this(broker, entry))
+			return false;
+		if (budget-- == 0)
+			return true;
+		broker_del_obj_now(broker, entry);
+	}
+
+	return false;
 }
 
 struct broker_client *broker_client_create(struct broker *broker,
@@ -170,8 +667,11 @@ struct broker_client *broker_client_create(struct broker *broker,
 	client->broker_obj.flags = BROKER_FLAGS_CLIENT;
 
 	CIRCLEQ_INSERT_HEAD(&broker->b_client_list_head, client, client_list);
-	CIRCLEQ_INSERT_HEAD(&broker->b_obj_list_head, &client->broker_obj,
-			    b_obj_list);
+	if (!broker_is_seq_log(broker))
+		CIRCLEQ_INSERT_HEAD(&broker->b_obj_list_head,
+				    &client->broker_obj, b_obj_list);
+	else
+		client->seq_gen = broker->seq_log_gen;
 
 	/*
 	 * If there is no data for this client then make the ID the same as the
@@ -182,36 +682,42 @@ struct broker_client *broker_client_create(struct broker *broker,
 	if (!broker_has_more_data(client))
 		client->broker_obj.id = broker->id;
 
+	if (broker_heap_insert(broker, client)) {
+		CIRCLEQ_REMOVE(&broker->b_client_list_head, client,
+			       client_list);
+		if (!broker_is_seq_log(broker))
+			CIRCLEQ_REMOVE(&broker->b_obj_list_head,
+				       &client->broker_obj, b_obj_list);
+		free(client->name);
+		free(client);
+		return NULL;
+	}
+
 	return client;
 }
 
 void broker_client_delete(struct broker_client *client)
 {
-	struct broker_obj *b_obj;
-	struct broker_obj *temp = NULL;
 	struct broker *broker = client->broker;
 
+	if (client->resync)
+		broker_snapshot_end(client->resync);
+	if (!(client->flags & BROKER_CLIENT_OVERRUN))
+		broker_heap_remove(broker, client);
 	CIRCLEQ_REMOVE(&client->broker->b_client_list_head,
 		       client, client_list);
-	CIRCLEQ_REMOVE(&client->broker->b_obj_list_head,
-		       &client->broker_obj, b_obj_list);
+	if (!broker_is_seq_log(broker))
+		CIRCLEQ_REMOVE(&client->broker->b_obj_list_head,
+			       &client->broker_obj, b_obj_list);
 	free(client->name);
 	free(client);
 
-	/* Walk the objects to see if there is stuff we can delete now. */
-	b_obj = CIRCLEQ_FIRST(&broker->b_obj_list_head);
-	while (b_obj != (struct broker_obj *)&broker->b_obj_list_head) {
-		temp = b_obj;
-		if ((b_obj->flags & BROKER_FLAGS_OBJ) &&
-		    (b_obj->flags & BROKER_FLAGS_DELETE)) {
-			if (no_clients_need_this(broker, b_obj)) {
-				/* remove it, so keep track of obj before */
-				temp = CIRCLEQ_PREV(b_obj, b_obj_list);
-				broker_del_obj_now(broker, b_obj);
-			}
-		}
-		b_obj = CIRCLEQ_NEXT(temp, b_obj_list);
-	}
+	/*
+	 * The watermark may have moved on, freeing up deleted objects. Only
+	 * do a bounded amount of that here, the rest is picked up by later
+	 * reclaim steps.
+	 */
+	broker_reclaim(broker, BROKER_RECLAIM_STEP);
 }
 
 static struct broker_obj *broker_get_next_data_obj(struct broker *broker,
@@ -227,9 +733,185 @@ static struct broker_obj *broker_get_next_data_obj(struct broker *broker,
 	return NULL;
 }
 
+/*
+ * The next object for a client after 'prev', or after the client's own
+ * position if 'prev' is NULL. For the seq log 'pos' is the log index of
+ * 'prev' on the way in and of the returned object on the way out.
+ */
+static struct broker_obj *broker_client_next_obj(struct broker_client *client,
+						 struct broker_obj *prev,
+						 size_t *pos)
+{
+	struct broker *broker = client->broker;
+	size_t i;
+
+	if (!broker_is_seq_log(broker))
+		return broker_get_next_data_obj(broker, prev ? prev :
+						&client->broker_obj);
+
+	if (!prev)
+		return broker_seq_client_next(client, pos);
+
+	for (i = *pos + 1; i < broker->seq_log_count; i++) {
+		if (broker->seq_log[i].obj) {
+			*pos = i;
+			return broker->seq_log[i].obj;
+		}
+	}
+	return NULL;
+}
+
+/* Move the client on to just after the given object. */
+static void broker_client_advance(struct broker_client *client,
+				  struct broker_obj *broker_obj, size_t pos)
+{
+	struct broker *broker = client->broker;
+
+	if (broker_is_seq_log(broker)) {
+		client->seq_pos = pos + 1;
+		client->seq_gen = broker->seq_log_gen;
+	} else {
+		CIRCLEQ_REMOVE(&broker->b_obj_list_head, &client->broker_obj,
+			       b_obj_list);
+		CIRCLEQ_INSERT_AFTER(&broker->b_obj_list_head, broker_obj,
+				     &client->broker_obj, b_obj_list);
+	}
+	broker_client_set_id(client, broker_obj->id);
+}
+
 bool broker_has_more_data(struct broker_client *client)
 {
-	return broker_get_next_data_obj(client->broker, &client->broker_obj);
+	size_t pos;
+
+	return broker_client_next_obj(client, NULL, &pos);
+}
+
+struct broker_obj *broker_client_peek(struct broker_client *client)
+{
+	size_t pos;
+
+	if (client->resync || client->restart ||
+	    (client->flags & BROKER_CLIENT_OVERRUN))
+		return NULL;
+
+	return broker_client_next_obj(client, NULL, &pos);
+}
+
+bool broker_client_resyncing(struct broker_client *client)
+{
+	return client->resync || client->restart;
+}
+
+void broker_client_restart(struct broker_client *client)
+{
+	if (client->resync) {
+		broker_snapshot_end(client->resync);
+		client->resync = NULL;
+	}
+	client->restart = true;
+}
+
+/*
+ * Catch up a client that has been overrun, or is to start again. It moves
+ * to the top, and is given a snapshot of everything below that to work
+ * through first. An overrun client has missed deletes, so is told to
+ * flush what it has before then, unless it already has been.
+ */
+static void broker_client_resync(struct broker_client *client)
+{
+	struct broker *broker = client->broker;
+	struct broker_snapshot *snap;
+	int rc;
+
+	snap = broker_snapshot_start(broker);
+	if (!snap)
+		return;
+
+	if (client->resync)
+		broker_snapshot_end(client->resync);
+	client->resync = snap;
+
+	if (broker_is_seq_log(broker)) {
+		client->seq_pos = broker->seq_log_count;
+		client->seq_gen = broker->seq_log_gen;
+	} else {
+		CIRCLEQ_REMOVE(&broker->b_obj_list_head, &client->broker_obj,
+			       b_obj_list);
+		CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head,
+				    &client->broker_obj, b_obj_list);
+	}
+	/* Everything up to here is handed to it from the snapshot */
+	broker->seen_id = broker->id;
+
+	if (client->flags & BROKER_CLIENT_OVERRUN) {
+		client->broker_obj.id = broker->id;
+		/* There is still room in the heap from when it was taken out */
+		rc = broker_heap_insert(broker, client);
+		assert(rc == 0);
+		client->flags &= ~BROKER_CLIENT_OVERRUN;
+		client->flush = !client->restart;
+	} else {
+		broker_client_set_id(client, broker->id);
+	}
+	client->restart = false;
+	client->resyncs++;
+
+	broker_reclaim(broker, BROKER_RECLAIM_STEP);
+}
+
+/*
+ * The resync snapshot missed a change, so the client is overrun again
+ * from where it is now, and starts over with a new snapshot, and a flush
+ * of what it had of the last.
+ */
+static void broker_client_resync_again(struct broker_client *client)
+{
+	broker_heap_remove(client->broker, client);
+	client->flags |= BROKER_CLIENT_OVERRUN;
+}
+
+/*
+ * Hand out up to 'max' of the objects in the client's resync snapshot.
+ * The client has nothing from before it, so deleted and retired objects
+ * are left out.
+ */
+static unsigned int broker_client_get_resync(struct broker_client *client,
+					     void **data, unsigned int max)
+{
+	struct broker_snapshot_ent ents[BROKER_RESYNC_BATCH];
+	struct broker *broker = client->broker;
+	unsigned int count = 0;
+	unsigned int n;
+	unsigned int i;
+
+	while (count < max) {
+		n = max - count;
+		if (n > BROKER_RESYNC_BATCH)
+			n = BROKER_RESYNC_BATCH;
+		n = broker_snapshot_next(client->resync, ents, n);
+		if (!n) {
+			if (broker_snapshot_failed(client->resync))
+				broker_client_resync_again(client);
+			broker_snapshot_end(client->resync);
+			client->resync = NULL;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ents[i].flags &
+			    (BROKER_FLAGS_DELETE | BROKER_FLAGS_RETIRED))
+				continue;
+			if (client->client_ops.snap_obj)
+				data[count++] =
+					client->client_ops.snap_obj(&ents[i]);
+			else
+				data[count++] =
+					client->client_ops.add_obj(ents[i].obj);
+		}
+		broker_snapshot_put(broker, ents, n);
+	}
+
+	return count;
 }
 
 /*
@@ -238,38 +920,259 @@ bool broker_has_more_data(struct broker_client *client)
  */
 void *broker_client_get_data(struct broker_client *client)
 {
+	void *data = NULL;
+
+	broker_client_get_batch(client, &data, 1);
+	return data;
+}
+
+/*
+ * As broker_client_get_data() for up to 'max' objects. The client only
+ * moves once, after the last of them. A client that is resyncing is
+ * given what is left of its snapshot first.
+ */
+unsigned int broker_client_get_batch(struct broker_client *client,
+				     void **data, unsigned int max)
+{
+	struct broker *broker;
 	struct broker_obj *broker_obj;
-	void *data;
+	struct broker_obj *last = NULL;
+	unsigned int count = 0;
+	bool deleted = false;
+	size_t pos = 0;
 
 	if (!client)
-		return NULL;
+		return 0;
+
+	broker = client->broker;
+	if ((client->flags & BROKER_CLIENT_OVERRUN) || client->restart) {
+		broker_client_resync(client);
+		if ((client->flags & BROKER_CLIENT_OVERRUN) || client->restart)
+			return 0;
+	}
+
+	/* The flush goes on its own, so it can be seen for what it is */
+	if (client->flush) {
+		client->flush = false;
+		data[0] = client->client_ops.flush(client);
+		client->consumed++;
+		return 1;
+	}
 
-	broker_obj =
-	    broker_get_next_data_obj(client->broker, &client->broker_obj);
-	if (!broker_obj) {
+	if (client->resync) {
+		count = broker_client_get_resync(client, data, max);
+		if (count == max || (client->flags & BROKER_CLIENT_OVERRUN)) {
+			client->consumed += count;
+			return count;
+		}
+	}
+
+	while (count < max &&
+	       (broker_obj = broker_client_next_obj(client, last, &pos))) {
+		if (broker_obj->flags & BROKER_FLAGS_DELETE) {
+			data[count++] = client->client_ops.del_obj(broker_obj);
+			deleted = true;
+		} else {
+			data[count++] = client->client_ops.add_obj(broker_obj);
+			if (broker_obj->flags & BROKER_FLAGS_RETIRED)
+				deleted = true;
+		}
+		last = broker_obj;
+	}
+
+	if (!last) {
 		/* No more data. Ensure id up to date so don't keep asking */
-		client->broker_obj.id = client->broker->id;
-		return NULL;
+		if (broker_is_seq_log(broker)) {
+			client->seq_pos = pos;
+			client->seq_gen = broker->seq_log_gen;
+		}
+		broker_client_set_id(client, broker->id);
+	} else {
+		broker_client_advance(client, last, pos);
 	}
 
-	if (broker_obj->flags & BROKER_FLAGS_DELETE)
-		data = client->client_ops.del_obj(broker_obj);
+	if (deleted)
+		broker_reclaim(broker, BROKER_RECLAIM_STEP);
+
+	client->consumed += count;
+	return count;
+}
+
+struct broker_snapshot *broker_snapshot_start(struct broker *broker)
+{
+	struct broker_snapshot *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+
+	snap->broker = broker;
+	snap->pos = broker->id + 1;
+	snap->cursor.flags = BROKER_FLAGS_CURSOR;
+	snap->cursor.id = broker->id;
+
+	/* Anything added or moved from now on goes after the cursor */
+	CIRCLEQ_INSERT_TAIL(&broker->b_obj_list_head, &snap->cursor,
+			    b_obj_list);
+	LIST_INSERT_HEAD(&broker->b_snap_list_head, snap, snap_list);
+	return snap;
+}
+
+struct broker_snapshot *broker_snapshot_start_skip(struct broker *broker,
+						   struct broker_obj *lo,
+						   uint64_t hi)
+{
+	struct broker_snapshot *snap;
+
+	snap = broker_snapshot_start(broker);
+	if (!snap)
+		return NULL;
+
+	snap->skip_lo = lo ? lo->id : 0;
+	snap->skip_hi = hi;
+	snap->mark.flags = BROKER_FLAGS_CURSOR;
+	snap->mark.id = snap->skip_lo;
+	if (lo)
+		CIRCLEQ_INSERT_BEFORE(&broker->b_obj_list_head, lo,
+				      &snap->mark, b_obj_list);
 	else
-		data = client->client_ops.add_obj(broker_obj);
+		CIRCLEQ_INSERT_HEAD(&broker->b_obj_list_head, &snap->mark,
+				    b_obj_list);
+	snap->marked = true;
+	return snap;
+}
 
-	CIRCLEQ_REMOVE(&client->broker->b_obj_list_head, &client->broker_obj,
-		       b_obj_list);
-	CIRCLEQ_INSERT_AFTER(&client->broker->b_obj_list_head, broker_obj,
-			     &client->broker_obj, b_obj_list);
-	client->broker_obj.id = broker_obj->id;
+void broker_snapshot_set_limit(struct broker_snapshot *snap, size_t max)
+{
+	snap->saved_max = max;
+}
 
-	if (broker_obj->flags & BROKER_FLAGS_DELETE) {
-		if (no_clients_need_this(client->broker, broker_obj))
-			broker_del_obj_now(client->broker, broker_obj);
+static struct broker_obj *broker_get_prev_data_obj(struct broker *broker,
+						   struct broker_obj *b_obj)
+{
+	while ((b_obj = CIRCLEQ_PREV(b_obj, b_obj_list))) {
+		if (b_obj == (struct broker_obj *)&broker->b_obj_list_head)
+			return NULL;
+
+		if (b_obj->flags & BROKER_FLAGS_OBJ)
+			return b_obj;
 	}
+	return NULL;
+}
 
-	client->consumed++;
-	return data;
+static int broker_snapshot_ent_cmp(const void *a, const void *b)
+{
+	const struct broker_snapshot_ent *ent_a = a;
+	const struct broker_snapshot_ent *ent_b = b;
+
+	return (ent_a->id > ent_b->id) - (ent_a->id < ent_b->id);
+}
+
+/*
+ * Once the walk gets down to the objects left out, move the cursor to
+ * the mark below them to go on from there. Returns true if it did.
+ */
+static bool broker_snapshot_skip(struct broker_snapshot *snap,
+				 struct broker_obj *b_obj)
+{
+	struct broker *broker = snap->broker;
+
+	if (!snap->marked || (b_obj && b_obj->id > snap->skip_hi))
+		return false;
+
+	CIRCLEQ_REMOVE(&broker->b_obj_list_head, &snap->cursor, b_obj_list);
+	CIRCLEQ_INSERT_BEFORE(&broker->b_obj_list_head, &snap->mark,
+			      &snap->cursor, b_obj_list);
+	CIRCLEQ_REMOVE(&broker->b_obj_list_head, &snap->mark, b_obj_list);
+	snap->marked = false;
+	return true;
+}
+
+/*
+ * Walk down the object list from the cursor, merging in the saved
+ * objects, which all have ids below the last one handed out.
+ */
+unsigned int broker_snapshot_next(struct broker_snapshot *snap,
+				  struct broker_snapshot_ent *ents,
+				  unsigned int max)
+{
+	struct broker *broker = snap->broker;
+	struct broker_snapshot_ent *ent;
+	struct broker_obj *b_obj;
+	struct broker_obj *last = NULL;
+	unsigned int count = 0;
+
+	if (snap->failed)
+		return 0;
+
+	/* Saved objects are handed out from the end, highest id first */
+	if (snap->saved_count > 1)
+		qsort(snap->saved, snap->saved_count, sizeof(*snap->saved),
+		      broker_snapshot_ent_cmp);
+
+	b_obj = broker_get_prev_data_obj(broker, &snap->cursor);
+	if (broker_snapshot_skip(snap, b_obj))
+		b_obj = broker_get_prev_data_obj(broker, &snap->cursor);
+	while (count < max) {
+		ent = &ents[count];
+		if (snap->saved_count &&
+		    (!b_obj || snap->saved[snap->saved_count - 1].id > b_obj->id)) {
+			*ent = snap->saved[--snap->saved_count];
+		} else if (b_obj) {
+			broker_snapshot_ent_fill(broker, ent, b_obj);
+			last = b_obj;
+			b_obj = broker_get_prev_data_obj(broker, b_obj);
+			if (broker_snapshot_skip(snap, b_obj)) {
+				/* The cursor is already where it goes on from */
+				last = NULL;
+				b_obj = broker_get_prev_data_obj(broker,
+								 &snap->cursor);
+			}
+		} else {
+			break;
+		}
+		snap->pos = ent->id;
+		count++;
+	}
+
+	if (last) {
+		CIRCLEQ_REMOVE(&broker->b_obj_list_head, &snap->cursor,
+			       b_obj_list);
+		CIRCLEQ_INSERT_BEFORE(&broker->b_obj_list_head, last,
+				      &snap->cursor, b_obj_list);
+	}
+	return count;
+}
+
+void broker_snapshot_put(struct broker *broker,
+			 struct broker_snapshot_ent *ents, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (ents[i].data)
+			broker->ops.put_data(ents[i].data);
+		broker->ops.unlock_obj(ents[i].obj);
+	}
+}
+
+bool broker_snapshot_failed(struct broker_snapshot *snap)
+{
+	return snap->failed;
+}
+
+void broker_snapshot_end(struct broker_snapshot *snap)
+{
+	struct broker *broker = snap->broker;
+
+	CIRCLEQ_REMOVE(&broker->b_obj_list_head, &snap->cursor, b_obj_list);
+	if (snap->marked)
+		CIRCLEQ_REMOVE(&broker->b_obj_list_head, &snap->mark,
+			       b_obj_list);
+	LIST_REMOVE(snap, snap_list);
+	broker_snapshot_put(broker, snap->saved, snap->saved_count);
+	free(snap->saved);
+	free(snap);
 }
 
 struct broker_obj *broker_seq_start(struct broker *broker)
@@ -17,12 +17,19 @@
 #define BROKER_FLAGS_OBJ     0x1
 #define BROKER_FLAGS_CLIENT  0x2
 #define BROKER_FLAGS_DELETE  0x4
+#define BROKER_FLAGS_CURSOR  0x8
+/* A client has had an earlier version of the object */
+#define BROKER_FLAGS_SEEN    0x10
+/* Kept only for clients still to get to it, see broker_retire_obj() */
+#define BROKER_FLAGS_RETIRED 0x20
 
 /*
  * Each object added to a broker must contain one of these structures.
  */
 struct broker_obj {
 	CIRCLEQ_ENTRY(broker_obj) b_obj_list;
+	/* Position in the tombstone list while marked for deletion */
+	TAILQ_ENTRY(broker_obj) b_tomb_list;
 	uint32_t obj_type;
 	uint32_t flags;
 	uint64_t id;
@@ -38,23 +45,76 @@ struct broker_obj {
  *     it for as long as it needs.
  * void (*unlock_obj)(struct broker_obj *);
  *     Callback used to release a lock taken on an object.
+ * void *(*get_data)(struct broker_obj *);
+ *     Optional. Callback used to take a ref on the data the object has
+ *     now, for a snapshot entry to keep as it was.
+ * void (*put_data)(void *data);
+ *     Callback used to release a ref taken by get_data.
  */
 struct broker_ops {
 	struct broker_obj *(*obj_to_broker_obj)(void *obj, int type);
 	void *(*broker_obj_to_obj)(struct broker_obj *ca_obj);
 	void (*lock_obj)(struct broker_obj *);
 	void (*unlock_obj)(struct broker_obj *);
+	void *(*get_data)(struct broker_obj *);
+	void (*put_data)(void *data);
 };
 
+/*
+ * Broker creation flags
+ *
+ * BROKER_CREATE_SEQ_LOG: keep client positions as plain sequence ids
+ *     looked up in an id ordered log of the objects, rather than as
+ *     markers in the object list. Moving a client on is then a read only
+ *     walk of the log, and the object list only contains objects.
+ */
+#define BROKER_CREATE_SEQ_LOG 0x1
+
+struct broker_seq_ent;
+struct broker_snapshot;
+
 #define BROKER_MAX_NAME_LEN 16
 struct broker {
 	CIRCLEQ_ENTRY(broker) brokers_list;
 	CIRCLEQ_HEAD(b_obj_list, broker_obj) b_obj_list_head;
+	/* Objects marked for deletion, in id order (oldest first) */
+	TAILQ_HEAD(b_tomb_list, broker_obj) b_tomb_list_head;
+	uint64_t tomb_count;
 	struct broker_ops ops;
 	size_t type_count;
 	CIRCLEQ_HEAD(b_client_list, broker_client) b_client_list_head;
+	/*
+	 * Min-heap of the clients keyed on their position, so that the
+	 * slowest client (the low watermark) is always at index 0.
+	 */
+	struct broker_client **client_heap;
+	size_t client_heap_count;
+	size_t client_heap_size;
+	unsigned int create_flags;
+	/*
+	 * BROKER_CREATE_SEQ_LOG only. The log is sorted by id, entries for
+	 * objects that have since moved or gone have a NULL obj, and are
+	 * squeezed out when the log fills up (bumping the generation).
+	 */
+	struct broker_seq_ent *seq_log;
+	size_t seq_log_count;
+	size_t seq_log_size;
+	size_t seq_log_live;
+	uint64_t seq_log_gen;
+	/* Snapshots that are part way through being walked */
+	LIST_HEAD(b_snap_list, broker_snapshot) b_snap_list_head;
+	/* How far behind a client can get before it is resynced, 0 if no limit */
+	uint64_t lag_limit;
 	uint64_t id;
 	uint64_t imp_dels;
+	/*
+	 * The highest id any client has got to. Nothing above it has been
+	 * seen by a client since it last moved.
+	 */
+	uint64_t seen_id;
+	/* Deletes and updates of objects no client had seen yet */
+	uint64_t unseen_dels;
+	uint64_t unseen_upds;
 };
 
 /*
@@ -64,14 +124,62 @@ struct broker {
 struct broker *broker_create(const struct broker_ops *broker_ops,
 			     size_t type_count);
 
+/* As broker_create(), with BROKER_CREATE_* flags */
+struct broker *broker_create_flags(const struct broker_ops *broker_ops,
+				   size_t type_count, unsigned int flags);
+
 /* ret 0 == success */
 int broker_delete(struct broker *broker);
 
-void broker_add_obj(struct broker *broker, void *obj, int type);
+/*
+ * Returns -ENOMEM, leaving the object out of the broker, if there is no
+ * room to track it.
+ */
+int broker_add_obj(struct broker *broker, void *obj, int type);
+/*
+ * Deleting an object that no client has seen yet removes it there and
+ * then, and updating one leaves it where it is, as the clients will all
+ * pick it up as it is when they get to it.
+ */
 void broker_del_obj(struct broker *broker, void *obj, int type);
 void broker_upd_obj(struct broker *broker, void *obj, int type);
-/* Delete this obj without updating clients about it */
-void broker_del_obj_now(struct broker *broker, struct broker_obj *entry);
+/*
+ * Delete this obj without updating clients about it. Returns true if
+ * any client had seen it, in which case an object that replaces it in
+ * another broker should be marked with BROKER_FLAGS_SEEN.
+ */
+bool broker_del_obj_now(struct broker *broker, struct broker_obj *entry);
+/*
+ * Take an object out of use without clients being told it went. It is
+ * left where it is for the clients still to get to it, as something they
+ * need before what came after it, and removed once they have, as if
+ * deleted. A client resynced in the meantime is not given it. Returns
+ * false if it is removed now and no client had it.
+ */
+bool broker_retire_obj(struct broker *broker, struct broker_obj *entry);
+
+/*
+ * Let clients get at most 'limit' ids behind the newest object, 0 for no
+ * limit. A client that gets further behind is no longer walked through
+ * each change, and no deleted object is kept for it. When it next asks
+ * for data it is given the data from its flush op, telling it to forget
+ * all the objects it has, then all of the objects there are, newest
+ * first, before carrying on as normal. Only clients with a flush op are
+ * held to the limit.
+ */
+void broker_set_lag_limit(struct broker *broker, uint64_t limit);
+
+/*
+ * Number of deleted objects freed by each incremental reclaim step that
+ * the broker runs as objects are added or consumed.
+ */
+#define BROKER_RECLAIM_STEP 16
+
+/*
+ * Free up to 'budget' deleted objects that no client still needs.
+ * Returns true if there are more that could be freed now.
+ */
+bool broker_reclaim(struct broker *broker, unsigned int budget);
 
 /*
  * void *(*add_obj)(struct broker_obj *);
@@ -81,12 +189,26 @@ void broker_del_obj_now(struct broker *broker, struct broker_obj *entry);
  * void *(*del_obj)(struct broker_obj *);
  *     Callback that is called when a client asks for data and the next object
  *     has been marked for deletion.
+ * void *(*snap_obj)(struct broker_snapshot_ent *);
+ *     Optional. Called in place of the above for an object handed to a
+ *     client from its resync snapshot, as the object was in the snapshot.
+ * void *(*flush)(struct broker_client *);
+ *     Optional. Called for the data that tells a client that has been
+ *     overrun to forget the objects it has, before it is resynced. Only
+ *     clients with one can be overrun.
  */
+struct broker_snapshot_ent;
+
 struct broker_client_ops {
 	void *(*add_obj)(struct broker_obj *);
 	void *(*del_obj)(struct broker_obj *);
+	void *(*snap_obj)(struct broker_snapshot_ent *);
+	void *(*flush)(struct broker_client *);
 };
 
+/* Broker client flags */
+#define BROKER_CLIENT_OVERRUN 0x1	/* Over the lag limit, needs resync */
+
 struct broker_client {
 	struct broker *broker;
 	struct broker_client_ops client_ops;
@@ -95,6 +217,17 @@ struct broker_client {
 	unsigned int flags;
 	uint64_t id;
 	uint64_t consumed;
+	size_t heap_idx;
+	/* BROKER_CREATE_SEQ_LOG: log index to resume from, if gen matches */
+	size_t seq_pos;
+	uint64_t seq_gen;
+	/* Objects still to be handed out to catch up after an overrun */
+	struct broker_snapshot *resync;
+	/* To start again from a snapshot, without a flush */
+	bool restart;
+	/* To be handed the flush before the resync snapshot */
+	bool flush;
+	uint64_t resyncs;
 	char *name;
 };
 
@@ -107,9 +240,93 @@ void broker_client_delete(struct broker_client *broker_client);
 /* Get the next data from the next object in the list */
 void *broker_client_get_data(struct broker_client *broker_client);
 
+/*
+ * Get the data from up to 'max' of the next objects in the list.
+ * Returns how many entries of 'data' were filled in.
+ */
+unsigned int broker_client_get_batch(struct broker_client *broker_client,
+				     void **data, unsigned int max);
+
 /* Is there any more data for this client? */
 bool broker_has_more_data(struct broker_client *broker_client);
 
+/*
+ * The object the client will be given next, without moving it on. NULL
+ * if there is none, or if the client is to be resynced or is resyncing.
+ */
+struct broker_obj *broker_client_peek(struct broker_client *broker_client);
+
+/*
+ * Is the client part way through catching up after an overrun, or to
+ * start again? Only changed by the client asking for data or restarting.
+ */
+bool broker_client_resyncing(struct broker_client *broker_client);
+
+/*
+ * Have the client start again from a snapshot of all the objects, next
+ * time it asks for data, without being told to flush. For a client that
+ * has been told to by another broker.
+ */
+void broker_client_restart(struct broker_client *broker_client);
+
+/*
+ * An object as it was when a snapshot was taken. The object is locked
+ * until the entry is given back with broker_snapshot_put(), so it can be
+ * looked at without holding the broker still, but only the fields here
+ * reflect the time of the snapshot. The data is from the get_data op, if
+ * the broker has one, and is held until then too.
+ */
+struct broker_snapshot_ent {
+	uint64_t id;
+	uint32_t obj_type;
+	uint32_t flags;
+	struct broker_obj *obj;
+	void *data;
+};
+
+/*
+ * Take a snapshot of the objects in the broker. The objects are then
+ * handed out a page at a time, newest first, as they were when the
+ * snapshot was taken. The broker can be changed between pages, objects
+ * that change before they have been handed out are remembered by the
+ * snapshot until then.
+ */
+struct broker_snapshot *broker_snapshot_start(struct broker *broker);
+
+/*
+ * As broker_snapshot_start(), leaving out the objects from 'lo' up to id
+ * 'hi' that are still as they were, all those up to 'hi' if 'lo' is
+ * NULL. They are skipped over without being walked, for a snapshot that
+ * goes on from where one before got to.
+ */
+struct broker_snapshot *broker_snapshot_start_skip(struct broker *broker,
+						   struct broker_obj *lo,
+						   uint64_t hi);
+
+/*
+ * Fail the snapshot rather than save more than 'max' objects that change
+ * before they are handed out, 0 for no limit.
+ */
+void broker_snapshot_set_limit(struct broker_snapshot *snap, size_t max);
+
+/* Fill in up to 'max' entries. Returns 0 once all have been handed out */
+unsigned int broker_snapshot_next(struct broker_snapshot *snap,
+				  struct broker_snapshot_ent *ents,
+				  unsigned int max);
+
+/* Give back entries handed out by broker_snapshot_next() */
+void broker_snapshot_put(struct broker *broker,
+			 struct broker_snapshot_ent *ents, unsigned int count);
+
+/*
+ * Did the snapshot stop early, for want of memory to save an object that
+ * changed, or having saved as many as its limit? broker_snapshot_next()
+ * then hands out no more.
+ */
+bool broker_snapshot_failed(struct broker_snapshot *snap);
+
+void broker_snapshot_end(struct broker_snapshot *snap);
+
 struct broker_obj *broker_seq_start(struct broker *broker);
 struct broker_obj *broker_seq_next(struct broker *broker,
 				   struct broker_obj *ca_obj);
@@ -11,32 +11,136 @@
 #include <stddef.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <zlib.h>
 
 #include "broker.h"
 #include "route_broker_internal.h"
+#include "route_hashtbl.h"
+#include "route_pool.h"
 
 #include <czmq.h>
+#include <zmq.h>
 
 void *route_broker_log_arg;
 route_broker_fmt_cb route_broker_log_debug;
 route_broker_fmt_cb route_broker_log_error;
 route_broker_log_cb route_broker_log_dp_detail;
 object_broker_topic_gen_cb route_broker_topic_gen;
+object_broker_key_gen_cb route_broker_key_gen;
 object_broker_copy_obj_cb route_broker_copy_obj;
 object_broker_free_obj_cb route_broker_free_obj;
+object_broker_obj_type_cb route_broker_obj_type;
+object_broker_obj_size_cb route_broker_obj_size;
+const void *route_broker_flush_obj;
 bool *route_broker_is_log_detail;
 
+/* The broker's copy of the flush object, NULL if there is none */
+static struct rib_data *route_broker_flush_data;
+
+/*
+ * Routes added or updated, so that a nexthop group can tell if any have
+ * been since it was, which could be using it. Only touched atomically.
+ */
+static uint32_t route_broker_route_adds;
+
+/* Updated without a lock, so only ever touched atomically */
 static uint64_t processed_msg;
 static uint64_t ignored_msg;
 static uint64_t dropped_msg;
+/* Frames packed for dataplanes, and those sent again to others */
+static uint64_t rib_nl_dp_frames_packed;
+static uint64_t rib_nl_dp_frames_shared;
+/* Frames compressed for dataplanes, and the bytes before and after */
+static uint64_t rib_nl_dp_deflated;
+static uint64_t rib_nl_dp_deflate_in;
+static uint64_t rib_nl_dp_deflate_out;
+
+#define route_broker_count(counter) \
+	__atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+/*
+ * Each priority level has its own lock, and the key hash is split
+ * into shards that each have their own lock. When more than one is
+ * needed they are taken in the order: levels, lowest first, then a
+ * shard. Only one shard is ever held at a time.
+ */
+struct broker *route_broker[ROUTE_BROKER_LEVELS_MAX];
+static pthread_mutex_t route_broker_mutex[ROUTE_BROKER_LEVELS_MAX] = {
+	[0 ... ROUTE_BROKER_LEVELS_MAX - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+/* Route priority levels, set along with the scheduling when created */
+int route_broker_priorities = ROUTE_PRIORITY_MAX;
+/*
+ * Copy of the id of each broker, so that clients can see if there is
+ * anything for them without taking the lock.
+ */
+static uint64_t route_broker_top[ROUTE_BROKER_LEVELS_MAX];
+
+/*
+ * The order clients take objects from the levels in when the scheduling
+ * is strict, nexthop groups and then the route levels in priority order.
+ */
+static int route_broker_drain[ROUTE_BROKER_LEVELS_MAX];
+
+static enum route_broker_sched_type route_broker_sched_type;
+static uint32_t route_broker_quantum[ROUTE_BROKER_LEVELS_MAX];
+
+/* Default quantum, in objects for WRR and bytes for DRR */
+#define ROUTE_BROKER_WRR_QUANTUM ROUTE_BROKER_BATCH
+#define ROUTE_BROKER_DRR_QUANTUM (ROUTE_BROKER_BATCH * 256)
+
+/* Updated by clients without a lock, so only ever touched atomically */
+static uint64_t route_broker_served[ROUTE_BROKER_LEVELS_MAX];
+static uint64_t route_broker_turns[ROUTE_BROKER_LEVELS_MAX];
+
+#define ROUTE_HASH_SHARD_BITS 6
+#define ROUTE_HASH_SHARDS (1 << ROUTE_HASH_SHARD_BITS)
 
-struct broker *route_broker[ROUTE_PRIORITY_MAX];
-zhash_t *route_hashtbl;
-static pthread_mutex_t route_broker_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct route_hash_shard {
+	pthread_mutex_t mutex;
+	struct route_hashtbl *hash;
+};
+
+static struct route_hash_shard route_hash[ROUTE_HASH_SHARDS];
+
+/* Protects the client list, which publishers walk to wake clients */
+static pthread_rwlock_t route_broker_client_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Routes that have been released by this thread while it held a level
+ * lock. They are freed once the thread has dropped its locks, as that
+ * needs the hash shard lock.
+ */
+static __thread struct rib_route *route_dead_list;
+
+/* Deleted objects freed per lock hold when a client goes away */
+#define ROUTE_BROKER_RECLAIM_BATCH 1024
+
+/* Objects taken from a snapshot per lock hold when showing */
+#define ROUTE_BROKER_SHOW_BATCH 256
+
+/* Objects applied per lock hold by a batch publish */
+#define ROUTE_BROKER_PUBLISH_BATCH 64
+
+/* Most bytes of netlink messages packed into a frame for a dataplane */
+#define RIB_NL_DP_BATCH_BYTES (64 * 1024)
+
+/* Frames packed for a dataplane that are kept to send others */
+#define RIB_NL_DP_FRAMES 4
+
+/*
+ * Batches of fewer messages than this are not compressed, as they are
+ * those sent to a dataplane that has caught up.
+ */
+#define RIB_NL_DP_DEFLATE_MIN 16
 
 #define container_of(pointer, container, member) \
 	((container *)(((unsigned char *)(pointer)) - \
@@ -44,28 +148,174 @@ static pthread_mutex_t route_broker_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 CIRCLEQ_HEAD(client_list, route_broker_client) client_list_head;
 
-static inline void route_broker_lock(void)
+static inline void route_broker_lock(int pri)
+{
+	pthread_mutex_lock(&route_broker_mutex[pri]);
+}
+
+static inline void route_broker_unlock(int pri)
+{
+	pthread_mutex_unlock(&route_broker_mutex[pri]);
+}
+
+static void route_broker_lock_all(void)
+{
+	int i;
+
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++)
+		route_broker_lock(i);
+}
+
+static void route_broker_unlock_all(void)
+{
+	int i;
+
+	for (i = ROUTE_BROKER_LEVELS - 1; i >= 0; i--)
+		route_broker_unlock(i);
+}
+
+/* The top bits pick the shard, leaving the rest spread for the hash */
+static struct route_hash_shard *route_hash_shard(const struct rib_route *route)
+{
+	return &route_hash[route->hash >> (32 - ROUTE_HASH_SHARD_BITS)];
+}
+
+/* Make the route the one in the hash for its key */
+static void route_hash_set(struct route_hash_shard *shard,
+			   struct rib_route *route)
 {
-	pthread_mutex_lock(&route_broker_mutex);
+	if (route_hashtbl_set(shard->hash, route))
+		broker_log_err("Failed to add route to hash\n");
 }
 
-static inline void route_broker_unlock(void)
+static struct rib_route *rib_route_create(const uint8_t *key, size_t key_len)
 {
-	pthread_mutex_unlock(&route_broker_mutex);
+	struct rib_route *route;
+
+	route = route_pool_alloc(sizeof(*route) + key_len);
+	if (!route)
+		return NULL;
+
+	memset(route, 0, sizeof(*route));
+	memcpy(route->key, key, key_len);
+	route->key_len = key_len;
+	route->hash = route_key_hash(key, key_len);
+	return route;
 }
 
-static struct rib_route *rib_route_create(void)
+/* Take the broker's copy of an object, which is the only one if shared */
+static struct rib_data *rib_data_create(const void *obj)
 {
-	return calloc(sizeof(struct rib_route), 1);
+	struct rib_data *data;
+	size_t size = 0;
+
+	if (route_broker_obj_size)
+		size = route_broker_obj_size(obj);
+
+	data = route_pool_alloc(sizeof(*data) + size);
+	if (!data)
+		return NULL;
+
+	if (route_broker_obj_size) {
+		memcpy(data->payload, obj, size);
+		data->obj = data->payload;
+	} else {
+		data->obj = route_broker_copy_obj(obj);
+		if (!data->obj) {
+			route_pool_free(data);
+			return NULL;
+		}
+	}
+	data->refcount = 1;
+	data->attrs.scanned = false;
+	return data;
 }
 
+/*
+ * The key for the object in the data. The attributes of a netlink object
+ * are kept from making the key, and used again for its topic.
+ */
+static int rib_data_key(struct rib_data *data, uint8_t *key, size_t len,
+			bool *del)
+{
+	int rc;
+
+	if (route_broker_key_gen == route_key_gen)
+		return route_key_gen_attrs(data->obj, &data->attrs, key, len,
+					   del);
+	if (route_broker_key_gen)
+		return route_broker_key_gen(data->obj, key, len, del);
+
+	if (route_broker_topic_gen == route_topic)
+		rc = route_topic_attrs(data->obj, &data->attrs, (char *)key,
+				       len, del);
+	else
+		rc = route_broker_topic_gen(data->obj, (char *)key, len, del);
+	if (rc >= (int)len)
+		rc = len - 1;
+	return rc;
+}
+
+static int rib_data_topic(struct rib_data *data, char *topic, size_t len)
+{
+	bool del;
+
+	if (data->attrs.scanned)
+		return route_topic_attrs(data->obj, &data->attrs, topic, len,
+					 &del);
+	return route_broker_topic_gen(data->obj, topic, len, &del);
+}
+
+static struct rib_data *rib_data_get(struct rib_data *data)
+{
+	__atomic_add_fetch(&data->refcount, 1, __ATOMIC_RELAXED);
+	return data;
+}
+
+/* Can be called without the lock */
+static void rib_data_put(struct rib_data *data)
+{
+	if (__atomic_sub_fetch(&data->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (data->obj != data->payload)
+			route_broker_free_obj(data->obj);
+		route_pool_free(data);
+	}
+}
+
+/*
+ * The refs on a route are taken under the lock of the level it is in
+ * at the time, which changes if it moves level, so are atomic.
+ */
 static void rib_route_delete(struct rib_route *obj)
 {
 	assert(obj);
-	if (--obj->refcount == 0) {
-		zhash_delete(route_hashtbl, obj->topic);
-		route_broker_free_obj(obj->data);
-		free(obj);
+	if (__atomic_sub_fetch(&obj->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		obj->dead_next = route_dead_list;
+		route_dead_list = obj;
+	}
+}
+
+/* Free the routes released by this thread. Must hold no locks. */
+static void route_broker_free_dead(void)
+{
+	struct route_hash_shard *shard;
+	struct rib_route *obj;
+
+	while ((obj = route_dead_list)) {
+		route_dead_list = obj->dead_next;
+
+		/*
+		 * A show may have held on to the route after it left the
+		 * broker, by which time the key may be in use again.
+		 */
+		shard = route_hash_shard(obj);
+		pthread_mutex_lock(&shard->mutex);
+		if (route_hashtbl_lookup(shard->hash, obj) == obj)
+			route_hashtbl_delete(shard->hash, obj);
+		pthread_mutex_unlock(&shard->mutex);
+
+		rib_data_put(obj->data);
+		route_pool_free(obj);
 	}
 }
 
@@ -91,7 +341,7 @@ static void rib_route_lock(struct broker_obj *b_obj)
 	struct rib_route *obj;
 
 	obj = broker_obj_to_rib_route(b_obj);
-	obj->refcount++;
+	__atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void rib_route_unlock(struct broker_obj *b_obj)
@@ -102,96 +352,455 @@ static void rib_route_unlock(struct broker_obj *b_obj)
 	rib_route_delete(obj);
 }
 
-static void route_broker_seq_show(route_broker_fmt_cb cli_out, void *cli,
-				  struct broker_obj *b_obj, bool show_obj)
+static void route_broker_client_show(route_broker_fmt_cb cli_out, void *cli,
+				     struct broker_client *client)
 {
-	struct rib_route *route;
-	struct broker_client *client;
+	cli_out(cli,
+		"ID:%-10" PRIu64 "   %s consumed:%" PRIu64 " behind:%"
+		PRIu64 " resyncs:%" PRIu64 "%s\n", client->broker_obj.id,
+		client->name, client->consumed,
+		client->broker->id - client->broker_obj.id, client->resyncs,
+		(client->flags & BROKER_CLIENT_OVERRUN) ? " overrun" : "");
+}
 
-	if (b_obj->flags & BROKER_FLAGS_OBJ) {
-		if (show_obj) {
-			route = broker_obj_to_rib_route(b_obj);
-			cli_out(cli, "ID:%-10" PRIu64 " %s %s\n",
-				b_obj->id,
-				(b_obj->flags & BROKER_FLAGS_DELETE) ?
-				 "D" : " ",
-				route->topic);
-		}
+/* The topic is only generated here, from the data the entry holds */
+static void route_broker_snapshot_show(route_broker_fmt_cb cli_out, void *cli,
+				       struct broker_snapshot_ent *ent)
+{
+	struct rib_data *data = ent->data;
+	char topic[ROUTE_TOPIC_LEN];
 
-	} else {
-		/* is a client */
-		client = container_of(b_obj, struct broker_client, broker_obj);
-		cli_out(cli,
-			"ID:%-10" PRIu64 "   %s consumed:%" PRIu64 " behind:%"
-			PRIu64 "\n", b_obj->id, client->name, client->consumed,
-			client->broker->id - b_obj->id);
-	}
+	if (rib_data_topic(data, topic, sizeof(topic)) <= 0)
+		strcpy(topic, "?");
+
+	cli_out(cli, "ID:%-10" PRIu64 " %s %s\n", ent->id,
+		(ent->flags & BROKER_FLAGS_DELETE) ? "D" : " ",
+		topic);
+}
+
+/*
+ * The snapshot walk only hands out objects, so the clients are listed
+ * with the priority level instead.
+ */
+static void route_broker_level_show(route_broker_fmt_cb cli_out, void *cli,
+				    int pri, uint64_t top)
+{
+	struct broker *broker = route_broker[pri];
+	struct broker_client *client;
+	uint64_t served = __atomic_load_n(&route_broker_served[pri],
+					  __ATOMIC_RELAXED);
+	uint64_t turns = __atomic_load_n(&route_broker_turns[pri],
+					 __ATOMIC_RELAXED);
+
+	/* Unseen are changes made before any client had got to them */
+	if (pri == ROUTE_BROKER_NHG_LEVEL)
+		cli_out(cli, "\nNexthop groups, top: %" PRIu64
+			" unseen dels:%" PRIu64 " upds:%" PRIu64
+			" served:%" PRIu64 " turns:%" PRIu64 "\n",
+			top, broker->unseen_dels, broker->unseen_upds,
+			served, turns);
+	else
+		cli_out(cli, "\nPriority %d, top: %" PRIu64
+			" unseen dels:%" PRIu64 " upds:%" PRIu64
+			" served:%" PRIu64 " turns:%" PRIu64
+			" quantum:%" PRIu32 "\n",
+			pri, top, broker->unseen_dels, broker->unseen_upds,
+			served, turns, route_broker_quantum[pri]);
+
+	CIRCLEQ_FOREACH(client, &broker->b_client_list_head, client_list)
+		route_broker_client_show(cli_out, cli, client);
 }
 
 void *route_broker_seq_first(int *pri)
 {
+	struct broker_obj *b_obj;
+
 	*pri = 0;
-	return broker_seq_start(route_broker[*pri]);
+	b_obj = broker_seq_start(route_broker[*pri]);
+	if (!b_obj)
+		return route_broker_seq_next(NULL, pri);
+
+	return b_obj;
 }
 
 void *route_broker_seq_next(void *obj, int *pri)
 {
-	struct broker_obj *b_obj;
+	struct broker_obj *b_obj = NULL;
+
+	if (obj)
+		b_obj = broker_seq_next(route_broker[*pri], obj);
+
+	/*
+	 * end of this broker - is there another priority level? Without
+	 * client markers a level can be empty, so keep looking. Only the
+	 * route priority levels are walked, not the nexthop groups.
+	 */
+	while (!b_obj && *pri < (ROUTE_BROKER_NHG_LEVEL - 1)) {
+		(*pri)++;
+		/* TODO - put a separator in here ? */
+		b_obj = broker_seq_start(route_broker[*pri]);
+	}
+
+	return b_obj;
+}
+
+static void route_broker_pool_show(route_broker_fmt_cb cli_out, void *cli)
+{
+	struct route_pool_stats stats[ROUTE_POOL_CLASSES + 1];
+	int i;
+
+	route_pool_get_stats(stats);
+
+	cli_out(cli, "\nPools\n");
+	for (i = 0; i < ROUTE_POOL_CLASSES; i++)
+		cli_out(cli,
+			"size:%-5zu slabs:%" PRIu64 " objects:%" PRIu64
+			" free:%" PRIu64 " cached:%" PRIu64 " allocs:%" PRIu64
+			" frees:%" PRIu64 "\n", stats[i].size, stats[i].slabs,
+			stats[i].objects, stats[i].free, stats[i].cached,
+			stats[i].allocs, stats[i].frees);
+	cli_out(cli, "malloc     allocs:%" PRIu64 " frees:%" PRIu64 "\n",
+		stats[i].allocs, stats[i].frees);
+}
+
+/*
+ * A show walks a snapshot of each level, all taken at once. Each page is
+ * taken with the level locked, and the lock is not held while the page
+ * is being output, so a slow reader does not hold up routes being
+ * published.
+ */
+struct route_broker_show_cursor {
+	struct route_broker_show_filter filter;
+	struct broker_snapshot *snap[ROUTE_BROKER_LEVELS_MAX];
+	uint64_t top[ROUTE_BROKER_LEVELS_MAX];
+	/* The level being walked, and the last object walked in it */
+	int level;
+	uint64_t id;
+	uint16_t key_len;
+	uint8_t key[ROUTE_BROKER_KEY_LEN];
+	/*
+	 * Objects in the level with ids in this range were walked by the
+	 * show resumed from, and have not changed since. Only set if the
+	 * snapshot could not be started past them.
+	 */
+	uint64_t skip_lo[ROUTE_BROKER_LEVELS_MAX];
+	uint64_t skip_hi[ROUTE_BROKER_LEVELS_MAX];
+	bool header;
+	/* Objects matching the filter so far */
+	uint64_t count;
+};
+
+static bool route_broker_show_level(const struct route_broker_show_filter *f,
+				    int pri)
+{
+	if (!f->levels)
+		return true;
+	return pri < ROUTE_BROKER_NHG_LEVEL && (f->levels & (1u << pri));
+}
+
+/* Called without the lock, with a ref held on the data */
+static bool route_broker_show_match(const struct route_broker_show_filter *f,
+				    struct rib_data *data)
+{
+	uint8_t family;
+	uint32_t table;
+
+	if (!f->family && !f->table)
+		return true;
+	if (route_attrs_family_table(data->obj, &data->attrs, &family, &table))
+		return false;
+	return (!f->family || family == f->family) &&
+		(!f->table || table == f->table);
+}
+
+/*
+ * The object the show resumed from got to in its level, if it is still
+ * there as it was. Called with the level locked.
+ */
+static struct broker_obj *
+route_broker_show_from(const struct route_broker_show_pos *from)
+{
+	struct route_hash_shard *shard;
+	struct rib_route *route;
+	struct rib_route *key;
+
+	if (!from->key_len || from->key_len > ROUTE_TOPIC_LEN)
+		return NULL;
 
-	b_obj = broker_seq_next(route_broker[*pri], obj);
-	if (!b_obj) {
-		/* end of this broker - is there another priority level? */
-		if (*pri < (ROUTE_PRIORITY_MAX - 1)) {
-			(*pri)++;
-			/* TODO - put a separator in here ? */
-			return broker_seq_start(route_broker[*pri]);
+	key = rib_route_create(from->key, from->key_len);
+	if (!key)
+		return NULL;
+
+	shard = route_hash_shard(key);
+	pthread_mutex_lock(&shard->mutex);
+	route = route_hashtbl_lookup(shard->hash, key);
+	if (route && ((int)route->pri != from->level ||
+		      route->b_obj.id != from->id))
+		route = NULL;
+	pthread_mutex_unlock(&shard->mutex);
+	route_pool_free(key);
+
+	return route ? &route->b_obj : NULL;
+}
+
+/*
+ * Snapshot the level, going on from what the show resumed from walked
+ * of it, if any. Called with the level locked.
+ */
+static struct broker_snapshot *
+route_broker_show_snap(struct route_broker_show_cursor *cursor, int pri,
+		       const struct route_broker_show_pos *from)
+{
+	struct broker *broker = route_broker[pri];
+	struct broker_obj *lo;
+
+	if (!from || pri > from->level || (pri == from->level && !from->id))
+		return broker_snapshot_start(broker);
+
+	if (pri < from->level)
+		return broker_snapshot_start_skip(broker, NULL, from->top[pri]);
+
+	lo = route_broker_show_from(from);
+	if (lo)
+		return broker_snapshot_start_skip(broker, lo, from->top[pri]);
+
+	/* It has changed since, so the level is walked to get back there */
+	cursor->skip_lo[pri] = from->id;
+	cursor->skip_hi[pri] = from->top[pri];
+	return broker_snapshot_start(broker);
+}
+
+static void route_broker_show_next_level(struct route_broker_show_cursor *cursor)
+{
+	int pri = cursor->level;
+
+	if (cursor->snap[pri]) {
+		route_broker_lock(pri);
+		broker_snapshot_end(cursor->snap[pri]);
+		route_broker_unlock(pri);
+		route_broker_free_dead();
+		cursor->snap[pri] = NULL;
+	}
+	cursor->level++;
+	cursor->id = 0;
+	cursor->key_len = 0;
+	cursor->header = false;
+}
+
+struct route_broker_show_cursor *
+route_broker_show_start(const struct route_broker_show_filter *filter,
+			const struct route_broker_show_pos *from)
+{
+	struct route_broker_show_cursor *cursor;
+	int pri;
+
+	cursor = calloc(1, sizeof(*cursor));
+	if (!cursor)
+		return NULL;
+
+	if (filter)
+		cursor->filter = *filter;
+
+	route_broker_lock_all();
+	for (pri = 0; pri < ROUTE_BROKER_LEVELS; pri++) {
+		cursor->skip_lo[pri] = 1;
+		if (!route_broker_show_level(&cursor->filter, pri))
+			continue;
+		cursor->snap[pri] = route_broker_show_snap(cursor, pri, from);
+		if (cursor->snap[pri])
+			broker_snapshot_set_limit(cursor->snap[pri],
+						  ROUTE_BROKER_SHOW_SAVED_MAX);
+		cursor->top[pri] = route_broker[pri]->id;
+	}
+	route_broker_unlock_all();
+	return cursor;
+}
+
+/*
+ * Walk up to 'max' objects, showing those that match if 'detail', and
+ * counting them. Returns false once there are no more.
+ */
+static bool route_broker_show_walk(struct route_broker_show_cursor *cursor,
+				   route_broker_fmt_cb cli_out, void *cli,
+				   unsigned int max, bool detail)
+{
+	struct broker_snapshot_ent ents[ROUTE_BROKER_SHOW_BATCH];
+	struct rib_route *route;
+	unsigned int walked = 0;
+	bool failed;
+	unsigned int n;
+	unsigned int i;
+	int pri;
+
+	while (cursor->level < ROUTE_BROKER_LEVELS) {
+		pri = cursor->level;
+		if (!route_broker_show_level(&cursor->filter, pri)) {
+			route_broker_show_next_level(cursor);
+			continue;
 		}
+
+		if (walked >= max)
+			return true;
+
+		if (!cursor->header) {
+			route_broker_lock(pri);
+			route_broker_level_show(cli_out, cli, pri,
+						cursor->top[pri]);
+			route_broker_unlock(pri);
+			cursor->header = true;
+		}
+
+		if (!cursor->snap[pri]) {
+			cli_out(cli, "No memory to show priority %d\n", pri);
+			route_broker_show_next_level(cursor);
+			continue;
+		}
+
+		n = max - walked;
+		if (n > ROUTE_BROKER_SHOW_BATCH)
+			n = ROUTE_BROKER_SHOW_BATCH;
+
+		route_broker_lock(pri);
+		n = broker_snapshot_next(cursor->snap[pri], ents, n);
+		failed = broker_snapshot_failed(cursor->snap[pri]);
+		route_broker_unlock(pri);
+
+		if (failed) {
+			cli_out(cli, "Too many changes to show priority %d\n",
+				pri);
+			route_broker_show_next_level(cursor);
+			continue;
+		}
+
+		walked += n;
+		for (i = 0; i < n; i++) {
+			cursor->id = ents[i].id;
+			if ((ents[i].id < cursor->skip_lo[pri] ||
+			     ents[i].id > cursor->skip_hi[pri]) &&
+			    route_broker_show_match(&cursor->filter,
+						    ents[i].data)) {
+				cursor->count++;
+				if (detail)
+					route_broker_snapshot_show(cli_out, cli,
+								   &ents[i]);
+			}
+		}
+
+		/* What a show resuming from this one goes on from */
+		if (n) {
+			route = broker_obj_to_rib_route(ents[n - 1].obj);
+			memcpy(cursor->key, route->key, route->key_len);
+			cursor->key_len = route->key_len;
+		}
+
+		route_broker_lock(pri);
+		broker_snapshot_put(route_broker[pri], ents, n);
+		route_broker_unlock(pri);
+		route_broker_free_dead();
+
+		if (!n)
+			route_broker_show_next_level(cursor);
 	}
+	return false;
+}
 
-	return b_obj;
+bool route_broker_show_page(struct route_broker_show_cursor *cursor,
+			    route_broker_fmt_cb cli_out, void *cli,
+			    unsigned int max)
+{
+	return route_broker_show_walk(cursor, cli_out, cli, max, true);
 }
 
-static void route_broker_show_internal(route_broker_fmt_cb cli_out, void *cli,
-				       bool detail)
+void route_broker_show_get_pos(struct route_broker_show_cursor *cursor,
+			       struct route_broker_show_pos *pos)
 {
-	uint64_t count = 0;
-	int pri = 0;
-	int pri_last = 0;
+	pos->level = cursor->level;
+	pos->id = cursor->id;
+	pos->key_len = cursor->key_len;
+	memcpy(pos->key, cursor->key, cursor->key_len);
+	memcpy(pos->top, cursor->top, sizeof(pos->top));
+}
 
-	struct route_broker_client *rclient;
+void route_broker_show_end(struct route_broker_show_cursor *cursor)
+{
+	while (cursor->level < ROUTE_BROKER_LEVELS)
+		route_broker_show_next_level(cursor);
+	free(cursor);
+}
+
+/* Credit left, and time stalled for the want of it, including any stall now */
+static void route_broker_show_flow(struct route_broker_client *rclient,
+				   route_broker_fmt_cb cli_out, void *cli)
+{
+	uint64_t since, stalled;
+
+	since = __atomic_load_n(&rclient->flow_stall_since, __ATOMIC_RELAXED);
+	stalled = __atomic_load_n(&rclient->flow_stall_usecs, __ATOMIC_RELAXED);
+	if (since)
+		stalled += zclock_usecs() - since;
 
-	cli_out(cli, "processed %" PRIu64 "\n", processed_msg);
+	cli_out(cli, "Client %p: credit:%" PRIu64 " stalled:%" PRIu64 " ms%s\n",
+		rclient,
+		__atomic_load_n(&rclient->flow_credit, __ATOMIC_RELAXED),
+		stalled / 1000, since ? " (stalled now)" : "");
+}
 
-	if (ignored_msg)
-		cli_out(cli, "ignored %" PRIu64 "\n", ignored_msg);
-	if (dropped_msg)
-		cli_out(cli, "dropped %" PRIu64 "\n", dropped_msg);
+static void route_broker_show_internal(route_broker_fmt_cb cli_out, void *cli,
+				       bool detail)
+{
+	struct route_broker_show_cursor *cursor;
+	struct route_broker_client *rclient;
 
+	uint64_t ignored = __atomic_load_n(&ignored_msg, __ATOMIC_RELAXED);
+	uint64_t dropped = __atomic_load_n(&dropped_msg, __ATOMIC_RELAXED);
+	uint64_t packed = __atomic_load_n(&rib_nl_dp_frames_packed,
+					  __ATOMIC_RELAXED);
+	uint64_t deflated = __atomic_load_n(&rib_nl_dp_deflated,
+					    __ATOMIC_RELAXED);
+
+	cli_out(cli, "processed %" PRIu64 "\n",
+		__atomic_load_n(&processed_msg, __ATOMIC_RELAXED));
+
+	if (ignored)
+		cli_out(cli, "ignored %" PRIu64 "\n", ignored);
+	if (dropped)
+		cli_out(cli, "dropped %" PRIu64 "\n", dropped);
+	if (packed)
+		cli_out(cli, "dp frames packed %" PRIu64 " shared %" PRIu64
+			"\n", packed,
+			__atomic_load_n(&rib_nl_dp_frames_shared,
+					__ATOMIC_RELAXED));
+	if (deflated)
+		cli_out(cli, "dp frames deflated %" PRIu64 " bytes %" PRIu64
+			" to %" PRIu64 "\n", deflated,
+			__atomic_load_n(&rib_nl_dp_deflate_in,
+					__ATOMIC_RELAXED),
+			__atomic_load_n(&rib_nl_dp_deflate_out,
+					__ATOMIC_RELAXED));
+
+	pthread_rwlock_rdlock(&route_broker_client_lock);
 	CIRCLEQ_FOREACH(rclient, &client_list_head, clients_list) {
 		if (rclient->errors) {
 			cli_out(cli, "Client %p: errors:%" PRIu64,
 				rclient, rclient->errors);
 		}
+		if (__atomic_load_n(&rclient->flow_control,
+				    __ATOMIC_RELAXED))
+			route_broker_show_flow(rclient, cli_out, cli);
 	}
-
-	cli_out(cli, "\nPriority %d, top: %" PRIu64 "\n", pri,
-		route_broker[pri]->id);
-	route_broker_lock();
-
-	void *obj = route_broker_seq_first(&pri);
-	while (obj) {
-		if (pri != pri_last) {
-			pri_last = pri;
-			cli_out(cli, "\nPriority %d, top: %" PRIu64 "\n", pri,
-				route_broker[pri]->id);
-		}
-		count++;
-		route_broker_seq_show(cli_out, cli, obj, detail);
-		obj = route_broker_seq_next(obj, &pri);
+	pthread_rwlock_unlock(&route_broker_client_lock);
+
+	cursor = route_broker_show_start(NULL, NULL);
+	if (cursor) {
+		while (route_broker_show_walk(cursor, cli_out, cli,
+					      ROUTE_BROKER_SHOW_BATCH, detail))
+			;
+		cli_out(cli, "Total objects %" PRIu64 "\n", cursor->count);
+		route_broker_show_end(cursor);
+	} else {
+		cli_out(cli, "No memory to show objects\n");
 	}
-	cli_out(cli, "Total objects %" PRIu64 "\n", count);
-
-	route_broker_unlock();
+	route_broker_pool_show(cli_out, cli);
 }
 
 void route_broker_show(route_broker_fmt_cb cli_out, void *cli)
@@ -204,31 +813,134 @@ void route_broker_show_summary(route_broker_fmt_cb cli_out, void *cli)
 	route_broker_show_internal(cli_out, cli, false);
 }
 
+void route_broker_get_level_stats(struct route_broker_level_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
+		stats[i].served = __atomic_load_n(&route_broker_served[i],
+						  __ATOMIC_RELAXED);
+		stats[i].turns = __atomic_load_n(&route_broker_turns[i],
+						 __ATOMIC_RELAXED);
+	}
+}
+
+/* A snapshot keeps the data a route had, as it is swapped on updates */
+static void *rib_route_get_data(struct broker_obj *b_obj)
+{
+	struct rib_route *route = broker_obj_to_rib_route(b_obj);
+
+	return rib_data_get(route->data);
+}
+
+static void rib_route_put_data(void *data)
+{
+	rib_data_put(data);
+}
+
 const struct broker_ops route_broker_ops = {
 	.obj_to_broker_obj = rib_route_to_broker_obj,
 	.broker_obj_to_obj = broker_obj_to_rib_route,
 	.lock_obj = rib_route_lock,
 	.unlock_obj = rib_route_unlock,
+	.get_data = rib_route_get_data,
+	.put_data = rib_route_put_data,
 };
 
-int route_broker_init(void)
+static int route_broker_sched_init(const struct route_broker_sched *sched)
+{
+	unsigned int levels = ROUTE_PRIORITY_MAX;
+	uint32_t quantum;
+	int i;
+
+	if (sched && sched->levels)
+		levels = sched->levels;
+	if (levels > ROUTE_PRIORITY_LEVELS_MAX)
+		return -EINVAL;
+
+	route_broker_priorities = levels;
+	route_broker_sched_type = sched ? sched->type : ROUTE_SCHED_STRICT;
+	switch (route_broker_sched_type) {
+	case ROUTE_SCHED_STRICT:
+		quantum = 0;
+		break;
+	case ROUTE_SCHED_WRR:
+		quantum = ROUTE_BROKER_WRR_QUANTUM;
+		break;
+	case ROUTE_SCHED_DRR:
+		quantum = ROUTE_BROKER_DRR_QUANTUM;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	route_broker_drain[0] = ROUTE_BROKER_NHG_LEVEL;
+	for (i = 0; i < route_broker_priorities; i++) {
+		route_broker_drain[i + 1] = i;
+		route_broker_quantum[i] = sched && sched->quantum[i] ?
+			sched->quantum[i] : quantum;
+	}
+	route_broker_quantum[ROUTE_BROKER_NHG_LEVEL] = 0;
+
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
+		route_broker_served[i] = 0;
+		route_broker_turns[i] = 0;
+	}
+	return 0;
+}
+
+int route_broker_init(unsigned int flags)
+{
+	return route_broker_init_sched(flags, NULL);
+}
+
+int route_broker_init_sched(unsigned int flags,
+			    const struct route_broker_sched *sched)
 {
 	int i;
 
+	if (route_broker_sched_init(sched))
+		return -EINVAL;
+
 	CIRCLEQ_INIT(&client_list_head);
 
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++) {
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
+		route_broker_top[i] = 0;
 		route_broker[i] =
-		    broker_create(&route_broker_ops, ROUTE_BROKER_TYPES_MAX);
+		    broker_create_flags(&route_broker_ops,
+					ROUTE_BROKER_TYPES_MAX, flags);
 		assert(route_broker[i]);
 		if (!route_broker[i])
 			return 1;
 	}
 
-	route_hashtbl = zhash_new();
-	assert(route_hashtbl);
+	route_broker_flush_data = NULL;
+	if (route_broker_flush_obj) {
+		route_broker_flush_data =
+			rib_data_create(route_broker_flush_obj);
+		if (!route_broker_flush_data)
+			return 1;
+	}
+
+	for (i = 0; i < ROUTE_HASH_SHARDS; i++) {
+		pthread_mutex_init(&route_hash[i].mutex, NULL);
+		route_hash[i].hash = route_hashtbl_create();
+		assert(route_hash[i].hash);
+		if (!route_hash[i].hash)
+			return 1;
+	}
+
+	return 0;
+}
+
+void route_broker_set_lag_limit(uint64_t limit)
+{
+	int i;
 
-	return route_hashtbl ? 0 : 1;
+	route_broker_lock_all();
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++)
+		broker_set_lag_limit(route_broker[i], limit);
+	route_broker_unlock_all();
 }
 
 int route_broker_destroy(void)
@@ -236,13 +948,23 @@ int route_broker_destroy(void)
 	int rc;
 	int i;
 
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++) {
+	route_broker_free_dead();
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
 		rc = broker_delete(route_broker[i]);
 		if (rc != 0)
 			return rc;
 	}
 
-	zhash_destroy(&route_hashtbl);
+	if (route_broker_flush_data) {
+		rib_data_put(route_broker_flush_data);
+		route_broker_flush_data = NULL;
+	}
+
+	for (i = 0; i < ROUTE_HASH_SHARDS; i++) {
+		route_hashtbl_destroy(route_hash[i].hash);
+		route_hash[i].hash = NULL;
+		pthread_mutex_destroy(&route_hash[i].mutex);
+	}
 
 	return 0;
 }
@@ -254,26 +976,116 @@ static void *route_broker_client_get(struct broker_obj *b_obj)
 	obj = broker_obj_to_rib_route(b_obj);
 
 	assert(obj->data);
-	return route_broker_copy_obj(obj->data);
+	return rib_data_get(obj->data);
+}
+
+/* From a resync snapshot, the data the route had when it was taken */
+static void *route_broker_client_snap_get(struct broker_snapshot_ent *ent)
+{
+	return rib_data_get(ent->data);
+}
+
+/* Tells a client that has been overrun to forget the objects it has */
+static void *route_broker_client_flush(struct broker_client *bc)
+{
+	return rib_data_get(route_broker_flush_data);
 }
 
 static struct broker_client_ops route_broker_client_ops = {
 	.add_obj = route_broker_client_get,
 	.del_obj = route_broker_client_get,
+	.snap_obj = route_broker_client_snap_get,
+};
+
+static struct broker_client_ops route_broker_flush_client_ops = {
+	.add_obj = route_broker_client_get,
+	.del_obj = route_broker_client_get,
+	.snap_obj = route_broker_client_snap_get,
+	.flush = route_broker_client_flush,
 };
 
-static int data_available_for_client(struct route_broker_client *rclient)
+/*
+ * Is there data for the client in the level? Only the client itself
+ * moves its position or starts and ends a resync, so this can be called
+ * by the client without the lock. A client that has been overrun is left
+ * where it was until it next gets data.
+ */
+static bool route_broker_level_pending(struct route_broker_client *rclient,
+				       int level)
+{
+	return rclient->client[level]->broker_obj.id !=
+		__atomic_load_n(&route_broker_top[level], __ATOMIC_SEQ_CST) ||
+		broker_client_resyncing(rclient->client[level]);
+}
+
+/*
+ * The first of the levels before 'limit', in the order they are drained,
+ * that has data for the client. Returns the index in route_broker_drain,
+ * or -1.
+ */
+static int data_available_for_client(struct route_broker_client *rclient,
+				     int limit)
 {
 	int i;
 
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++) {
-		if (rclient->client[i]->broker_obj.id != route_broker[i]->id)
+	for (i = 0; i < limit; i++) {
+		if (route_broker_level_pending(rclient, route_broker_drain[i]))
 			return i;
 	}
 
 	return -1;
 }
 
+bool route_broker_client_arm(struct route_broker_client *rclient)
+{
+	uint64_t rings;
+
+	if (data_available_for_client(rclient, ROUTE_BROKER_LEVELS) >= 0)
+		return false;
+
+	/* Clear out any ring left over from an earlier wait */
+	if (read(rclient->doorbell, &rings, sizeof(rings)) < 0 &&
+	    errno != EAGAIN)
+		broker_log_err("Failed to read client doorbell: %d\n", errno);
+
+	/* Anything published after this check rings it */
+	__atomic_store_n(&rclient->armed, true, __ATOMIC_SEQ_CST);
+	return data_available_for_client(rclient, ROUTE_BROKER_LEVELS) < 0;
+}
+
+uint64_t route_broker_client_lag(struct route_broker_client *rclient)
+{
+	uint64_t lag = 0;
+	int level;
+
+	for (level = 0; level < ROUTE_BROKER_LEVELS; level++)
+		lag += __atomic_load_n(&route_broker_top[level],
+				       __ATOMIC_RELAXED) -
+			rclient->client[level]->broker_obj.id;
+	return lag;
+}
+
+int route_broker_client_doorbell(struct route_broker_client *rclient)
+{
+	return rclient->doorbell;
+}
+
+/*
+ * Wait until there is data for the client, the doorbell is rung for all
+ * of it. Returns as data_available_for_client(), which can still be none
+ * if the wait was interrupted.
+ */
+static int route_broker_client_wait(struct route_broker_client *rclient)
+{
+	struct pollfd pfd = { .fd = rclient->doorbell, .events = POLLIN };
+
+	if (route_broker_client_arm(rclient) &&
+	    poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		broker_log_err("Failed to poll client doorbell: %d\n", errno);
+
+	return data_available_for_client(rclient, ROUTE_BROKER_LEVELS);
+}
+
 /*
  * There are possibly multiple underlying brokers (one per priority)
  * being represented to the users as a single one. Check each broker
@@ -284,42 +1096,352 @@ static int data_available_for_client(struct route_broker_client *rclient)
 void *route_broker_client_get_data(struct route_broker_client *rclient,
 				   struct broker_client **bc)
 {
-	void *data;
+	struct route_broker_data data;
+
+	if (!route_broker_client_get_batch(rclient, &data, 1))
+		return NULL;
+
+	*bc = data.bc;
+	return data.obj;
+}
+
+/* Take up to 'max' objects from a level. Called with the level locked. */
+static int route_broker_level_get(struct route_broker_client *rclient,
+				  int level, struct route_broker_data *data,
+				  int max)
+{
+	struct broker_client *bc = rclient->client[level];
+	void *objs[ROUTE_BROKER_BATCH];
+	int count = 0;
+	int n;
+	int i;
+
+	do {
+		n = max - count;
+		if (n > ROUTE_BROKER_BATCH)
+			n = ROUTE_BROKER_BATCH;
+		n = broker_client_get_batch(bc, objs, n);
+		for (i = 0; i < n; i++, count++) {
+			data[count].obj = objs[i];
+			data[count].bc = bc;
+		}
+		if (n && objs[0] == route_broker_flush_data) {
+			rclient->flushed = bc;
+			break;
+		}
+	} while (n && count < max);
+
+	if (count) {
+		__atomic_add_fetch(&route_broker_served[level], count,
+				   __ATOMIC_RELAXED);
+		route_broker_count(route_broker_turns[level]);
+	}
+	return count;
+}
+
+/*
+ * Take everything from each level in turn, going back if more arrives in
+ * an earlier one. Anything published to an earlier level before what is
+ * in this one must get to the client first, such as a nexthop group
+ * before the routes using it.
+ */
+static int route_broker_get_strict(struct route_broker_client *rclient,
+				   struct route_broker_data *data, int max,
+				   int idx)
+{
+	int count = 0;
+	int earlier;
 	int level;
-	int rc;
-	struct timespec wake_at;
 
-	clock_gettime(CLOCK_REALTIME, &wake_at);
-	wake_at.tv_sec += 1;
+	while (idx < ROUTE_BROKER_LEVELS && count < max && !rclient->flushed) {
+		level = route_broker_drain[idx];
+		route_broker_lock(level);
+
+		earlier = data_available_for_client(rclient, idx);
+		if (earlier >= 0) {
+			route_broker_unlock(level);
+			idx = earlier;
+			continue;
+		}
+
+		count += route_broker_level_get(rclient, level, data + count,
+						max - count);
+		route_broker_unlock(level);
+		idx++;
+	}
+	return count;
+}
+
+/*
+ * A nexthop group delete goes in the last route level, after the routes
+ * published before it in that level. Those in the other levels, which
+ * may still be using the group, have to be given out first too.
+ * Called with the level locked.
+ */
+static bool route_broker_nhg_fenced(struct route_broker_client *rclient,
+				    int level)
+{
+	struct broker_obj *next;
+	int i;
+
+	if (level != ROUTE_BROKER_NHG_LEVEL - 1)
+		return false;
+
+	next = broker_client_peek(rclient->client[level]);
+	if (!next || next->obj_type != ROUTE_BROKER_NHG)
+		return false;
+
+	for (i = 0; i < level; i++) {
+		if (route_broker_level_pending(rclient, i))
+			return true;
+	}
+	return false;
+}
+
+static int64_t route_broker_sched_cost(struct rib_data *ref)
+{
+	if (route_broker_sched_type == ROUTE_SCHED_DRR && route_broker_obj_size)
+		return route_broker_obj_size(ref->obj);
+	return 1;
+}
+
+/*
+ * Take objects from a route level until the client has had its credit
+ * for the turn. Objects are taken one at a time where the cost of each
+ * is needed, or a nexthop group delete could be among them.
+ * Called with the level locked.
+ */
+static int route_broker_level_get_credit(struct route_broker_client *rclient,
+					 int level,
+					 struct route_broker_data *data,
+					 int max)
+{
+	struct broker_client *bc = rclient->client[level];
+	int64_t *credit = &rclient->credit[level];
+	void *objs[ROUTE_BROKER_BATCH];
+	bool single;
+	int count = 0;
+	int n;
+	int i;
+
+	single = route_broker_sched_type == ROUTE_SCHED_DRR ||
+		level == ROUTE_BROKER_NHG_LEVEL - 1;
+
+	while (count < max && *credit > 0) {
+		if (route_broker_nhg_fenced(rclient, level))
+			break;
+
+		n = max - count;
+		if (n > ROUTE_BROKER_BATCH)
+			n = ROUTE_BROKER_BATCH;
+		if (single)
+			n = 1;
+		else if (n > *credit)
+			n = *credit;
+
+		n = broker_client_get_batch(bc, objs, n);
+		if (!n)
+			break;
+		for (i = 0; i < n; i++, count++) {
+			data[count].obj = objs[i];
+			data[count].bc = bc;
+			*credit -= route_broker_sched_cost(objs[i]);
+		}
+		if (objs[0] == route_broker_flush_data) {
+			rclient->flushed = bc;
+			break;
+		}
+	}
+
+	if (count)
+		__atomic_add_fetch(&route_broker_served[level], count,
+				   __ATOMIC_RELAXED);
+	return count;
+}
+
+/*
+ * Give each route level with data a turn in round robin order, starting
+ * from the level that was having its turn when the client last asked.
+ * A turn adds the quantum to the credit of the level, and lasts until
+ * that is used up. Nexthop groups are always taken first.
+ */
+static int route_broker_get_fair(struct route_broker_client *rclient,
+				 struct route_broker_data *data, int max)
+{
+	int nhg = ROUTE_BROKER_NHG_LEVEL;
+	int64_t *credit;
+	int skipped = 0;
+	int count = 0;
+	int level;
+	int n;
+
+	/* Stop once every level has been passed over with nothing taken */
+	while (count < max && skipped < route_broker_priorities &&
+	       !rclient->flushed) {
+		if (route_broker_level_pending(rclient, nhg)) {
+			route_broker_lock(nhg);
+			count += route_broker_level_get(rclient, nhg,
+							data + count,
+							max - count);
+			route_broker_unlock(nhg);
+			continue;
+		}
+
+		level = rclient->sched_level;
+		credit = &rclient->credit[level];
+		if (!route_broker_level_pending(rclient, level)) {
+			/* An idle level does not save up credit */
+			*credit = 0;
+			skipped++;
+		} else if (*credit <= 0) {
+			/* A new turn, unless the last overran a whole one */
+			*credit += route_broker_quantum[level];
+			route_broker_count(route_broker_turns[level]);
+			if (*credit > 0)
+				continue;
+		} else {
+			route_broker_lock(level);
+			n = route_broker_level_get_credit(rclient, level,
+							  data + count,
+							  max - count);
+			route_broker_unlock(level);
+			count += n;
+			skipped = n ? 0 : skipped + 1;
+
+			/* The turn goes on if it was only cut short by max */
+			if (count == max && *credit > 0)
+				break;
+		}
+		rclient->sched_level = (level + 1) % route_broker_priorities;
+	}
+	return count;
+}
+
+/*
+ * A client told to flush by one level has to be given everything in the
+ * others again too, so they start it again from a snapshot.
+ */
+static void route_broker_client_restart(struct route_broker_client *rclient)
+{
+	int level;
+
+	for (level = 0; level < ROUTE_BROKER_LEVELS; level++) {
+		if (rclient->client[level] == rclient->flushed)
+			continue;
+		route_broker_lock(level);
+		broker_client_restart(rclient->client[level]);
+		route_broker_unlock(level);
+	}
+	rclient->flushed = NULL;
+}
+
+/*
+ * As route_broker_client_get_data() for up to 'max' objects, taking the
+ * lock of each level at most once a turn. With strict scheduling the
+ * objects are returned in the order they would have been by that many
+ * single calls, so higher priority levels are drained first.
+ */
+static int route_broker_client_batch(struct route_broker_client *rclient,
+				     struct route_broker_data *data, int max,
+				     bool wait)
+{
+	struct rib_data *ref;
+	int count;
+	int copied = 0;
+	int idx;
+	int i;
+
+	/* If there is no more data sleep until the doorbell is rung */
+	if (wait)
+		idx = route_broker_client_wait(rclient);
+	else
+		idx = data_available_for_client(rclient, ROUTE_BROKER_LEVELS);
+	if (idx < 0)
+		return 0;
+
+	if (route_broker_sched_type == ROUTE_SCHED_STRICT)
+		count = route_broker_get_strict(rclient, data, max, idx);
+	else
+		count = route_broker_get_fair(rclient, data, max);
+	if (rclient->flushed)
+		route_broker_client_restart(rclient);
+	route_broker_free_dead();
+
+	/* Shared objects are handed out with the ref that was taken */
+	if (route_broker_obj_size) {
+		for (i = 0; i < count; i++) {
+			ref = data[i].obj;
+			data[i].obj = ref->obj;
+		}
+		return count;
+	}
+
+	/* Take the copies now the lock has been dropped */
+	for (i = 0; i < count; i++) {
+		ref = data[i].obj;
+		data[copied].obj = route_broker_copy_obj(ref->obj);
+		data[copied].bc = data[i].bc;
+		rib_data_put(ref);
+		if (!data[copied].obj) {
+			broker_log_err("Failed to copy object for %s\n",
+				       data[i].bc->name);
+			rclient->errors++;
+			continue;
+		}
+		copied++;
+	}
+
+	return copied;
+}
+
+int route_broker_client_get_batch(struct route_broker_client *rclient,
+				  struct route_broker_data *data, int max)
+{
+	return route_broker_client_batch(rclient, data, max, true);
+}
 
-	route_broker_lock();
+int route_broker_client_try_batch(struct route_broker_client *rclient,
+				  struct route_broker_data *data, int max)
+{
+	return route_broker_client_batch(rclient, data, max, false);
+}
 
-	/* Check all levels */
+void route_broker_client_free_data(struct route_broker_client *rclient,
+				   void *obj)
+{
+	if (route_broker_obj_size)
+		route_broker_data_release(obj);
+	else
+		route_broker_free_obj(obj);
+}
 
-	/* If there is no more data sleep until woken by more data */
-	while ((level = data_available_for_client(rclient)) < 0) {
-		rc = pthread_cond_timedwait(&rclient->client_cond,
-					    &route_broker_mutex, &wake_at);
-		if (rc == ETIMEDOUT) {
-			route_broker_unlock();
-			return NULL;
-		}
-	}
+bool route_broker_data_hold(void *obj)
+{
+	if (!route_broker_obj_size)
+		return false;
 
-	data = broker_client_get_data(rclient->client[level]);
-	*bc = rclient->client[level];
-	route_broker_unlock();
+	rib_data_get(container_of(obj, struct rib_data, payload));
+	return true;
+}
 
-	return data;
+void route_broker_data_release(void *obj)
+{
+	rib_data_put(container_of(obj, struct rib_data, payload));
 }
 
-void route_broker_client_free_data(struct route_broker_client *rclient,
-				   void *obj)
+const struct route_attrs *route_broker_data_attrs(void *obj)
 {
-	route_broker_free_obj(obj);
+	struct rib_data *data;
+
+	if (!route_broker_obj_size)
+		return NULL;
+
+	data = container_of(obj, struct rib_data, payload);
+	return data->attrs.scanned ? &data->attrs : NULL;
 }
 
-struct route_broker_client *route_broker_client_create(const char *name)
+static struct route_broker_client *
+route_broker_client_new(const char *name, struct broker_client_ops *ops)
 {
 	struct route_broker_client *rclient;
 	int i;
@@ -331,99 +1453,277 @@ struct route_broker_client *route_broker_client_create(const char *name)
 	if (!rclient)
 		return NULL;
 
-	route_broker_lock();
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++) {
+	route_broker_lock_all();
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
 		rclient->client[i] = broker_client_create(route_broker[i],
-					     &route_broker_client_ops, name);
-		if (!rclient->client) {
-			route_broker_unlock();
+					     ops, name);
+		if (!rclient->client[i]) {
+			route_broker_unlock_all();
 			goto failed;
 		}
 	}
 
-	route_broker_unlock();
+	route_broker_unlock_all();
 
-	if (pthread_cond_init(&rclient->client_cond, NULL))
+	rclient->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rclient->doorbell < 0)
 		goto failed;
 
+	pthread_rwlock_wrlock(&route_broker_client_lock);
 	CIRCLEQ_INSERT_HEAD(&client_list_head, rclient, clients_list);
+	pthread_rwlock_unlock(&route_broker_client_lock);
 
 	return rclient;
 
  failed:
-	route_broker_lock();
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++) {
+	route_broker_lock_all();
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
 		if (rclient->client[i])
 			broker_client_delete(rclient->client[i]);
 	}
 	free(rclient);
-	route_broker_unlock();
+	route_broker_unlock_all();
+	route_broker_free_dead();
 	return NULL;
 }
 
+struct route_broker_client *route_broker_client_create(const char *name)
+{
+	return route_broker_client_new(name, &route_broker_client_ops);
+}
+
+struct route_broker_client *route_broker_client_create_flush(const char *name)
+{
+	if (!route_broker_flush_data)
+		return route_broker_client_create(name);
+	return route_broker_client_new(name, &route_broker_flush_client_ops);
+}
+
 void route_broker_client_delete(struct route_broker_client *rclient)
 {
+	bool more;
 	int i;
 
-	route_broker_lock();
-	for (i = 0; i < ROUTE_PRIORITY_MAX; i++)
+	pthread_rwlock_wrlock(&route_broker_client_lock);
+	CIRCLEQ_REMOVE(&client_list_head, rclient, clients_list);
+	pthread_rwlock_unlock(&route_broker_client_lock);
+
+	route_broker_lock_all();
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++)
 		broker_client_delete(rclient->client[i]);
-	pthread_cond_destroy(&rclient->client_cond);
-	route_broker_unlock();
+	route_broker_unlock_all();
 
-	CIRCLEQ_REMOVE(&client_list_head, rclient, clients_list);
+	close(rclient->doorbell);
 	free(rclient);
+
+	/*
+	 * Free the deleted objects this client was holding back, dropping
+	 * the lock between batches so that publishing is not held up.
+	 */
+	for (i = 0; i < ROUTE_BROKER_LEVELS; i++) {
+		do {
+			route_broker_lock(i);
+			more = broker_reclaim(route_broker[i],
+					      ROUTE_BROKER_RECLAIM_BATCH);
+			route_broker_unlock(i);
+			route_broker_free_dead();
+		} while (more);
+	}
 }
 
+/*
+ * Ring the doorbell of any client that has found it has nothing to do
+ * and is waiting.
+ */
 static void route_broker_wake_clients(void)
 {
 	struct route_broker_client *rclient;
+	uint64_t ring = 1;
 
-	/* Already have the mutex */
+	pthread_rwlock_rdlock(&route_broker_client_lock);
 	CIRCLEQ_FOREACH(rclient, &client_list_head, clients_list) {
-		if (data_available_for_client(rclient) >= 0)
-			pthread_cond_signal(&rclient->client_cond);
+		if (!__atomic_exchange_n(&rclient->armed, false,
+					 __ATOMIC_SEQ_CST))
+			continue;
+		if (write(rclient->doorbell, &ring, sizeof(ring)) < 0)
+			broker_log_err("Failed to ring client doorbell: %d\n",
+				       errno);
 	}
+	pthread_rwlock_unlock(&route_broker_client_lock);
 }
 
-void object_broker_publish(void *obj, int pri)
+/*
+ * Add a route to a level. If the level has no room for it the route is
+ * freed and the change dropped, leaving any route it was to replace as
+ * it was.
+ */
+static bool route_broker_add(int pri, struct rib_route *route, int type)
 {
-	struct rib_route *route = NULL;
-	struct rib_route *hashed_route = NULL;
-	int rc;
-	void *data_copy;
-	bool del = false;
+	char topic[ROUTE_TOPIC_LEN];
 
-	processed_msg++;
-	route = rib_route_create();
-	if (!route) {
-		dropped_msg++;
+	if (!broker_add_obj(route_broker[pri], route, type))
+		return true;
+
+	rib_data_topic(route->data, topic, sizeof(topic));
+	broker_log_err("No memory to add %s\n", topic);
+	rib_data_put(route->data);
+	route_pool_free(route);
+	return false;
+}
+
+/*
+ * Nexthop groups are added and updated in their own level, and deleted
+ * in the last route level, moving between the two as needed. A group
+ * stays in the hash while it is being deleted, so that adding it again
+ * takes it back out of the last level. Called with the levels and the
+ * shard locked.
+ */
+static void route_broker_publish_nhg(struct route_hash_shard *shard,
+				     struct rib_route *route,
+				     struct rib_route *hashed_route, bool del)
+{
+	int level = route->pri;
+	bool seen = false;
+
+	if (hashed_route && (int)hashed_route->pri == level) {
+		/* Snapshots keep the old data, then swap to the new */
+		if (del)
+			broker_del_obj(route_broker[level], hashed_route,
+				       ROUTE_BROKER_NHG);
+		else
+			broker_upd_obj(route_broker[level], hashed_route,
+				       ROUTE_BROKER_NHG);
+		rib_data_put(hashed_route->data);
+		hashed_route->data = route->data;
+		route_pool_free(route);
 		return;
 	}
 
-	data_copy = route_broker_copy_obj(obj);
-	if (!data_copy) {
-		dropped_msg++;
-		free(route);
+	if (!hashed_route && del) {
+		rib_data_put(route->data);
+		route_pool_free(route);
 		return;
 	}
 
-	route->data = data_copy;
-	route->pri = pri;
-	rc = route_broker_topic_gen(route->data, route->topic,
-				    ROUTE_TOPIC_LEN, &del);
+	route->route_adds = __atomic_load_n(&route_broker_route_adds,
+					    __ATOMIC_RELAXED);
+	if (!route_broker_add(level, route, ROUTE_BROKER_NHG))
+		return;
+	/*
+	 * A deleted group that routes may have been added using since is
+	 * kept for the clients still to get them, with the delete after.
+	 */
+	if (hashed_route && del &&
+	    hashed_route->route_adds != route->route_adds)
+		seen = broker_retire_obj(route_broker[hashed_route->pri],
+					 &hashed_route->b_obj);
+	else if (hashed_route)
+		seen = broker_del_obj_now(route_broker[hashed_route->pri],
+					  &hashed_route->b_obj);
+	if (seen)
+		route->b_obj.flags |= BROKER_FLAGS_SEEN;
+	route_hash_set(shard, route);
+	if (del)
+		broker_del_obj(route_broker[level], route, ROUTE_BROKER_NHG);
+}
+
+/* Publish the new id of a level, then drop its lock */
+static void route_broker_unlock_publish(int pri)
+{
+	__atomic_store_n(&route_broker_top[pri], route_broker[pri]->id,
+			 __ATOMIC_SEQ_CST);
+	route_broker_unlock(pri);
+}
+
+/* Publish the new ids of all the levels, then drop their locks */
+static void route_broker_unlock_publish_all(void)
+{
+	int i;
+
+	for (i = ROUTE_BROKER_LEVELS - 1; i >= 0; i--)
+		route_broker_unlock_publish(i);
+}
+
+/* An object made ready to publish, before any lock is taken */
+struct route_broker_pending {
+	struct rib_route *route;
+	enum object_broker_obj_type type;
+	bool del;
+};
+
+/*
+ * Take the copy of the object and make its route, which needs no lock.
+ * Returns false if there is nothing to publish.
+ */
+static bool route_broker_publish_prep(void *obj, int pri,
+				      struct route_broker_pending *pend)
+{
+	struct rib_route *route;
+	uint8_t key[ROUTE_TOPIC_LEN];
+	struct rib_data *data;
+	int rc;
+
+	route_broker_count(processed_msg);
+	data = rib_data_create(obj);
+	if (!data) {
+		route_broker_count(dropped_msg);
+		return false;
+	}
+
+	pend->del = false;
+	rc = rib_data_key(data, key, sizeof(key), &pend->del);
 	if (rc <= 0) {
 		/* Some routes such as local broadcast are ignored */
-		ignored_msg++;
-		route_broker_free_obj(route->data);
-		free(route);
-		return;
+		route_broker_count(ignored_msg);
+		rib_data_put(data);
+		return false;
+	}
+
+	route = rib_route_create(key, rc);
+	if (!route) {
+		route_broker_count(dropped_msg);
+		rib_data_put(data);
+		return false;
 	}
 
-	route_broker_lock();
-	hashed_route = zhash_lookup(route_hashtbl, route->topic);
+	pend->type = OB_OBJ_ROUTE;
+	if (route_broker_obj_type)
+		pend->type = route_broker_obj_type(data->obj);
+	if (pend->type == OB_OBJ_NEXTHOP_GROUP)
+		pri = pend->del ? ROUTE_BROKER_NHG_LEVEL - 1 :
+			ROUTE_BROKER_NHG_LEVEL;
+	else if (pri < 0)
+		pri = 0;
+	else if (pri >= ROUTE_BROKER_NHG_LEVEL)
+		pri = ROUTE_BROKER_NHG_LEVEL - 1;
+	route->pri = pri;
+	route->data = data;
+	pend->route = route;
+	return true;
+}
+
+/*
+ * Apply the route to the broker, given the route in the hash for its key
+ * if any. Called with the levels of both, and the shard, locked.
+ */
+static void route_broker_publish_locked(struct route_hash_shard *shard,
+					struct route_broker_pending *pend,
+					struct rib_route *hashed_route)
+{
+	struct rib_route *route = pend->route;
+	int pri = route->pri;
+	bool del = pend->del;
+	bool seen;
+
+	if (hashed_route && !(hashed_route->b_obj.flags & BROKER_FLAGS_OBJ)) {
+		/* Gone from the broker, only held on to by a show */
+		route_hashtbl_delete(shard->hash, route);
+		hashed_route = NULL;
+	}
 
-	if (del) {
+	if (pend->type == OB_OBJ_NEXTHOP_GROUP) {
+		route_broker_publish_nhg(shard, route, hashed_route, del);
+	} else if (del) {
 		/* If we are deleting something it must be there */
 		if (hashed_route) {
 			if (hashed_route->pri > pri) {
@@ -433,33 +1733,38 @@ void object_broker_publish(void *obj, int pri)
 				 *   - Add it to new priority level (add then
 				 *     delete as we can't add a 'delete')
 				 */
-				broker_del_obj_now(route_broker
-						   [hashed_route->pri],
-						   &hashed_route->b_obj);
-
-				broker_add_obj(route_broker[pri], route,
-					       ROUTE_BROKER_ROUTE);
+				if (!route_broker_add(pri, route,
+						      ROUTE_BROKER_ROUTE))
+					return;
+				seen = broker_del_obj_now(route_broker
+							  [hashed_route->pri],
+							  &hashed_route->b_obj);
+				if (seen)
+					route->b_obj.flags |=
+						BROKER_FLAGS_SEEN;
 				broker_del_obj(route_broker[pri], route,
 					       ROUTE_BROKER_ROUTE);
 			} else {
 				/*
 				 * Priority has not changed or new route has
 				 * lower priority.
-				 * Swap the data to most recent version.
+				 * Swap the data to most recent version, once
+				 * snapshots have kept the old.
 				 */
-				route_broker_free_obj(hashed_route->data);
-				hashed_route->data = route->data;
-
 				broker_del_obj(route_broker[hashed_route->pri],
 					       hashed_route,
 					       ROUTE_BROKER_ROUTE);
-				free(route);
+				rib_data_put(hashed_route->data);
+				hashed_route->data = route->data;
+				route_pool_free(route);
 			}
 		} else {
-			route_broker_free_obj(route->data);
-			free(route);
+			rib_data_put(route->data);
+			route_pool_free(route);
 		}
 	} else {
+		__atomic_add_fetch(&route_broker_route_adds, 1,
+				   __ATOMIC_RELAXED);
 		if (hashed_route) {
 			if (hashed_route->pri > pri) {
 				/*
@@ -467,14 +1772,17 @@ void object_broker_publish(void *obj, int pri)
 				 *   - Force it out of existing priority level
 				 *   - Add it to new priority level.
 				 */
-				broker_del_obj_now(route_broker
-						   [hashed_route->pri],
-						   &hashed_route->b_obj);
-
-				broker_add_obj(route_broker[pri], route,
-					       ROUTE_BROKER_ROUTE);
-				zhash_insert(route_hashtbl, route->topic,
-					     route);
+				if (!route_broker_add(pri, route,
+						      ROUTE_BROKER_ROUTE))
+					return;
+				seen = broker_del_obj_now(route_broker
+							  [hashed_route->pri],
+							  &hashed_route->b_obj);
+				if (seen)
+					route->b_obj.flags |=
+						BROKER_FLAGS_SEEN;
+				/* The old one may still be held by a show */
+				route_hash_set(shard, route);
 			} else if (hashed_route->pri < pri
 				   || hashed_route->pri == pri) {
 				/*
@@ -495,24 +1803,113 @@ void object_broker_publish(void *obj, int pri)
 				 *     in the wrong level.
 				 *
 				 * Updating, so swap data to most recent
-				 * version.
+				 * version, once snapshots have kept the old.
 				 */
-				route_broker_free_obj(hashed_route->data);
-				hashed_route->data = route->data;
-				free(route);
 				broker_upd_obj(route_broker[hashed_route->pri],
 					       hashed_route,
 					       ROUTE_BROKER_ROUTE);
+				rib_data_put(hashed_route->data);
+				hashed_route->data = route->data;
+				route_pool_free(route);
 			}
 		} else {
-			broker_add_obj(route_broker[pri], route,
-				       ROUTE_BROKER_ROUTE);
-			zhash_insert(route_hashtbl, route->topic, route);
+			if (route_broker_add(pri, route, ROUTE_BROKER_ROUTE))
+				route_hash_set(shard, route);
 		}
 	}
+}
+
+void object_broker_publish(void *obj, int pri)
+{
+	struct rib_route *hashed_route = NULL;
+	struct route_broker_pending pend;
+	struct route_hash_shard *shard;
+	int hashed_pri;
+	int lo, hi;
+
+	if (!route_broker_publish_prep(obj, pri, &pend))
+		return;
+	pri = pend.route->pri;
+
+	/*
+	 * Find which levels are needed from the existing route, then take
+	 * them in order and check the route did not change in the meantime.
+	 * The route is only looked at while it is in the hash, with the
+	 * shard locked, as it can be freed once it is out.
+	 */
+	shard = route_hash_shard(pend.route);
+	while (true) {
+		pthread_mutex_lock(&shard->mutex);
+		hashed_route = route_hashtbl_lookup(shard->hash, pend.route);
+		hashed_pri = hashed_route ? (int)hashed_route->pri : pri;
+		pthread_mutex_unlock(&shard->mutex);
+
+		lo = hashed_pri < pri ? hashed_pri : pri;
+		hi = hashed_pri < pri ? pri : hashed_pri;
+		route_broker_lock(lo);
+		if (hi != lo)
+			route_broker_lock(hi);
+		pthread_mutex_lock(&shard->mutex);
+
+		if (route_hashtbl_lookup(shard->hash, pend.route) ==
+		    hashed_route &&
+		    (!hashed_route || (int)hashed_route->pri == hashed_pri))
+			break;
+
+		pthread_mutex_unlock(&shard->mutex);
+		if (hi != lo)
+			route_broker_unlock(hi);
+		route_broker_unlock(lo);
+	}
+
+	route_broker_publish_locked(shard, &pend, hashed_route);
+
+	pthread_mutex_unlock(&shard->mutex);
+	if (hi != lo)
+		route_broker_unlock_publish(hi);
+	route_broker_unlock_publish(lo);
 
 	route_broker_wake_clients();
-	route_broker_unlock();
+	route_broker_free_dead();
+}
+
+/*
+ * The copies and keys are made for a whole batch before any lock is
+ * taken, then the batch is applied holding all the levels, and the
+ * clients woken once. Large batches are split so that the clients are
+ * not kept out of the levels for long.
+ */
+void object_broker_publish_batch(const struct object_broker_msg *msgs,
+				 unsigned int count)
+{
+	struct route_broker_pending pend[ROUTE_BROKER_PUBLISH_BATCH];
+	struct route_hash_shard *shard;
+	unsigned int i, n;
+
+	while (count) {
+		for (n = 0; count && n < ROUTE_BROKER_PUBLISH_BATCH;
+		     msgs++, count--)
+			if (route_broker_publish_prep(msgs->obj, msgs->pri,
+						      &pend[n]))
+				n++;
+		if (!n)
+			continue;
+
+		route_broker_lock_all();
+		for (i = 0; i < n; i++) {
+			shard = route_hash_shard(pend[i].route);
+			pthread_mutex_lock(&shard->mutex);
+			route_broker_publish_locked(
+				shard, &pend[i],
+				route_hashtbl_lookup(shard->hash,
+						     pend[i].route));
+			pthread_mutex_unlock(&shard->mutex);
+		}
+		route_broker_unlock_publish_all();
+
+		route_broker_wake_clients();
+		route_broker_free_dead();
+	}
 }
 
 int object_broker_init_all(const struct object_broker_init *init,
@@ -521,7 +1918,9 @@ int object_broker_init_all(const struct object_broker_init *init,
 {
 	int rc;
 
-	if (!init || !init->topic_gen || !init->copy_obj || !init->free_obj)
+	if (!init || !init->topic_gen)
+		return -EINVAL;
+	if (!init->obj_size && (!init->copy_obj || !init->free_obj))
 		return -EINVAL;
 
 	/* Client support currently hardcoded */
@@ -544,15 +1943,21 @@ int object_broker_init_all(const struct object_broker_init *init,
 	route_broker_log_dp_detail = init->log_dp_detail;
 	route_broker_log_arg = init->log_arg;
 	route_broker_topic_gen = init->topic_gen;
+	route_broker_key_gen = init->key_gen;
 	route_broker_copy_obj = init->copy_obj;
 	route_broker_free_obj = init->free_obj;
-
-	rc = route_broker_init();
+	route_broker_obj_type = init->obj_type;
+	route_broker_obj_size = init->obj_size;
+	route_broker_flush_obj = init->flush_obj;
+
+	rc = route_broker_init_sched(init->seq_log ? BROKER_CREATE_SEQ_LOG : 0,
+				     &init->sched);
+	if (rc == -EINVAL)
+		return rc;
 	assert(rc == 0);
+	route_broker_set_lag_limit(init->lag_limit);
 
-	rc = route_broker_dataplane_ctrl_init(client[0].cfg_file,
-					      client[0].client_publish,
-					      client[0].client_data_format);
+	rc = route_broker_dataplane_ctrl_init(&client[0]);
 	if (num_clients == 2)
 		rc |= route_broker_kernel_init(client[1].client_publish);
 	return rc;
@@ -562,6 +1967,7 @@ void object_broker_shutdown_all(void)
 {
 	route_broker_dataplane_ctrl_shutdown();
 	route_broker_kernel_shutdown();
+	rib_nl_dp_publish_flush();
 	route_broker_destroy();
 }
 
@@ -574,14 +1980,45 @@ static int rib_nl_kernel_publish_wrapper(void *obj, void *client_ctx)
 	return rib_nl_kernel_publish(obj);
 }
 
+static void rib_nl_dp_release(void *obj, void *hint)
+{
+	route_broker_data_release(obj);
+}
+
+/*
+ * A shared object is sent as it is, holding a ref on it until ZMQ is
+ * done with it, rather than being copied into a frame.
+ */
 int
 rib_nl_dp_publish_route(void *obj, void *client_ctx)
 {
 	const struct nlmsghdr *nlmsg = obj;
 	zsock_t *dp_data_sock = client_ctx;
 	zframe_t *frame;
+	zmq_msg_t msg;
+	int err;
 	int rc;
 
+	if (route_broker_data_hold(obj)) {
+		if (zmq_msg_init_data(&msg, obj, nlmsg->nlmsg_len,
+				      rib_nl_dp_release, NULL) < 0) {
+			err = errno;
+			route_broker_data_release(obj);
+			errno = err;
+			return -1;
+		}
+		rc = zmq_msg_send(&msg, zsock_resolve(dp_data_sock),
+				  ZMQ_DONTWAIT);
+		if (rc < 0) {
+			/* Drops the ref, keeping errno for the caller */
+			err = errno;
+			zmq_msg_close(&msg);
+			errno = err;
+			return -1;
+		}
+		return 0;
+	}
+
 	frame = zframe_new(nlmsg, nlmsg->nlmsg_len);
 	if (!frame)
 		return -1;
@@ -593,12 +2030,431 @@ rib_nl_dp_publish_route(void *obj, void *client_ctx)
 	return rc;
 }
 
+/*
+ * A batch packed into a frame. Dataplanes at the same place in the
+ * broker are sent the same batches, so the frame is kept a while to be
+ * sent as it is to the others, rather than each packing its own. It
+ * holds a ref on each of the objects in it, so that none of them can be
+ * freed and another take its place while it is kept.
+ */
+struct rib_nl_dp_frame {
+	uint32_t refcount;
+	unsigned int count;
+	size_t len;
+	uint8_t *buf;
+	void *objs[];
+};
+
+static pthread_mutex_t rib_nl_dp_frames_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rib_nl_dp_frame *rib_nl_dp_frames[RIB_NL_DP_FRAMES];
+static unsigned int rib_nl_dp_frames_next;
+
+static void rib_nl_dp_pack(uint8_t *buf, void **objs, unsigned int count)
+{
+	const struct nlmsghdr *nlmsg;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		nlmsg = objs[i];
+		memcpy(buf, nlmsg, nlmsg->nlmsg_len);
+		memset(buf + nlmsg->nlmsg_len, 0,
+		       NLMSG_ALIGN(nlmsg->nlmsg_len) - nlmsg->nlmsg_len);
+		buf += NLMSG_ALIGN(nlmsg->nlmsg_len);
+	}
+}
+
+static void rib_nl_dp_frame_put(struct rib_nl_dp_frame *frame)
+{
+	unsigned int i;
+
+	if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < frame->count; i++)
+		route_broker_data_release(frame->objs[i]);
+	free(frame);
+}
+
+static void rib_nl_dp_frame_release(void *data, void *hint)
+{
+	rib_nl_dp_frame_put(hint);
+}
+
+/* A kept frame of the same objects, with a ref taken on it, or NULL */
+static struct rib_nl_dp_frame *rib_nl_dp_frame_find(void **objs,
+						    unsigned int count)
+{
+	struct rib_nl_dp_frame *frame;
+	unsigned int i;
+
+	pthread_mutex_lock(&rib_nl_dp_frames_mutex);
+	for (i = 0; i < RIB_NL_DP_FRAMES; i++) {
+		frame = rib_nl_dp_frames[i];
+		if (frame && frame->count == count &&
+		    !memcmp(frame->objs, objs, count * sizeof(*objs))) {
+			__atomic_add_fetch(&frame->refcount, 1,
+					   __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&rib_nl_dp_frames_mutex);
+			return frame;
+		}
+	}
+	pthread_mutex_unlock(&rib_nl_dp_frames_mutex);
+	return NULL;
+}
+
+/* Pack a new frame, and keep it in place of the oldest one kept */
+static struct rib_nl_dp_frame *rib_nl_dp_frame_pack(void **objs,
+						    unsigned int count,
+						    size_t len)
+{
+	struct rib_nl_dp_frame *frame, *old;
+	unsigned int i;
+
+	frame = malloc(sizeof(*frame) + count * sizeof(*objs) + len);
+	if (!frame)
+		return NULL;
+
+	/* One for the caller and one for keeping it */
+	frame->refcount = 2;
+	frame->count = count;
+	frame->len = len;
+	frame->buf = (uint8_t *)(frame->objs + count);
+	memcpy(frame->objs, objs, count * sizeof(*objs));
+	for (i = 0; i < count; i++)
+		route_broker_data_hold(objs[i]);
+	rib_nl_dp_pack(frame->buf, objs, count);
+
+	pthread_mutex_lock(&rib_nl_dp_frames_mutex);
+	old = rib_nl_dp_frames[rib_nl_dp_frames_next];
+	rib_nl_dp_frames[rib_nl_dp_frames_next] = frame;
+	rib_nl_dp_frames_next = (rib_nl_dp_frames_next + 1) %
+		RIB_NL_DP_FRAMES;
+	pthread_mutex_unlock(&rib_nl_dp_frames_mutex);
+
+	if (old)
+		rib_nl_dp_frame_put(old);
+	return frame;
+}
+
+void rib_nl_dp_publish_flush(void)
+{
+	struct rib_nl_dp_frame *frame;
+	unsigned int i;
+
+	for (i = 0; i < RIB_NL_DP_FRAMES; i++) {
+		pthread_mutex_lock(&rib_nl_dp_frames_mutex);
+		frame = rib_nl_dp_frames[i];
+		rib_nl_dp_frames[i] = NULL;
+		pthread_mutex_unlock(&rib_nl_dp_frames_mutex);
+		if (frame)
+			rib_nl_dp_frame_put(frame);
+	}
+}
+
+/*
+ * Send a frame of shared objects by reference, taking the one already
+ * packed for another dataplane if there is one.
+ */
+static int rib_nl_dp_publish_shared(void **objs, unsigned int count,
+				    size_t len, zsock_t *dp_data_sock)
+{
+	struct rib_nl_dp_frame *frame;
+	zmq_msg_t msg;
+	int err;
+
+	frame = rib_nl_dp_frame_find(objs, count);
+	if (frame) {
+		__atomic_add_fetch(&rib_nl_dp_frames_shared, 1,
+				   __ATOMIC_RELAXED);
+	} else {
+		frame = rib_nl_dp_frame_pack(objs, count, len);
+		if (!frame)
+			return -1;
+		__atomic_add_fetch(&rib_nl_dp_frames_packed, 1,
+				   __ATOMIC_RELAXED);
+	}
+
+	if (zmq_msg_init_data(&msg, frame->buf, frame->len,
+			      rib_nl_dp_frame_release, frame) < 0) {
+		err = errno;
+		rib_nl_dp_frame_put(frame);
+		errno = err;
+		return -1;
+	}
+	if (zmq_msg_send(&msg, zsock_resolve(dp_data_sock),
+			 ZMQ_DONTWAIT) < 0) {
+		/* Drops the ref, keeping errno for the caller */
+		err = errno;
+		zmq_msg_close(&msg);
+		errno = err;
+		return -1;
+	}
+	return count;
+}
+
+/* How many of the messages fit in a frame, and how long they are */
+static unsigned int rib_nl_dp_batch_len(void **objs, unsigned int count,
+					size_t *len)
+{
+	const struct nlmsghdr *nlmsg;
+	unsigned int n;
+
+	*len = 0;
+	for (n = 0; n < count; n++) {
+		nlmsg = objs[n];
+		if (n && *len + NLMSG_ALIGN(nlmsg->nlmsg_len) >
+		    RIB_NL_DP_BATCH_BYTES)
+			break;
+		*len += NLMSG_ALIGN(nlmsg->nlmsg_len);
+	}
+	return n;
+}
+
+/*
+ * Pack the messages into a frame, as many as fit. One on its own is sent
+ * as rib_nl_dp_publish_route() would, without a copy if it is shared,
+ * and shared ones are packed once for all the dataplanes sent them.
+ */
+int rib_nl_dp_publish_batch(void **objs, unsigned int count, void *client_ctx)
+{
+	zsock_t *dp_data_sock = client_ctx;
+	zframe_t *frame;
+	size_t len;
+	unsigned int n;
+	int err;
+
+	n = rib_nl_dp_batch_len(objs, count, &len);
+	if (n == 1)
+		return rib_nl_dp_publish_route(objs[0], client_ctx) ? -1 : 1;
+
+	if (route_broker_obj_size)
+		return rib_nl_dp_publish_shared(objs, n, len, dp_data_sock);
+
+	frame = zframe_new(NULL, len);
+	if (!frame)
+		return -1;
+
+	rib_nl_dp_pack(zframe_data(frame), objs, n);
+
+	if (zframe_send(&frame, dp_data_sock, ZFRAME_DONTWAIT) < 0) {
+		err = errno;
+		zframe_destroy(&frame);
+		errno = err;
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Messages as routes usually are, for deflate to find matches in from
+ * the start of each frame. The most common go last, where they are the
+ * nearest.
+ */
+static uint8_t rib_nl_deflate_dict[512];
+static size_t rib_nl_deflate_dict_len;
+
+/* Compression state, and buffers, for each thread that compresses */
+struct rib_nl_deflate {
+	z_stream zs;
+	uint8_t in[RIB_NL_DP_BATCH_BYTES];
+	size_t out_len;
+	uint8_t *out;
+};
+
+static pthread_once_t rib_nl_deflate_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rib_nl_deflate_key;
+static __thread struct rib_nl_deflate *rib_nl_deflate;
+
+static void rib_nl_deflate_dict_attr(uint8_t **pos, unsigned short type,
+				     const void *data, unsigned short len)
+{
+	struct rtattr rta = {
+		.rta_len = RTA_LENGTH(len),
+		.rta_type = type,
+	};
+
+	memcpy(*pos, &rta, sizeof(rta));
+	memcpy(*pos + sizeof(rta), data, len);
+	*pos += RTA_SPACE(len);
+}
+
+static void rib_nl_deflate_dict_route(uint8_t **pos, unsigned short type,
+				      unsigned char family)
+{
+	uint8_t addr[16] = { 0 };
+	unsigned short addr_len = family == AF_INET ? 4 : 16;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)*pos;
+	struct rtmsg *rtm = NLMSG_DATA(nlh);
+	uint32_t table = RT_TABLE_MAIN;
+	uint32_t oif = 2;
+	uint32_t priority = 20;
+
+	memset(nlh, 0, NLMSG_SPACE(sizeof(*rtm)));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	if (type == RTM_NEWROUTE)
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	rtm->rtm_family = family;
+	rtm->rtm_dst_len = family == AF_INET ? 24 : 64;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_ZEBRA;
+	rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+	rtm->rtm_type = RTN_UNICAST;
+	*pos += NLMSG_SPACE(sizeof(*rtm));
+
+	rib_nl_deflate_dict_attr(pos, RTA_TABLE, &table, sizeof(table));
+	rib_nl_deflate_dict_attr(pos, RTA_DST, addr, addr_len);
+	rib_nl_deflate_dict_attr(pos, RTA_PRIORITY, &priority,
+				 sizeof(priority));
+	if (type == RTM_NEWROUTE) {
+		rib_nl_deflate_dict_attr(pos, RTA_GATEWAY, addr, addr_len);
+		rib_nl_deflate_dict_attr(pos, RTA_OIF, &oif, sizeof(oif));
+	}
+	nlh->nlmsg_len = *pos - (uint8_t *)nlh;
+}
+
+static void rib_nl_deflate_free(void *arg)
+{
+	struct rib_nl_deflate *state = arg;
+
+	deflateEnd(&state->zs);
+	free(state->out);
+	free(state);
+	rib_nl_deflate = NULL;
+}
+
+static void rib_nl_deflate_init(void)
+{
+	uint8_t *pos = rib_nl_deflate_dict;
+
+	rib_nl_deflate_dict_route(&pos, RTM_DELROUTE, AF_INET6);
+	rib_nl_deflate_dict_route(&pos, RTM_NEWROUTE, AF_INET6);
+	rib_nl_deflate_dict_route(&pos, RTM_DELROUTE, AF_INET);
+	rib_nl_deflate_dict_route(&pos, RTM_NEWROUTE, AF_INET);
+	rib_nl_deflate_dict_len = pos - rib_nl_deflate_dict;
+	assert(rib_nl_deflate_dict_len <= sizeof(rib_nl_deflate_dict));
+
+	pthread_key_create(&rib_nl_deflate_key, rib_nl_deflate_free);
+}
+
+const void *rib_nl_dp_deflate_dict(size_t *len)
+{
+	pthread_once(&rib_nl_deflate_once, rib_nl_deflate_init);
+	*len = rib_nl_deflate_dict_len;
+	return rib_nl_deflate_dict;
+}
+
+/*
+ * Speed matters more than size, as compressing is only worth it if it
+ * gets the batch to the dataplane sooner.
+ */
+static struct rib_nl_deflate *rib_nl_deflate_get(void)
+{
+	struct rib_nl_deflate *state = rib_nl_deflate;
+
+	if (state)
+		return state;
+
+	pthread_once(&rib_nl_deflate_once, rib_nl_deflate_init);
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
+
+	if (deflateInit(&state->zs, Z_BEST_SPEED) != Z_OK) {
+		free(state);
+		return NULL;
+	}
+
+	state->out_len = deflateBound(&state->zs, RIB_NL_DP_BATCH_BYTES);
+	state->out = malloc(state->out_len);
+	if (!state->out) {
+		deflateEnd(&state->zs);
+		free(state);
+		return NULL;
+	}
+
+	pthread_setspecific(rib_nl_deflate_key, state);
+	rib_nl_deflate = state;
+	return state;
+}
+
+/*
+ * Compress the packed messages, each frame on its own so that the
+ * dataplane needs nothing from the frames before. Returns the length,
+ * or 0 if they could not be.
+ */
+static size_t rib_nl_deflate_batch(struct rib_nl_deflate *state, size_t len)
+{
+	z_stream *zs = &state->zs;
+
+	if (deflateReset(zs) != Z_OK ||
+	    deflateSetDictionary(zs, rib_nl_deflate_dict,
+				 rib_nl_deflate_dict_len) != Z_OK)
+		return 0;
+
+	zs->next_in = state->in;
+	zs->avail_in = len;
+	zs->next_out = state->out;
+	zs->avail_out = state->out_len;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+		return 0;
+
+	return state->out_len - zs->avail_out;
+}
+
+int rib_nl_dp_publish_deflate(void **objs, unsigned int count,
+			      void *client_ctx)
+{
+	struct ob_deflate_hdr hdr = { 0 };
+	zsock_t *dp_data_sock = client_ctx;
+	struct rib_nl_deflate *state;
+	zframe_t *frame;
+	size_t out;
+	size_t len;
+	unsigned int n;
+	int err;
+
+	if (count < RIB_NL_DP_DEFLATE_MIN)
+		return rib_nl_dp_publish_batch(objs, count, client_ctx);
+
+	n = rib_nl_dp_batch_len(objs, count, &len);
+	state = rib_nl_deflate_get();
+	if (n < RIB_NL_DP_DEFLATE_MIN || !state)
+		return rib_nl_dp_publish_batch(objs, n, client_ctx);
+
+	rib_nl_dp_pack(state->in, objs, n);
+	out = rib_nl_deflate_batch(state, len);
+	if (!out)
+		return rib_nl_dp_publish_batch(objs, n, client_ctx);
+
+	frame = zframe_new(NULL, sizeof(hdr) + out);
+	if (!frame)
+		return -1;
+
+	hdr.len = len;
+	memcpy(zframe_data(frame), &hdr, sizeof(hdr));
+	memcpy(zframe_data(frame) + sizeof(hdr), state->out, out);
+
+	if (zframe_send(&frame, dp_data_sock, ZFRAME_DONTWAIT) < 0) {
+		err = errno;
+		zframe_destroy(&frame);
+		errno = err;
+		return -1;
+	}
+
+	route_broker_count(rib_nl_dp_deflated);
+	__atomic_add_fetch(&rib_nl_dp_deflate_in, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&rib_nl_dp_deflate_out, sizeof(hdr) + out,
+			   __ATOMIC_RELAXED);
+	return n;
+}
+
 void *rib_nl_copy(const void *obj)
 {
 	const struct nlmsghdr *nl = obj;
 	struct nlmsghdr *nl_copy;
 
-	nl_copy = malloc(nl->nlmsg_len);
+	nl_copy = route_pool_alloc(nl->nlmsg_len);
 	if (!nl_copy)
 		return NULL;
 
@@ -608,9 +2464,22 @@ void *rib_nl_copy(const void *obj)
 
 void rib_nl_free(void *obj)
 {
-	free(obj);
+	route_pool_free(obj);
+}
+
+size_t rib_nl_size(const void *obj)
+{
+	const struct nlmsghdr *nl = obj;
+
+	return nl->nlmsg_len;
 }
 
+/* Tells a dataplane to forget the routes and groups it has */
+static const struct nlmsghdr rib_nl_flush = {
+	.nlmsg_len = sizeof(struct nlmsghdr),
+	.nlmsg_type = NLMSG_OVERRUN,
+};
+
 int route_broker_init_all(const struct route_broker_init *init)
 {
 	struct object_broker_init obj_init = { 0 };
@@ -622,14 +2491,25 @@ int route_broker_init_all(const struct route_broker_init *init)
 		obj_init.log_debug = init->log_debug;
 		obj_init.log_error = init->log_error;
 		obj_init.log_arg = init->log_arg;
+		obj_init.seq_log = init->seq_log;
+		obj_init.lag_limit = init->lag_limit;
+		obj_init.sched = init->sched;
 	}
 	obj_init.topic_gen = route_topic;
+	obj_init.key_gen = route_key_gen;
 	obj_init.copy_obj = rib_nl_copy;
 	obj_init.free_obj = rib_nl_free;
+	obj_init.obj_type = route_obj_type;
+	obj_init.obj_size = rib_nl_size;
+	obj_init.flush_obj = &rib_nl_flush;
 
 	client[0].cfg_file = cfgfile;
 	client[0].type = OB_CLIENT_DP_ZSOCK;
 	client[0].client_publish = rib_nl_dp_publish_route;
+	client[0].client_publish_batch = rib_nl_dp_publish_batch;
+	client[0].client_publish_deflate = rib_nl_dp_publish_deflate;
+	client[0].client_deflate_dict =
+		rib_nl_dp_deflate_dict(&client[0].client_deflate_dict_len);
 
 	if (init && init->kernel_publish) {
 		rib_nl_kernel_publish = init->kernel_publish;
@@ -10,6 +10,7 @@
 #define __ROUTE_BROKER_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <linux/netlink.h>
 
 enum route_priority {
@@ -19,6 +20,38 @@ enum route_priority {
 	ROUTE_PRIORITY_MAX = 3,
 };
 
+/*
+ * Most route priority levels there can be. There are ROUTE_PRIORITY_MAX
+ * unless more are asked for, and routes published at a priority past
+ * the last level go in the last level.
+ */
+#define ROUTE_PRIORITY_LEVELS_MAX 8
+
+/* How clients are given objects from the route priority levels */
+enum route_broker_sched_type {
+	/* All of the highest priority level that has any first */
+	ROUTE_SCHED_STRICT,
+	/* Up to 'quantum' objects from each level in turn */
+	ROUTE_SCHED_WRR,
+	/*
+	 * Up to 'quantum' bytes from each level in turn, with any overrun
+	 * taken off the next turn. Objects without a size count as 1.
+	 */
+	ROUTE_SCHED_DRR,
+};
+
+/*
+ * Nexthop groups are given to clients before any route level, whatever
+ * the scheduling.
+ */
+struct route_broker_sched {
+	enum route_broker_sched_type type;
+	/* Number of route priority levels, ROUTE_PRIORITY_MAX if 0 */
+	unsigned int levels;
+	/* Per level, 0 for the default of the type */
+	uint32_t quantum[ROUTE_PRIORITY_LEVELS_MAX];
+};
+
 /*
  * Callback for formatted show/log output
  */
@@ -49,6 +82,22 @@ struct route_broker_init {
 
 	/* Argument to provide with log callbacks */
 	void *log_arg;
+
+	/*
+	 * Track client positions as sequence ids in an id ordered log,
+	 * rather than as markers in the object lists.
+	 */
+	bool seq_log;
+
+	/*
+	 * How many changes a client can get behind in a priority level
+	 * before it is resynced with the whole table, 0 for no limit. Only
+	 * dataplanes that take OB_DATA_FORMAT_FLUSH are held to it.
+	 */
+	uint64_t lag_limit;
+
+	/* Priority levels, and how clients are given objects from them */
+	struct route_broker_sched sched;
 };
 
 /*
@@ -59,12 +108,106 @@ struct route_broker_init {
 typedef int (*object_broker_topic_gen_cb) (void *obj, char *buf, size_t len,
 					bool *delete);
 
+/* Longest key that an object_broker_key_gen_cb can generate */
+#define OBJECT_BROKER_KEY_LEN 64
+
+/*
+ * Generate a binary key for the given object, of at most len bytes.
+ * Returns the length of the key, or <= 0 if the object is to be ignored.
+ *
+ * delete should be set to true if this is a delete of an object
+ */
+typedef int (*object_broker_key_gen_cb) (void *obj, void *key, size_t len,
+					 bool *delete);
+
 typedef void *(*object_broker_copy_obj_cb) (const void *obj);
 
 typedef void (*object_broker_free_obj_cb) (void *obj);
 
+typedef size_t (*object_broker_obj_size_cb) (const void *obj);
+
 typedef int (*object_broker_client_publish_cb) (void *obj, void *client_ctx);
 
+/*
+ * Send as many of the objects as fit in one frame, at least one. Returns
+ * the number sent, or -1 with errno set.
+ */
+typedef int (*object_broker_client_publish_batch_cb) (void **objs,
+						      unsigned int count,
+						      void *client_ctx);
+
+/*
+ * Set in the data format sent to a dataplane in the ACCEPT if it asked
+ * for batches in its CONNECT, and the client can send them. Each frame
+ * then holds one or more objects rather than just one. For netlink the
+ * messages are back to back, each padded to NLMSG_ALIGN.
+ */
+#define OB_DATA_FORMAT_BATCH (1u << 31)
+
+/*
+ * Set in the ACCEPT if the dataplane asked for it in its CONNECT. The
+ * dataplane is then sent no more messages, objects not frames, than the
+ * credit it has been given. It starts with the credit in the config,
+ * and is given more by each CREDIT it sends on the control socket.
+ */
+#define OB_DATA_FORMAT_CREDIT (1u << 30)
+
+/*
+ * Set in the ACCEPT if the dataplane asked for it, along with batches,
+ * in its CONNECT. The ACCEPT then has the deflate dictionary after the
+ * data format. Batches of netlink messages sent while the dataplane is
+ * catching up, large ones, are compressed with it, zlib format, one
+ * stream per frame. Such a frame starts with struct ob_deflate_hdr, the
+ * zero first word of which no netlink message has. Once caught up the
+ * dataplane is sent uncompressed frames again.
+ */
+#define OB_DATA_FORMAT_DEFLATE (1u << 29)
+
+struct ob_deflate_hdr {
+	uint32_t zero;
+	/* Of the batch once inflated */
+	uint32_t len;
+};
+
+/*
+ * Set in the ACCEPT if the dataplane asked for it in its CONNECT, and
+ * the session can be resumed. A CONNECT asking for it has one more
+ * frame, a u64 count of the messages the dataplane applied from the
+ * session it had, 0 for none. If the session is still kept, with the
+ * same formats, and has the messages after those, the ACCEPT also has
+ * OB_DATA_FORMAT_RESUMED set and the data url of the session, which
+ * carries on from the message after the last applied, with the credit
+ * in the config again. Otherwise the dataplane starts again from the
+ * start with a new session.
+ *
+ * A resumable session is kept for the grace in the config after the
+ * dataplane is last heard from on the control socket.
+ */
+#define OB_DATA_FORMAT_RESUME (1u << 28)
+#define OB_DATA_FORMAT_RESUMED (1u << 27)
+
+/*
+ * Set in the ACCEPT if the dataplane asked for it in its CONNECT, and
+ * there is a flush object. The dataplane is then resynced if it gets
+ * over the lag limit, rather than the deletes it has still to be sent
+ * being kept for it. It is sent the flush object, for netlink an
+ * NLMSG_OVERRUN header, on which it must forget all the objects it has
+ * been sent, then all of the objects as they are.
+ */
+#define OB_DATA_FORMAT_FLUSH (1u << 26)
+
+enum object_broker_obj_type {
+	OB_OBJ_ROUTE,
+	/*
+	 * Routes can refer to a nexthop group. The group reaches clients
+	 * before any routes published after it, and a delete of it after
+	 * any routes published before the delete.
+	 */
+	OB_OBJ_NEXTHOP_GROUP,
+};
+
+typedef enum object_broker_obj_type (*object_broker_obj_type_cb) (void *obj);
+
 struct object_broker_init {
 	/* Topic generation */
 	object_broker_topic_gen_cb topic_gen;
@@ -89,6 +232,45 @@ struct object_broker_init {
 
 	/* Argument to provide with log callbacks */
 	void *log_arg;
+
+	/*
+	 * Track client positions as sequence ids in an id ordered log,
+	 * rather than as markers in the object lists.
+	 */
+	bool seq_log;
+
+	/*
+	 * Changes a client can get behind before resync, 0 for no limit.
+	 * Only clients that can take flush_obj are held to it.
+	 */
+	uint64_t lag_limit;
+
+	/*
+	 * Object sent to a client that is resynced, telling it to forget
+	 * all the objects it has, as deletes it missed are not kept for it.
+	 * Clients are never resynced if NULL.
+	 */
+	const void *flush_obj;
+
+	/*
+	 * Binary key the object is found by. If NULL the topic is used as
+	 * the key, otherwise the topic is only generated to show objects.
+	 */
+	object_broker_key_gen_cb key_gen;
+
+	/* Type of the object, all are OB_OBJ_ROUTE if NULL */
+	object_broker_obj_type_cb obj_type;
+
+	/*
+	 * Size of the object. If given, the object is copied this many
+	 * bytes into the broker, and that copy is shared by all the
+	 * clients, which must not change it. copy_obj and free_obj are
+	 * then not needed. If NULL each client gets its own copy.
+	 */
+	object_broker_obj_size_cb obj_size;
+
+	/* Priority levels, and how clients are given objects from them */
+	struct route_broker_sched sched;
 };
 
 enum object_broker_client_type {
@@ -103,6 +285,12 @@ struct object_broker_client_init {
 
 	object_broker_client_publish_cb client_publish;
 
+	/*
+	 * Optional for OB_CLIENT_DP_ZSOCK, used instead of client_publish
+	 * for dataplanes that take batches.
+	 */
+	object_broker_client_publish_batch_cb client_publish_batch;
+
 	/* path to config file - required for OB_CLIENT_DP_ZSOCK */
 	const char *cfg_file;
 
@@ -111,18 +299,95 @@ struct object_broker_client_init {
 	 * broker - required for OB_CLIENT_DP_ZSOCK.
 	 */
 	uint32_t client_data_format;
+
+	/*
+	 * Optional for OB_CLIENT_DP_ZSOCK, used instead of
+	 * client_publish_batch for dataplanes that take compressed
+	 * batches, along with the dictionary they are compressed with.
+	 */
+	object_broker_client_publish_batch_cb client_publish_deflate;
+	const void *client_deflate_dict;
+	size_t client_deflate_dict_len;
 };
 
 /*
  * Take a netlink route message. Parse it to check it is a route, and if it
  * is then update the broker with it. This can be either an add, modify
- * or delete.
+ * or delete. Nexthop group messages are taken too, the priority is not
+ * used for those.
  */
 void route_broker_publish(const struct nlmsghdr *nlmsg, enum route_priority);
 
 void route_broker_show(route_broker_fmt_cb cli_out, void *cli);
 void route_broker_show_summary(route_broker_fmt_cb cli_out, void *cli);
 
+/* The objects a paged show is of, 0 in a field matches anything */
+struct route_broker_show_filter {
+	/*
+	 * Route priority levels, 1 << priority for each. Nexthop groups
+	 * are only shown when all levels are.
+	 */
+	uint32_t levels;
+	/* Address family and table, only ever matching netlink objects */
+	uint8_t family;
+	uint32_t table;
+};
+
+/* Longest key of an object, made by key_gen or as its topic */
+#define ROUTE_BROKER_KEY_LEN 184
+
+/*
+ * Where a paged show got to. Levels are numbered by priority, with the
+ * nexthop groups after the route levels, and in each level the objects
+ * are shown from the highest id down.
+ */
+struct route_broker_show_pos {
+	int level;
+	/* The last object walked in the level, 0 for none yet */
+	uint64_t id;
+	/* The key of that object, to find where it is in the level */
+	uint16_t key_len;
+	uint8_t key[ROUTE_BROKER_KEY_LEN];
+	/*
+	 * The top id of each level when the show started. Objects above it
+	 * have been added or changed since.
+	 */
+	uint64_t top[ROUTE_PRIORITY_LEVELS_MAX + 1];
+};
+
+struct route_broker_show_cursor;
+
+/*
+ * Start a paged show of the objects matching the filter, all if NULL.
+ * The show is of the objects as they are now, however long it takes to
+ * get through, and the broker is only locked while each page is taken.
+ * If 'from' is given the show carries on from that position in a show
+ * before. It shows the objects that show had not got to, and those that
+ * have been added or changed since it started, in any level, all as they
+ * are now. The show goes straight on from the object the show before
+ * got to, unless that has changed since, in which case its level is
+ * walked again to get back to where it was, so the first pages can show
+ * nothing.
+ *
+ * Only so many objects that change before the show gets to them are
+ * kept as they were. If more change, as they can in a show left part
+ * way, the rest of the level is not shown. Returns NULL if out of
+ * memory.
+ */
+struct route_broker_show_cursor *
+route_broker_show_start(const struct route_broker_show_filter *filter,
+			const struct route_broker_show_pos *from);
+/*
+ * Show up to 'max' more objects, fewer if some do not match the filter.
+ * Returns false once there are no more.
+ */
+bool route_broker_show_page(struct route_broker_show_cursor *cursor,
+			    route_broker_fmt_cb cli_out, void *cli,
+			    unsigned int max);
+void route_broker_show_get_pos(struct route_broker_show_cursor *cursor,
+			       struct route_broker_show_pos *pos);
+void route_broker_show_end(struct route_broker_show_cursor *cursor);
+
 /* Init broker and vplaned broker client */
 int route_broker_init_all(const struct route_broker_init *init);
 void route_broker_shutdown_all(void);
@@ -136,4 +401,17 @@ void object_broker_shutdown_all(void);
 
 void object_broker_publish(void *obj, int route_priority);
 
+struct object_broker_msg {
+	void *obj;
+	int pri;
+};
+
+/*
+ * Publish a number of objects, in order, as object_broker_publish would,
+ * but taking the locks and waking the clients once for the lot rather
+ * than once for each.
+ */
+void object_broker_publish_batch(const struct object_broker_msg *msgs,
+				 unsigned int count);
+
 #endif /* __ROUTE_BROKER_H__ */
@@ -22,14 +22,28 @@ enum rib_broker_dp_request {
 	RIB_BROKER_DP_REQ_ERROR,
 	RIB_BROKER_DP_REQ_CONNECT,
 	RIB_BROKER_DP_REQ_KEEPALIVE,
+	RIB_BROKER_DP_REQ_CREDIT,
 };
 
 struct rib_broker_cfg {
 	struct in_addr local_ip;	/* local ip of tunnel */
 	char *rib_dp_ctrl_url;		/* url of rib broker server */
 	char *rib_dp_data_url;		/* url of rib broker server */
+	uint32_t hwm;			/* frames queued to a dataplane */
+	uint32_t credit;		/* first credit of a dataplane */
+	uint32_t workers;		/* threads shared by the dataplanes */
+	uint32_t resume_grace;		/* ms a session is kept, 0 for none */
+	uint32_t resume_ring;		/* messages kept to resume with */
 };
 
+#define RIB_BROKER_DP_HWM_DEFAULT 500
+#define RIB_BROKER_DP_CREDIT_DEFAULT 500
+#define RIB_BROKER_DP_RESUME_GRACE_DEFAULT 10000
+#define RIB_BROKER_DP_RESUME_RING_DEFAULT 32768
+
+/* How often to look for resumable dataplanes gone past their grace */
+#define RIB_BROKER_DP_RESUME_CHECK_MS 1000
+
 struct dp_ctrl_client_args {
 	const char *cfgfile;
 	uint32_t data_format;
@@ -39,7 +53,14 @@ static struct rib_broker_cfg rib_broker_cfg;
 
 static zactor_t *broker_dp_ctrl_thread;
 
-static object_broker_client_publish_cb broker_dp_client_publish;
+/*
+ * If configured, the workers the dataplanes are shared between, and how
+ * many each has. Otherwise each dataplane has a thread of its own.
+ */
+static zactor_t **dp_workers;
+static uint32_t *dp_worker_sessions;
+
+static struct object_broker_client_init broker_dp_client;
 
 /*
  * Hash table of connected vplanes, keyed using the uuid.
@@ -51,6 +72,11 @@ struct dp {
 	zframe_t *envelope;	/* To make sure we send back to correct dp */
 	zsock_t *ipc;		/* ipc pipe between ctrl thread and dp thread */
 	char *data_url;
+	uint32_t worker;	/* or the worker the dp is on */
+	void *session;		/* and its session there */
+	uint32_t formats;	/* agreed with the dp */
+	bool resumable;
+	int64_t last_heard;	/* zclock_mono() of the last message */
 };
 
 static int copy_str(char **str_ref, const char *value)
@@ -65,6 +91,20 @@ static int parse_ipaddress(struct in_addr *addr, const char *str)
 	return inet_pton(AF_INET, str, &addr);
 }
 
+static int parse_u32(uint32_t *value, const char *str)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(str, &end, 0);
+	if (errno || end == str || *end || v > UINT32_MAX)
+		return 0;
+
+	*value = v;
+	return 1;
+}
+
 /*
  * Callback from inih library for each name value
  * return 0 = error, 1 = ok
@@ -81,6 +121,16 @@ static int parse_entry(void *user, const char *section,
 			return copy_str(&cfg->rib_dp_ctrl_url, value);
 		else if (strcmp(name, "data") == 0)
 			return copy_str(&cfg->rib_dp_data_url, value);
+		else if (strcmp(name, "hwm") == 0)
+			return parse_u32(&cfg->hwm, value);
+		else if (strcmp(name, "credit") == 0)
+			return parse_u32(&cfg->credit, value);
+		else if (strcmp(name, "workers") == 0)
+			return parse_u32(&cfg->workers, value);
+		else if (strcmp(name, "resume_grace") == 0)
+			return parse_u32(&cfg->resume_grace, value);
+		else if (strcmp(name, "resume_ring") == 0)
+			return parse_u32(&cfg->resume_ring, value);
 	}
 
 	return 1;	/* good */
@@ -91,6 +141,11 @@ parse_rib_config(const char *cfgfile, struct rib_broker_cfg *rib_broker_cfg)
 {
 	FILE *f = fopen(cfgfile, "r");
 
+	rib_broker_cfg->hwm = RIB_BROKER_DP_HWM_DEFAULT;
+	rib_broker_cfg->credit = RIB_BROKER_DP_CREDIT_DEFAULT;
+	rib_broker_cfg->resume_grace = RIB_BROKER_DP_RESUME_GRACE_DEFAULT;
+	rib_broker_cfg->resume_ring = RIB_BROKER_DP_RESUME_RING_DEFAULT;
+
 	if (f == NULL)
 		return false;
 
@@ -159,6 +214,34 @@ static int zmsg_popu32(zmsg_t *msg, uint32_t *p)
 	return 0;
 }
 
+static int zmsg_popu64(zmsg_t *msg, uint64_t *p)
+{
+	zframe_t *frame = zmsg_pop(msg);
+	if (frame == NULL) {
+		broker_log_err("popu64: missing message element");
+		return -1;
+	}
+
+	if (zframe_size(frame) != sizeof(uint64_t)) {
+		broker_log_err("popu64: wrong message size %zd",
+			       zframe_size(frame));
+		zframe_destroy(&frame);
+		return -1;
+	}
+
+	memcpy(p, zframe_data(frame), sizeof(uint64_t));
+	zframe_destroy(&frame);
+	return 0;
+}
+
+/* Is the next frame there and 'size' long, leaving it on the message */
+static bool zmsg_next_is_size(zmsg_t *msg, size_t size)
+{
+	zframe_t *frame = zmsg_first(msg);
+
+	return frame && zframe_size(frame) == size;
+}
+
 static enum rib_broker_dp_request broker_dp_ctrl_msg_request(char *msg_type)
 {
 	if (msg_type) {
@@ -166,18 +249,33 @@ static enum rib_broker_dp_request broker_dp_ctrl_msg_request(char *msg_type)
 			return RIB_BROKER_DP_REQ_CONNECT;
 		if (!strcmp(msg_type, "KEEPALIVE"))
 			return RIB_BROKER_DP_REQ_KEEPALIVE;
+		if (!strcmp(msg_type, "CREDIT"))
+			return RIB_BROKER_DP_REQ_CREDIT;
 	}
 	return RIB_BROKER_DP_REQ_ERROR;
 }
 
 /*
  * Control message should be:
- *   "CONNECT|KEEPALIVE" (string)
- *   <proto version>     (int)
- *   <uuid>              (string)
+ *   "CONNECT|KEEPALIVE|CREDIT" (string)
+ *   <proto version>            (int)
+ *   <uuid>                     (string)
+ *   <value>                    (int, optional)
+ *   <applied>                  (u64, CONNECT with OB_DATA_FORMAT_RESUME)
+ *
+ * For a CONNECT the value is the OB_DATA_FORMAT_* flags the dataplane
+ * can take, none if it is not there, as from older dataplanes. For a
+ * CREDIT it is the number of messages more the dataplane can take.
+ *
+ * Frames after these, or in their place with another size, are ones
+ * this broker does not know and are ignored, so that a dataplane that
+ * sends more still gets connected. Without the applied count a CONNECT
+ * is taken as not asking to resume.
  */
 static enum rib_broker_dp_request broker_dp_ctrl_msg_parse(zmsg_t *msg,
-							   char **uuid)
+							   char **uuid,
+							   uint32_t *value,
+							   uint64_t *applied)
 {
 	char *msg_type;
 	uint32_t proto_version;
@@ -186,7 +284,8 @@ static enum rib_broker_dp_request broker_dp_ctrl_msg_parse(zmsg_t *msg,
 	msg_type = zmsg_popstr(msg);
 	req = broker_dp_ctrl_msg_request(msg_type);
 	if (req == RIB_BROKER_DP_REQ_ERROR) {
-		broker_log_err("broker ctrl expected CONNECT|KEEPALIVE, got %s",
+		broker_log_err("broker ctrl expected CONNECT|KEEPALIVE|CREDIT, "
+			       "got %s",
 			       msg_type ? msg_type : "NULL");
 		free(msg_type);
 		return RIB_BROKER_DP_REQ_ERROR;
@@ -204,6 +303,31 @@ static enum rib_broker_dp_request broker_dp_ctrl_msg_parse(zmsg_t *msg,
 		return RIB_BROKER_DP_REQ_ERROR;
 	}
 
+	*value = 0;
+	*applied = 0;
+	if (req == RIB_BROKER_DP_REQ_CREDIT) {
+		if (zmsg_popu32(msg, value) < 0) {
+			broker_log_err("Could not get dataplane credit value");
+			free(*uuid);
+			*uuid = NULL;
+			return RIB_BROKER_DP_REQ_ERROR;
+		}
+		return req;
+	}
+
+	if (req != RIB_BROKER_DP_REQ_CONNECT ||
+	    !zmsg_next_is_size(msg, sizeof(uint32_t)) ||
+	    zmsg_popu32(msg, value) < 0)
+		return req;
+
+	if ((*value & OB_DATA_FORMAT_RESUME) &&
+	    (!zmsg_next_is_size(msg, sizeof(uint64_t)) ||
+	     zmsg_popu64(msg, applied) < 0)) {
+		broker_log_debug("Dataplane %s gave no messages applied, "
+				 "not resuming\n", *uuid);
+		*value &= ~OB_DATA_FORMAT_RESUME;
+	}
+
 	return req;
 }
 
@@ -250,6 +374,7 @@ static zmsg_t *broker_dp_ctrl_msg_prepare(const char *reply, const char *uuid,
  * <UUID>
  * <data url>
  * <data format>
+ * [<deflate dictionary>]	if OB_DATA_FORMAT_DEFLATE is set
  */
 static int broker_dp_ctrl_msg_accept(struct dp *dp, zsock_t *sock,
 				     const char *url, uint32_t data_format)
@@ -276,6 +401,14 @@ static int broker_dp_ctrl_msg_accept(struct dp *dp, zsock_t *sock,
 		return -1;
 	}
 
+	if ((data_format & OB_DATA_FORMAT_DEFLATE) &&
+	    zmsg_addmem(reply_msg, broker_dp_client.client_deflate_dict,
+			broker_dp_client.client_deflate_dict_len) < 0) {
+		broker_log_err("Could not add dictionary to broker control reply msg");
+		zmsg_destroy(&reply_msg);
+		return -1;
+	}
+
 	broker_log_debug("New broker dataplane reply %s, %s\n", dp->uuid, url);
 
 	return zmsg_send(&reply_msg, sock);
@@ -324,10 +457,18 @@ static void delete_dp(struct dp *dp)
 }
 
 /*
- * Stop the thread by sending the TERM signal down the pipe to the thread.
+ * Stop the thread by sending the TERM signal down the pipe to the thread,
+ * or have the worker drop the session.
  */
 static void stop_old_dp_thread(struct dp *dp)
 {
+	if (dp->session) {
+		zsock_send(dp_workers[dp->worker], "sp8", "DEL",
+			   dp->session, (uint64_t)0);
+		zsock_wait(dp_workers[dp->worker]);
+		dp_worker_sessions[dp->worker]--;
+		return;
+	}
 	zactor_destroy((zactor_t **) &dp->ipc);
 }
 
@@ -347,10 +488,81 @@ static void close_all_dp_sessions(void)
 	zhash_destroy(&dp_uuid_ht);
 }
 
+static void stop_dp_workers(void)
+{
+	uint32_t i;
+
+	for (i = 0; dp_workers && i < rib_broker_cfg.workers; i++)
+		zactor_destroy(&dp_workers[i]);
+	free(dp_workers);
+	free(dp_worker_sessions);
+	dp_workers = NULL;
+	dp_worker_sessions = NULL;
+}
+
+/* Start the workers, if there are to be any */
+static void start_dp_workers(void)
+{
+	uint32_t i;
+
+	if (!rib_broker_cfg.workers)
+		return;
+
+	dp_workers = calloc(rib_broker_cfg.workers, sizeof(*dp_workers));
+	dp_worker_sessions = calloc(rib_broker_cfg.workers,
+				    sizeof(*dp_worker_sessions));
+	if (!dp_workers || !dp_worker_sessions) {
+		broker_log_err("Could not allocate dp workers, using threads");
+		goto fail;
+	}
+
+	for (i = 0; i < rib_broker_cfg.workers; i++) {
+		dp_workers[i] = zactor_new(broker_dp_data_worker, NULL);
+		if (!dp_workers[i]) {
+			broker_log_err(
+				"Could not create dp worker, using threads");
+			goto fail;
+		}
+	}
+	return;
+
+fail:
+	stop_dp_workers();
+}
+
+/*
+ * Hand the dataplane to the worker with the fewest, and return the data
+ * url it is using.
+ */
+static char *start_dp_data_session(struct dp *dp,
+				   struct dp_data_client_args *args)
+{
+	char *url = NULL;
+	uint32_t i;
+
+	dp->worker = 0;
+	for (i = 1; i < rib_broker_cfg.workers; i++)
+		if (dp_worker_sessions[i] < dp_worker_sessions[dp->worker])
+			dp->worker = i;
+
+	zsock_send(dp_workers[dp->worker], "sp8", "ADD", args, (uint64_t)0);
+	if (zsock_recv(dp_workers[dp->worker], "ps", &dp->session, &url) < 0 ||
+	    !dp->session) {
+		broker_log_err("Could not start dp data session");
+		dp->session = NULL;
+		free(url);
+		return NULL;
+	}
+
+	dp_worker_sessions[dp->worker]++;
+	return url;
+}
+
 /*
- * Start a new data thread, and return the data url it is using.
+ * Start a new data thread, sending in the formats agreed with the
+ * dataplane, and return the data url it is using.
  */
-static char *start_new_dp_data_thread(struct dp *dp)
+static char *start_new_dp_data_thread(struct dp *dp, uint32_t formats)
 {
 	struct dp_data_client_args *args = calloc(1, sizeof(*args));
 
@@ -360,22 +572,99 @@ static char *start_new_dp_data_thread(struct dp *dp)
 	}
 
 	args->sock_ep = rib_broker_cfg.rib_dp_data_url;
-	args->client_publish = broker_dp_client_publish;
+	args->client_publish = broker_dp_client.client_publish;
+	if (formats & OB_DATA_FORMAT_BATCH)
+		args->client_publish_batch =
+			broker_dp_client.client_publish_batch;
+	if (formats & OB_DATA_FORMAT_DEFLATE)
+		args->client_publish_batch =
+			broker_dp_client.client_publish_deflate;
+	args->hwm = rib_broker_cfg.hwm;
+	args->credit_control = formats & OB_DATA_FORMAT_CREDIT;
+	args->credit = rib_broker_cfg.credit;
+	if (formats & OB_DATA_FORMAT_RESUME)
+		args->resume_ring = rib_broker_cfg.resume_ring;
+	args->flush = formats & OB_DATA_FORMAT_FLUSH;
+
+	if (dp_workers)
+		return start_dp_data_session(dp, args);
 
 	dp->ipc = (zsock_t *) zactor_new(broker_dp_data_client, args);
-	if (dp->ipc == NULL)
+	if (dp->ipc == NULL) {
 		broker_log_err("Could not create new zactor for dp data");
+		free(args);
+		return NULL;
+	}
 
 	/* New thread starts, and sends us the ep url on the pipe */
 	return zstr_recv(dp->ipc);
 }
 
+/*
+ * Have the session of the dataplane carry on after the messages it
+ * applied, returning the new data url, or NULL if it cannot.
+ */
+static char *resume_dp_data_session(struct dp *dp, uint64_t applied)
+{
+	char *url = NULL;
+
+	if (dp->session) {
+		if (zsock_send(dp_workers[dp->worker], "sp8", "RESUME",
+			       dp->session, applied) < 0 ||
+		    zsock_recv(dp_workers[dp->worker], "s", &url) < 0)
+			return NULL;
+	} else {
+		if (zstr_sendf(dp->ipc, "RESUME %" PRIu64, applied) < 0)
+			return NULL;
+		url = zstr_recv(dp->ipc);
+	}
+
+	if (url && !*url) {
+		free(url);
+		url = NULL;
+	}
+	return url;
+}
+
 static int process_connect_message(zsock_t *sock, zframe_t *envelope,
-				   char *uuid, uint32_t data_format)
+				   char *uuid, uint32_t data_format,
+				   uint32_t formats, uint64_t applied)
 {
 	struct dp *dp;
+	char *url;
+
+	/* Only those asked for that can be done, and deflate needs batches */
+	if (!broker_dp_client.client_publish_batch)
+		formats &= ~OB_DATA_FORMAT_BATCH;
+	if (!broker_dp_client.client_publish_deflate ||
+	    !(formats & OB_DATA_FORMAT_BATCH))
+		formats &= ~OB_DATA_FORMAT_DEFLATE;
+	if (!rib_broker_cfg.resume_grace || !rib_broker_cfg.resume_ring)
+		formats &= ~OB_DATA_FORMAT_RESUME;
+	if (!route_broker_flush_obj)
+		formats &= ~OB_DATA_FORMAT_FLUSH;
+	formats &= OB_DATA_FORMAT_BATCH | OB_DATA_FORMAT_CREDIT |
+		OB_DATA_FORMAT_DEFLATE | OB_DATA_FORMAT_RESUME |
+		OB_DATA_FORMAT_FLUSH;
 
 	dp = dp_findbyuuid(uuid);
+	if (dp && dp->resumable && dp->formats == formats) {
+		url = resume_dp_data_session(dp, applied);
+		if (url) {
+			broker_log_debug("Resume broker dataplane client %s "
+					 "at %" PRIu64 "\n", uuid, applied);
+			zframe_destroy(&dp->envelope);
+			dp->envelope = envelope;
+			free(uuid);
+			free(dp->data_url);
+			dp->data_url = url;
+			dp->last_heard = zclock_mono();
+			broker_dp_ctrl_msg_accept(dp, sock, dp->data_url,
+						  data_format | formats |
+						  OB_DATA_FORMAT_RESUMED);
+			return 0;
+		}
+	}
 	if (dp) {
 		broker_log_debug("Restart broker dataplane client %s\n", uuid);
 		close_dp_session(dp);
@@ -393,10 +682,24 @@ static int process_connect_message(zsock_t *sock, zframe_t *envelope,
 	dp->uuid = uuid;
 	dp_insert(dp);
 
-	dp->data_url = start_new_dp_data_thread(dp);
+	dp->data_url = start_new_dp_data_thread(dp, formats);
+	if (!dp->data_url) {
+		/* No ACCEPT, the dataplane will try again */
+		broker_log_err("No data session for dp %s", uuid);
+		close_dp_session(dp);
+		return 0;
+	}
+
+	/* The ring is only kept if the objects can be shared */
+	dp->formats = formats;
+	if (!route_broker_obj_size)
+		formats &= ~OB_DATA_FORMAT_RESUME;
+	dp->resumable = formats & OB_DATA_FORMAT_RESUME;
+	dp->last_heard = zclock_mono();
 
 	/* And send the ACCEPT back to the DP */
-	broker_dp_ctrl_msg_accept(dp, sock, dp->data_url, data_format);
+	broker_dp_ctrl_msg_accept(dp, sock, dp->data_url,
+				  data_format | formats);
 	return 0;
 }
 
@@ -406,19 +709,54 @@ process_keepalive_message(zsock_t *sock, zframe_t *envelope, const char *uuid)
 	struct dp *dp;
 
 	dp = dp_findbyuuid(uuid);
-	if (dp)
+	if (dp) {
 		/* DP is known, no need to reply */
+		dp->last_heard = zclock_mono();
 		return 0;
+	}
 
 	/* unknown DP - tell it to reconnect */
 	broker_dp_ctrl_msg_reconnect(sock, uuid, envelope);
 	return 0;
 }
 
+/*
+ * Pass the credit on to the data thread of the dataplane. These come
+ * often, so unlike the others the uuid and envelope are freed here.
+ */
+static int
+process_credit_message(zsock_t *sock, zframe_t *envelope, char *uuid,
+		       uint32_t credit)
+{
+	struct dp *dp;
+
+	dp = dp_findbyuuid(uuid);
+	if (!dp) {
+		/* unknown DP - tell it to reconnect */
+		broker_dp_ctrl_msg_reconnect(sock, uuid, envelope);
+		free(uuid);
+		return 0;
+	}
+
+	dp->last_heard = zclock_mono();
+	if (dp->session) {
+		if (zsock_send(dp_workers[dp->worker], "sp8", "CREDIT",
+			       dp->session, (uint64_t)credit) < 0)
+			broker_log_err("Could not pass credit to dp %s", uuid);
+	} else if (zstr_sendf(dp->ipc, "CREDIT %" PRIu32, credit) < 0) {
+		broker_log_err("Could not pass credit to dp %s", uuid);
+	}
+	zframe_destroy(&envelope);
+	free(uuid);
+	return 0;
+}
+
 static int process_ctrl_message(zloop_t *loop, zsock_t *sock, void *arg)
 {
 	struct dp_ctrl_client_args *args = arg;
 	enum rib_broker_dp_request req;
+	uint64_t applied;
+	uint32_t value;
 	char *uuid;
 	zframe_t *envelope;
 	zmsg_t *msg;
@@ -431,14 +769,17 @@ static int process_ctrl_message(zloop_t *loop, zsock_t *sock, void *arg)
 	 */
 	envelope = zmsg_unwrap(msg);
 
-	req = broker_dp_ctrl_msg_parse(msg, &uuid);
+	req = broker_dp_ctrl_msg_parse(msg, &uuid, &value, &applied);
 	zmsg_destroy(&msg);
 	switch (req) {
 	case RIB_BROKER_DP_REQ_CONNECT:
 		return process_connect_message(sock, envelope, uuid,
-					       args->data_format);
+					       args->data_format, value,
+					       applied);
 	case RIB_BROKER_DP_REQ_KEEPALIVE:
 		return process_keepalive_message(sock, envelope, uuid);
+	case RIB_BROKER_DP_REQ_CREDIT:
+		return process_credit_message(sock, envelope, uuid, value);
 	default:
 		break;
 	}
@@ -447,6 +788,30 @@ static int process_ctrl_message(zloop_t *loop, zsock_t *sock, void *arg)
 	return 0;
 }
 
+/*
+ * Close the sessions of resumable dataplanes not heard from within the
+ * grace. Others are kept until they connect again, as they always were.
+ */
+static int process_resume_timer(zloop_t *loop, int timer_id, void *arg)
+{
+	int64_t now = zclock_mono();
+	struct dp *dp;
+
+	do {
+		for (dp = zhash_first(dp_uuid_ht); dp;
+		     dp = zhash_next(dp_uuid_ht))
+			if (dp->resumable &&
+			    now - dp->last_heard > rib_broker_cfg.resume_grace)
+				break;
+		if (dp) {
+			broker_log_debug("Broker dataplane client %s gone\n",
+					 dp->uuid);
+			close_dp_session(dp);
+		}
+	} while (dp);
+	return 0;
+}
+
 /*
  * A new pthread that will control the creation of all the datapane consumers.
  */
@@ -462,6 +827,7 @@ static void broker_dp_ctrl(zsock_t *pipe, void *arg)
 		broker_log_err("Could not name rib broker dp ctrl thread");
 
 	parse_rib_config(cfgfile, &rib_broker_cfg);
+	start_dp_workers();
 	zsock_signal(pipe, 0);
 
 	dp_uuid_ht = zhash_new();
@@ -494,18 +860,21 @@ static void broker_dp_ctrl(zsock_t *pipe, void *arg)
 	zloop_reader(zloop, pipe, process_actor_message, pipe);
 	zloop_reader(zloop, broker_dp_ctrl_sock, process_ctrl_message,
 		     args);
+	if (rib_broker_cfg.resume_grace)
+		zloop_timer(zloop, RIB_BROKER_DP_RESUME_CHECK_MS, 0,
+			    process_resume_timer, NULL);
 
 	zloop_start(zloop);
 
 	close_all_dp_sessions();
+	stop_dp_workers();
 	zloop_destroy(&zloop);
 	zsock_destroy(&broker_dp_ctrl_sock);
 	free(args);
 }
 
-int route_broker_dataplane_ctrl_init(const char *cfgfile,
-				     object_broker_client_publish_cb publish,
-				     uint32_t data_format)
+int route_broker_dataplane_ctrl_init(
+	const struct object_broker_client_init *client)
 {
 	struct dp_ctrl_client_args *args;
 
@@ -513,10 +882,10 @@ int route_broker_dataplane_ctrl_init(const char *cfgfile,
 	if (!args)
 		return -1;
 
-	args->cfgfile = cfgfile;
-	args->data_format = data_format;
+	args->cfgfile = client->cfg_file;
+	args->data_format = client->client_data_format;
 
-	broker_dp_client_publish = publish;
+	broker_dp_client = *client;
 
 	broker_dp_ctrl_thread = zactor_new(broker_dp_ctrl, args);
 	if (broker_dp_ctrl_thread)
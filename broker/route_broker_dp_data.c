@@ -8,6 +8,7 @@
 #include <pthread.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <inttypes.h>
 
 #include <czmq.h>
 #include <zmq.h>
@@ -16,7 +17,8 @@
 #include "route_broker_internal.h"
 #include "route_broker_dp_data.h"
 
-static char *broker_dp_data_init(zsock_t **data_sock, const char *sock_ep)
+static char *broker_dp_data_init(zsock_t **data_sock, const char *sock_ep,
+				 uint32_t hwm)
 {
 	char ep_dir[PATH_MAX];
 	char *actual_ep;
@@ -27,7 +29,7 @@ static char *broker_dp_data_init(zsock_t **data_sock, const char *sock_ep)
 		assert(0);
 	}
 
-	zsock_set_sndhwm(*data_sock, 500);
+	zsock_set_sndhwm(*data_sock, hwm);
 
 	if (zsock_bind(*data_sock, "%s", sock_ep) < 0) {
 		broker_log_err("Socket to DP not initialised");
@@ -62,44 +64,395 @@ static char *broker_dp_data_init(zsock_t **data_sock, const char *sock_ep)
 	return actual_ep;
 }
 
-/* Client needs restarting if we have received the $TERM command on the pipe */
-static bool client_needs_restart(zsock_t *pipe)
+/* The data thread waits on all of these at once */
+enum dp_data_poll {
+	DP_DATA_POLL_PIPE,
+	DP_DATA_POLL_DOORBELL,
+	DP_DATA_POLL_SEND,
+	DP_DATA_POLL_MAX,
+};
+
+/* How long to wait before trying again after an error other than full */
+#define DP_DATA_RETRY_MS 10
+
+/*
+ * Publish objects from the batch to the dataplane, one to a frame, or as
+ * many as fit in a frame if it takes batches. Those that are sent were
+ * all there was when the client is keeping up, and the batches only get
+ * bigger when it falls behind. Returns the number sent, or -errno, which
+ * is -EAGAIN if the socket is full.
+ */
+static int broker_dp_data_publish(zsock_t *dp_data_sock,
+				  struct route_broker_client *client,
+				  const struct dp_data_client_args *args,
+				  struct route_broker_data *data, int count)
+{
+	void *objs[ROUTE_BROKER_BATCH];
+	struct broker_client *bc = data->bc;
+	int sent = 1;
+	int i;
+
+	errno = 0;
+	if (args->client_publish_batch) {
+		for (i = 0; i < count; i++)
+			objs[i] = data[i].obj;
+		sent = args->client_publish_batch(objs, count, dp_data_sock);
+	} else if (args->client_publish(data->obj, dp_data_sock)) {
+		sent = -1;
+	}
+
+	if (sent <= 0) {
+		if (errno == EAGAIN)
+			return -EAGAIN;
+
+		client->errors++;
+		broker_log_err("publish error %s: "
+			       "consumed %" PRIu64
+			       " behind %" PRIu64
+			       " errno (%d) %s\n",
+			       bc->name,
+			       bc->consumed,
+			       bc->broker->id -
+			       bc->broker_obj.id,
+			       errno, strerror(errno));
+		return errno ? -errno : -EIO;
+	}
+
+	for (i = 0; i < sent; i++) {
+		bc = data[i].bc;
+		broker_log_dp_detail(data[i].obj, bc->name,
+				     "publish %s: consumed %" PRIu64
+				     " behind %" PRIu64 "\n",
+				     bc->name, bc->consumed,
+				     bc->broker->id - bc->broker_obj.id);
+	}
+	return sent;
+}
+
+/* A dataplane being sent routes, by a thread of its own or a worker */
+struct dp_data_session {
+	TAILQ_ENTRY(dp_data_session) list;
+	struct dp_data_client_args args;
+	struct route_broker_client *client;
+	zsock_t *sock;
+	/* Taken from the broker, and the next of those to send */
+	struct route_broker_data batch[ROUTE_BROKER_BATCH];
+	int count;
+	int next;
+	/* What to wait for before running again, or the timeout for it */
+	short doorbell_events;
+	short send_events;
+	int timeout;
+	/* For a worker, whether to run it next time round and how behind */
+	bool ready;
+	uint64_t lag;
+	uint64_t credit;
+	uint64_t stall_since;
+	uint64_t stall_usecs;
+	/*
+	 * Messages sent, and the last of them, kept by the number they
+	 * were sent as, to send again to a dataplane that resumes. After
+	 * a resume those up to resend_to are sent from the ring first.
+	 */
+	uint64_t sent;
+	uint64_t resend_to;
+	struct route_broker_data *ring;
+};
+
+TAILQ_HEAD(dp_data_session_list, dp_data_session);
+
+/* Keep the credit state where it can be shown */
+static void dp_data_session_flow_set(struct dp_data_session *s)
+{
+	__atomic_store_n(&s->client->flow_credit, s->credit, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->client->flow_stall_since, s->stall_since,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&s->client->flow_stall_usecs, s->stall_usecs,
+			 __ATOMIC_RELAXED);
+}
+
+static struct dp_data_session *
+dp_data_session_create(const struct dp_data_client_args *args, char **ep)
+{
+	struct dp_data_session *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->args = *args;
+
+	/* Only shared objects can be held on to after they are sent */
+	if (!route_broker_obj_size)
+		s->args.resume_ring = 0;
+	if (s->args.resume_ring) {
+		s->ring = calloc(s->args.resume_ring, sizeof(*s->ring));
+		if (!s->ring) {
+			free(s);
+			return NULL;
+		}
+	}
+
+	if (args->flush)
+		s->client = route_broker_client_create_flush("dp");
+	else
+		s->client = route_broker_client_create("dp");
+	if (!s->client) {
+		free(s->ring);
+		free(s);
+		return NULL;
+	}
+
+	s->credit = args->credit;
+	if (args->credit_control) {
+		dp_data_session_flow_set(s);
+		__atomic_store_n(&s->client->flow_control, true,
+				 __ATOMIC_RELAXED);
+	}
+	*ep = broker_dp_data_init(&s->sock, args->sock_ep, args->hwm);
+	broker_log_debug("New broker dataplane client ep: %s\n", *ep);
+	s->ready = true;
+	return s;
+}
+
+static void dp_data_session_destroy(struct dp_data_session *s)
+{
+	uint32_t i;
+
+	for (; s->next < s->count; s->next++)
+		route_broker_client_free_data(s->client,
+					      s->batch[s->next].obj);
+	for (i = 0; s->ring && i < s->args.resume_ring; i++)
+		if (s->ring[i].obj)
+			route_broker_data_release(s->ring[i].obj);
+	route_broker_client_delete(s->client);
+	zsock_destroy(&s->sock);
+	free(s->ring);
+	free(s);
+}
+
+/* Count the messages sent, and keep them if the session can resume */
+static void dp_data_session_sent(struct dp_data_session *s,
+				 const struct route_broker_data *data,
+				 int count)
 {
+	struct route_broker_data *slot;
+
+	if (s->args.credit_control) {
+		s->credit -= count;
+		dp_data_session_flow_set(s);
+	}
+
+	for (; count; count--, data++) {
+		if (!s->ring) {
+			s->sent++;
+			continue;
+		}
+		slot = &s->ring[s->sent++ % s->args.resume_ring];
+		if (slot->obj)
+			route_broker_data_release(slot->obj);
+		route_broker_data_hold(data->obj);
+		*slot = *data;
+	}
+}
+
+/*
+ * Carry on with a dataplane that has connected again, on a new socket,
+ * from the message after the last one it applied. Returns the new ep,
+ * or NULL if the messages it missed are not all kept.
+ */
+static char *dp_data_session_resume(struct dp_data_session *s,
+				    uint64_t applied)
+{
+	uint64_t top = s->sent > s->resend_to ? s->sent : s->resend_to;
+	zsock_t *sock;
+	char *ep;
+
+	if (!s->ring || applied > top || top - applied > s->args.resume_ring)
+		return NULL;
+
+	ep = broker_dp_data_init(&sock, s->args.sock_ep, s->args.hwm);
+	if (!ep)
+		return NULL;
+	zsock_destroy(&s->sock);
+	s->sock = sock;
+
+	s->sent = applied;
+	s->resend_to = top;
+	s->credit = s->args.credit;
+	if (s->stall_since)
+		s->stall_usecs += zclock_usecs() - s->stall_since;
+	s->stall_since = 0;
+	if (s->args.credit_control)
+		dp_data_session_flow_set(s);
+	s->ready = true;
+	broker_log_debug("Resumed broker dataplane client at %" PRIu64
+			 " of %" PRIu64 ", ep: %s\n", applied, top, ep);
+	return ep;
+}
+
+/* Send again, before anything new, what a resumed dataplane missed */
+static int dp_data_session_replay(struct dp_data_session *s)
+{
+	struct route_broker_data data[ROUTE_BROKER_BATCH];
+	uint64_t n = s->resend_to - s->sent;
+	uint64_t i;
+	int rc;
+
+	if (n > ROUTE_BROKER_BATCH)
+		n = ROUTE_BROKER_BATCH;
+	if (s->args.credit_control && s->credit < n)
+		n = s->credit;
+
+	s->doorbell_events = 0;
+	s->send_events = 0;
+	if (!n) {
+		if (!s->stall_since) {
+			s->stall_since = zclock_usecs();
+			dp_data_session_flow_set(s);
+		}
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		data[i] = s->ring[(s->sent + i) % s->args.resume_ring];
+	rc = broker_dp_data_publish(s->sock, s->client, &s->args, data, n);
+	if (rc < 0) {
+		s->send_events = rc == -EAGAIN ? ZMQ_POLLOUT : 0;
+		return rc == -EAGAIN ? -1 : DP_DATA_RETRY_MS;
+	}
+
+	/* Already in the ring, where they are */
+	s->sent += rc;
+	if (s->args.credit_control) {
+		s->credit -= rc;
+		dp_data_session_flow_set(s);
+	}
+	return 0;
+}
+
+static void dp_data_session_credit(struct dp_data_session *s,
+				   uint32_t grant)
+{
+	if (!s->args.credit_control)
+		return;
+
+	s->credit += grant;
+	if (s->stall_since)
+		s->stall_usecs += zclock_usecs() - s->stall_since;
+	s->stall_since = 0;
+	dp_data_session_flow_set(s);
+}
+
+/*
+ * Send what can be sent, and work out what to wait for before running
+ * the session again: room on the socket for the rest of a batch that
+ * could not be sent, or more data. A dataplane that grants credit is
+ * sent nothing once it has run out, until it grants more. Returns the
+ * timeout for the wait, 0 if there is more to send straight away.
+ */
+static int dp_data_session_run(struct dp_data_session *s)
+{
+	int err = 0;
+	int max;
+	int rc;
+
+	if (s->sent < s->resend_to)
+		return dp_data_session_replay(s);
+
+	if (s->next == s->count) {
+		s->next = 0;
+		max = ROUTE_BROKER_BATCH;
+		if (s->args.credit_control && s->credit < (uint64_t)max)
+			max = s->credit;
+		s->count = max ? route_broker_client_try_batch(s->client,
+							       s->batch,
+							       max) : 0;
+	}
+
+	while (s->next < s->count) {
+		rc = broker_dp_data_publish(s->sock, s->client, &s->args,
+					    &s->batch[s->next],
+					    s->count - s->next);
+		if (rc < 0) {
+			err = -rc;
+			break;
+		}
+		dp_data_session_sent(s, &s->batch[s->next], rc);
+		while (rc--)
+			route_broker_client_free_data(
+				s->client, s->batch[s->next++].obj);
+	}
+
+	if (s->next < s->count) {
+		/* Wait for room, or retry a while after an error */
+		s->doorbell_events = 0;
+		s->send_events = err == EAGAIN ? ZMQ_POLLOUT : 0;
+		return err == EAGAIN ? -1 : DP_DATA_RETRY_MS;
+	}
+
+	s->send_events = 0;
+	if (s->args.credit_control && !s->credit) {
+		/* Only stalled if there is data that cannot be sent */
+		s->doorbell_events = route_broker_client_arm(s->client) ?
+			ZMQ_POLLIN : 0;
+		if (!s->doorbell_events && !s->stall_since) {
+			s->stall_since = zclock_usecs();
+			dp_data_session_flow_set(s);
+		}
+		return -1;
+	}
+
+	/* Straight on if there is more, else wait for it */
+	s->doorbell_events = ZMQ_POLLIN;
+	return s->count || !route_broker_client_arm(s->client) ? 0 : -1;
+}
+
+/*
+ * Take a command from the pipe: credit passed on by the control thread,
+ * a resume, answered with the new ep or an empty string if it cannot,
+ * or $TERM. Returns true if the client needs restarting.
+ */
+static bool broker_dp_data_pipe_recv(zsock_t *pipe, struct dp_data_session *s)
+{
+	uint64_t applied;
+	uint32_t grant;
 	char *str;
+	char *ep;
 	bool restart = false;
 
-	if (!(zsock_events(pipe) & ZMQ_POLLIN))
-		return false;
-
 	str = zstr_recv(pipe);
-	if (streq(str, "$TERM"))
+	if (!str || streq(str, "$TERM")) {
 		restart = true;
+	} else if (sscanf(str, "CREDIT %" SCNu32, &grant) == 1) {
+		dp_data_session_credit(s, grant);
+	} else if (sscanf(str, "RESUME %" SCNu64, &applied) == 1) {
+		ep = dp_data_session_resume(s, applied);
+		zstr_send(pipe, ep ? ep : "");
+		free(ep);
+	}
 
 	free(str);
 	return restart;
 }
 
+/*
+ * The thread sleeps in one poll until it can get on, as the session
+ * says, and always until it is told to stop on the pipe.
+ */
 void broker_dp_data_client(zsock_t *pipe, void *arg)
 {
-	void *obj;
-	struct route_broker_client *client;
-	struct broker_client *bc;
-	char *ep;
-	static zsock_t *dp_data_sock;
-	struct dp_data_client_args *args = arg;
-	const char *sock_ep = args->sock_ep;
-	object_broker_client_publish_cb client_publish = args->client_publish;
-
-	free(args);
+	zmq_pollitem_t items[DP_DATA_POLL_MAX] = { { 0 } };
+	struct dp_data_session *s;
+	char *ep = NULL;
+	int timeout;
+	int rc;
 
 	if (pthread_setname_np(pthread_self(), "ribbroker/dp"))
 		broker_log_err("Could not name rib broker dp data thread");
 
-	client = route_broker_client_create("dp");
-	ep = broker_dp_data_init(&dp_data_sock, sock_ep);
-	broker_log_debug("New broker dataplane client ep: %s\n", ep);
-
-	if (!ep) {
+	s = dp_data_session_create(arg, &ep);
+	free(arg);
+	if (!s || !ep) {
 		broker_log_err("Could not create rib broker dp thread ep");
 		assert(0);
 	}
@@ -110,50 +463,186 @@ void broker_dp_data_client(zsock_t *pipe, void *arg)
 	zstr_send(pipe, ep);
 	free(ep);
 
+	items[DP_DATA_POLL_PIPE].socket = zsock_resolve(pipe);
+	items[DP_DATA_POLL_PIPE].events = ZMQ_POLLIN;
+	items[DP_DATA_POLL_DOORBELL].fd = route_broker_client_doorbell(s->client);
+
 	while (true) {
-		while ((obj = route_broker_client_get_data(client, &bc))) {
- try_sending:
-			errno = 0;
-			if (client_publish(obj, dp_data_sock)) {
-				if (errno != EAGAIN) {
-					client->errors++;
-					broker_log_err("publish error %s: "
-						       "consumed %" PRIu64
-						       " behind %" PRIu64
-						       " errno (%d) %s\n",
-						       bc->name,
-						       bc->consumed,
-						       bc->broker->id -
-						       bc->broker_obj.id,
-						       errno, strerror(errno));
-				}
-				if (client_needs_restart(pipe)) {
-					route_broker_client_free_data(
-						client, obj);
-					goto stop_client;
-				}
-
-				usleep(10000);
-				goto try_sending;
+		timeout = dp_data_session_run(s);
+		/* A resume gives the session a new socket */
+		items[DP_DATA_POLL_SEND].socket = zsock_resolve(s->sock);
+		items[DP_DATA_POLL_DOORBELL].events = s->doorbell_events;
+		items[DP_DATA_POLL_SEND].events = s->send_events;
+
+		rc = zmq_poll(items, DP_DATA_POLL_MAX, timeout);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			broker_log_err("rib broker dp thread poll failed: %s\n",
+				       strerror(errno));
+			break;
+		}
+
+		if ((items[DP_DATA_POLL_PIPE].revents & ZMQ_POLLIN) &&
+		    broker_dp_data_pipe_recv(pipe, s))
+			break;
+	}
+
+	dp_data_session_destroy(s);
+}
+
+/* Most behind first */
+static int dp_data_session_cmp(const void *a, const void *b)
+{
+	const struct dp_data_session *sa = *(struct dp_data_session **)a;
+	const struct dp_data_session *sb = *(struct dp_data_session **)b;
+
+	if (sa->lag == sb->lag)
+		return 0;
+	return sa->lag < sb->lag ? 1 : -1;
+}
+
+/*
+ * Take a command from the control thread: ADD a session, replying with
+ * it and its ep, DEL one, signalling once it is gone, CREDIT for one, or
+ * RESUME one, replying with the new ep. Returns true if the worker is to
+ * stop.
+ */
+static bool broker_dp_data_worker_recv(zsock_t *pipe,
+				       struct dp_data_session_list *sessions,
+				       int *count)
+{
+	struct dp_data_session *s = NULL;
+	uint64_t value = 0;
+	void *ptr = NULL;
+	char *cmd = NULL;
+	char *ep = NULL;
+	bool stop = false;
+
+	if (zsock_recv(pipe, "sp8", &cmd, &ptr, &value) < 0 || !cmd ||
+	    streq(cmd, "$TERM")) {
+		stop = true;
+	} else if (streq(cmd, "ADD")) {
+		s = dp_data_session_create(ptr, &ep);
+		free(ptr);
+		if (s) {
+			TAILQ_INSERT_TAIL(sessions, s, list);
+			(*count)++;
+		}
+		zsock_send(pipe, "ps", s, ep ? ep : "");
+		free(ep);
+	} else if (streq(cmd, "DEL")) {
+		s = ptr;
+		TAILQ_REMOVE(sessions, s, list);
+		(*count)--;
+		dp_data_session_destroy(s);
+		zsock_signal(pipe, 0);
+	} else if (streq(cmd, "CREDIT")) {
+		s = ptr;
+		dp_data_session_credit(s, value);
+		s->ready = true;
+	} else if (streq(cmd, "RESUME")) {
+		ep = dp_data_session_resume(ptr, value);
+		zsock_send(pipe, "s", ep ? ep : "");
+		free(ep);
+	}
+
+	free(cmd);
+	return stop;
+}
+
+/*
+ * A worker sends to many dataplanes from the one thread. Each time round
+ * it runs the sessions that are ready, those most behind first, and then
+ * waits in one poll for any of them to be able to get on.
+ */
+void broker_dp_data_worker(zsock_t *pipe, void *arg)
+{
+	struct dp_data_session_list sessions =
+		TAILQ_HEAD_INITIALIZER(sessions);
+	struct dp_data_session **ready = NULL, **new_ready;
+	struct dp_data_session *s;
+	zmq_pollitem_t *items = NULL, *new_items;
+	int count = 0;
+	int size = 0;
+	int nready;
+	int timeout;
+	int i;
+	int rc;
+
+	if (pthread_setname_np(pthread_self(), "ribbroker/dpw"))
+		broker_log_err("Could not name rib broker dp worker thread");
+
+	zsock_signal(pipe, 0);
+
+	while (true) {
+		if (count >= size) {
+			size = count + 16;
+			new_items = realloc(items,
+					    (1 + 2 * size) * sizeof(*items));
+			if (new_items)
+				items = new_items;
+			new_ready = realloc(ready, size * sizeof(*ready));
+			if (new_ready)
+				ready = new_ready;
+			if (!new_items || !new_ready) {
+				broker_log_err("No memory for dp worker");
+				break;
 			}
+		}
+
+		nready = 0;
+		TAILQ_FOREACH(s, &sessions, list) {
+			if (!s->ready)
+				continue;
+			s->lag = route_broker_client_lag(s->client);
+			ready[nready++] = s;
+		}
+		qsort(ready, nready, sizeof(*ready), dp_data_session_cmp);
+		for (i = 0; i < nready; i++)
+			ready[i]->timeout = dp_data_session_run(ready[i]);
 
-			broker_log_dp_detail(obj, bc->name,
-					     "publish %s: consumed %" PRIu64
-					     " behind %" PRIu64 "\n",
-					     bc->name, bc->consumed,
-					     bc->broker->id - bc->broker_obj.id);
+		memset(items, 0, (1 + 2 * count) * sizeof(*items));
+		items[0].socket = zsock_resolve(pipe);
+		items[0].events = ZMQ_POLLIN;
+		timeout = -1;
+		i = 1;
+		TAILQ_FOREACH(s, &sessions, list) {
+			items[i].fd = route_broker_client_doorbell(s->client);
+			items[i].events = s->doorbell_events;
+			items[i + 1].socket = zsock_resolve(s->sock);
+			items[i + 1].events = s->send_events;
+			if (s->timeout >= 0 &&
+			    (timeout < 0 || s->timeout < timeout))
+				timeout = s->timeout;
+			i += 2;
+		}
 
-			route_broker_client_free_data(client, obj);
+		rc = zmq_poll(items, i, timeout);
+		if (rc < 0 && errno != EINTR) {
+			broker_log_err("rib broker dp worker poll failed: %s\n",
+				       strerror(errno));
+			break;
+		}
 
-			if (client_needs_restart(pipe))
-				goto stop_client;
+		/* Those that were waiting for a while have waited */
+		i = 1;
+		TAILQ_FOREACH(s, &sessions, list) {
+			s->ready = s->timeout >= 0 ||
+				(rc > 0 && (items[i].revents ||
+					    items[i + 1].revents));
+			i += 2;
 		}
 
-		if (client_needs_restart(pipe))
-			goto stop_client;
+		if (rc > 0 && (items[0].revents & ZMQ_POLLIN) &&
+		    broker_dp_data_worker_recv(pipe, &sessions, &count))
+			break;
 	}
 
- stop_client:
-	route_broker_client_delete(client);
-	zsock_destroy(&dp_data_sock);
+	while ((s = TAILQ_FIRST(&sessions))) {
+		TAILQ_REMOVE(&sessions, s, list);
+		dp_data_session_destroy(s);
+	}
+	free(items);
+	free(ready);
 }
@@ -13,6 +13,20 @@
 struct dp_data_client_args {
 	const char *sock_ep;
 	object_broker_client_publish_cb client_publish;
+	/*
+	 * Set if the dataplane takes frames of more than one object, to
+	 * the deflate one if it takes them compressed.
+	 */
+	object_broker_client_publish_batch_cb client_publish_batch;
+	/* Frames queued to the dataplane before sends would block */
+	uint32_t hwm;
+	/* Set if the dataplane grants credit, and what it starts with */
+	bool credit_control;
+	uint32_t credit;
+	/* Messages kept to send again if the dataplane resumes, or 0 */
+	uint32_t resume_ring;
+	/* Set if the dataplane can be told to flush, and so be resynced */
+	bool flush;
 };
 
 /*
@@ -20,4 +34,18 @@ struct dp_data_client_args {
  */
 void broker_dp_data_client(zsock_t *pipe, void *arg);
 
+/*
+ * A worker that sends to as many dataplanes as the control thread gives
+ * it, each taking the place of a client thread. It takes "sp8" messages
+ * on the pipe: ADD with a malloced struct dp_data_client_args, which is
+ * answered with the session, a pointer, and the data ep, DEL with the
+ * session, which is signalled once it is gone, CREDIT with the session
+ * and the credit, and RESUME with the session and the messages the
+ * dataplane applied, answered with the new data ep, empty if it cannot.
+ *
+ * A client thread takes "CREDIT <credit>" and "RESUME <applied>" strings
+ * on its pipe instead, and answers a RESUME the same way.
+ */
+void broker_dp_data_worker(zsock_t *pipe, void *arg);
+
 #endif /* __ROUTE_BROKER_DP_DATA__ */
@@ -18,8 +18,8 @@
 #include "broker.h"
 #include "route_broker.h"
 
-/* Sized to make the struct rib_route a power of 2 (256) for mem efficiency */
-#define ROUTE_TOPIC_LEN 204
+/* Longest topic generated for an object, also the longest key kept */
+#define ROUTE_TOPIC_LEN ROUTE_BROKER_KEY_LEN
 
 #define broker_log_debug(fmt, ...) \
 	do { \
@@ -48,24 +48,114 @@
 						   ##__VA_ARGS__); \
 	} while (0)
 
+/*
+ * Where the attributes the broker uses are in a route or nexthop
+ * message, as offsets from the start of it, 0 if not there. Found in
+ * one pass by route_attrs_scan(), and kept with the object so that
+ * nothing needs to parse it again.
+ */
+struct route_attrs {
+	uint32_t dst;
+	uint32_t src;
+	uint32_t table;
+	uint32_t iif;
+	uint32_t oif;
+	uint32_t rtg_domain;
+	uint32_t nhg_id;
+	bool scanned;
+};
+
+/*
+ * The data for a route. It is referenced rather than copied when handed
+ * to a consumer, so that the copy can be made without holding the lock,
+ * and it stays valid if the route is updated in the meantime.
+ *
+ * If there is an obj_size callback the object is held in the payload
+ * and handed to clients as it is, otherwise obj points to a copy from
+ * copy_obj and clients get copies of that.
+ */
+struct rib_data {
+	uint32_t refcount;
+	/* Only filled in for netlink objects */
+	struct route_attrs attrs;
+	void *obj;
+	uint8_t payload[];
+};
+
 struct rib_route {
 	struct broker_obj b_obj;
 	uint32_t refcount;
 	enum route_priority pri;
-	char topic[ROUTE_TOPIC_LEN];
-	void *data;
+	struct rib_data *data;
+	/* Released, waiting to be freed once no locks are held */
+	struct rib_route *dead_next;
+	/* Hash of the key, also picks the hash shard */
+	uint32_t hash;
+	/* For a nexthop group, route_broker_route_adds when it was added */
+	uint32_t route_adds;
+	/* The binary key, or the topic if there is no key_gen */
+	uint16_t key_len;
+	uint8_t key[];
 };
 
 enum route_broker_types {
 	ROUTE_BROKER_ROUTE = 0,
-	ROUTE_BROKER_TYPES_MAX = 1,
+	ROUTE_BROKER_NHG = 1,
+	ROUTE_BROKER_TYPES_MAX = 2,
+};
+
+/*
+ * Nexthop groups have a level of their own after the route priority
+ * levels, which clients drain before all of them. Deletes of groups go
+ * in the last route level instead. How many route levels there are is
+ * set when the broker is created.
+ */
+extern int route_broker_priorities;
+#define ROUTE_BROKER_NHG_LEVEL route_broker_priorities
+#define ROUTE_BROKER_LEVELS (route_broker_priorities + 1)
+#define ROUTE_BROKER_LEVELS_MAX (ROUTE_PRIORITY_LEVELS_MAX + 1)
+
+/* Most objects taken from a broker level in one go */
+#define ROUTE_BROKER_BATCH 64
+
+/*
+ * Objects a show keeps as they were when they change before it gets to
+ * them, per level. A show left part way keeps no more than this.
+ */
+#define ROUTE_BROKER_SHOW_SAVED_MAX 4096
+
+/* An object handed out by route_broker_client_get_batch() */
+struct route_broker_data {
+	void *obj;
+	/* The broker client for the level the object came from */
+	struct broker_client *bc;
 };
 
 struct route_broker_client {
 	CIRCLEQ_ENTRY(route_broker_client) clients_list;
-	struct broker_client *client[ROUTE_PRIORITY_MAX];
-	pthread_cond_t client_cond;
+	struct broker_client *client[ROUTE_BROKER_LEVELS_MAX];
+	/* eventfd rung when data arrives, if the client is armed */
+	int doorbell;
+	bool armed;
 	uint64_t errors;
+	/* The route level having its turn, and what each has left of one */
+	int sched_level;
+	int64_t credit[ROUTE_BROKER_LEVELS_MAX];
+	/*
+	 * Messages a dataplane that grants credit can still be sent, and
+	 * the time it has held things up by not granting more. Only set
+	 * by the client's thread, and read atomically to show them.
+	 */
+	bool flow_control;
+	uint64_t flow_credit;
+	uint64_t flow_stall_usecs;
+	/* When the current stall started, 0 if not stalled */
+	uint64_t flow_stall_since;
+	/*
+	 * The level that handed the client a flush while getting a batch,
+	 * the others are started again after it. NULL if none.
+	 */
+	struct broker_client *flushed;
 };
 
 extern void *route_broker_log_arg;
@@ -74,27 +164,76 @@ extern route_broker_fmt_cb route_broker_log_debug;
 extern route_broker_fmt_cb route_broker_log_error;
 extern route_broker_log_cb route_broker_log_dp_detail;
 extern object_broker_topic_gen_cb route_broker_topic_gen;
+extern object_broker_key_gen_cb route_broker_key_gen;
 extern object_broker_copy_obj_cb route_broker_copy_obj;
 extern object_broker_free_obj_cb route_broker_free_obj;
+extern object_broker_obj_type_cb route_broker_obj_type;
+extern object_broker_obj_size_cb route_broker_obj_size;
+extern const void *route_broker_flush_obj;
 
 /*
  * Manage Clients of the broker. A broker can have as many clients
  * as required, and each one reads data at its own speed.
  */
 struct route_broker_client *route_broker_client_create(const char *name);
+/*
+ * As route_broker_client_create(), for a client that can take the flush
+ * object. It is then resynced if it gets over the lag limit, given the
+ * flush object first to tell it to forget all it has. If there is no
+ * flush object it is the same as route_broker_client_create().
+ */
+struct route_broker_client *route_broker_client_create_flush(const char *name);
 void route_broker_client_delete(struct route_broker_client *client);
 void *route_broker_client_get_data(struct route_broker_client *client,
 		struct broker_client **bc);
+int route_broker_client_get_batch(struct route_broker_client *client,
+				  struct route_broker_data *data, int max);
+/*
+ * As route_broker_client_get_batch(), but returns 0 straight away if
+ * there is nothing for the client, for those that wait on the doorbell
+ * themselves.
+ */
+int route_broker_client_try_batch(struct route_broker_client *client,
+				  struct route_broker_data *data, int max);
+/*
+ * The client's doorbell, an eventfd that becomes readable once there is
+ * data after the client has been armed. Arming returns false, leaving
+ * it unarmed, if there is data for the client already.
+ */
+int route_broker_client_doorbell(struct route_broker_client *client);
+bool route_broker_client_arm(struct route_broker_client *client);
+/*
+ * How many objects the client is behind by, across the levels. Only to
+ * be called by the client itself.
+ */
+uint64_t route_broker_client_lag(struct route_broker_client *client);
 void route_broker_client_free_data(struct route_broker_client *rclient,
 				   void *obj);
+/*
+ * Take another ref on an object from route_broker_client_get_batch(),
+ * to keep it past route_broker_client_free_data(). Returns false if the
+ * objects are not shared, in which case the object is not held and must
+ * be copied to be kept.
+ */
+bool route_broker_data_hold(void *obj);
+void route_broker_data_release(void *obj);
+/*
+ * The attributes of a shared netlink object from
+ * route_broker_client_get_batch(), or NULL if they were not kept.
+ */
+const struct route_attrs *route_broker_data_attrs(void *obj);
 
-/* Just the broker */
-int route_broker_init(void);
+/* Just the broker, flags are BROKER_CREATE_* */
+int route_broker_init(unsigned int flags);
+/* As route_broker_init(), with the levels and scheduling given */
+int route_broker_init_sched(unsigned int flags,
+			    const struct route_broker_sched *sched);
 int route_broker_destroy(void);
+/* Resync clients that get more than 'limit' behind in a level, 0 for none */
+void route_broker_set_lag_limit(uint64_t limit);
 /* Initialise the broker clients */
-int route_broker_dataplane_ctrl_init(const char *cfgfile,
-				     object_broker_client_publish_cb publish,
-				     uint32_t data_format);
+int route_broker_dataplane_ctrl_init(
+	const struct object_broker_client_init *client);
 void route_broker_dataplane_ctrl_shutdown(void);
 int route_broker_kernel_init(object_broker_client_publish_cb publish);
 void route_broker_kernel_shutdown(void);
@@ -105,10 +244,50 @@ void route_broker_kernel_shutdown(void);
 void *route_broker_seq_first(int *pri);
 void *route_broker_seq_next(void *obj, int *pri);
 void *broker_obj_to_rib_route(struct broker_obj *obj);
+extern struct broker *route_broker[ROUTE_BROKER_LEVELS_MAX];
+
+struct route_broker_level_stats {
+	/* Objects given to clients from the level */
+	uint64_t served;
+	/* Times a client has been given objects from it */
+	uint64_t turns;
+};
+
+/* Fills in ROUTE_BROKER_LEVELS entries, one per level */
+void route_broker_get_level_stats(struct route_broker_level_stats *stats);
 
 int route_topic(void *obj, char *buf, size_t len, bool *delete);
+int route_key_gen(void *obj, void *key, size_t len, bool *delete);
+/*
+ * Find the attributes of a message. Returns -1 if it is not a route or
+ * nexthop message, or is too short or long.
+ */
+int route_attrs_scan(const struct nlmsghdr *nlh, struct route_attrs *attrs);
+/* As route_key_gen and route_topic, scanning into attrs if not done */
+int route_key_gen_attrs(void *obj, struct route_attrs *attrs, void *key,
+			size_t len, bool *delete);
+int route_topic_attrs(void *obj, struct route_attrs *attrs, char *buf,
+		      size_t len, bool *delete);
+/*
+ * The family and table of a scanned message, the table is 0 for a
+ * nexthop group. Returns -1 if it is not a route or nexthop message.
+ */
+int route_attrs_family_table(const void *obj, const struct route_attrs *attrs,
+			     uint8_t *family, uint32_t *table);
+enum object_broker_obj_type route_obj_type(void *obj);
 void *rib_nl_copy(const void *obj);
 void rib_nl_free(void *obj);
+size_t rib_nl_size(const void *obj);
 int rib_nl_dp_publish_route(void *obj, void *client_ctx);
+int rib_nl_dp_publish_batch(void **objs, unsigned int count, void *client_ctx);
+/* Drop the frames kept by rib_nl_dp_publish_batch() for reuse */
+void rib_nl_dp_publish_flush(void);
+/*
+ * As rib_nl_dp_publish_batch(), but large batches are compressed with
+ * the dictionary from rib_nl_dp_deflate_dict().
+ */
+int rib_nl_dp_publish_deflate(void **objs, unsigned int count,
+			      void *client_ctx);
+const void *rib_nl_dp_deflate_dict(size_t *len);
 
 #endif /* __ROUTE_BROKER_INTERNAL_H__ */
@@ -23,13 +23,20 @@ static object_broker_client_publish_cb obj_kernel_publish;
 static void *broker_consumer(void *arg)
 {
 	struct route_broker_client *client;
+	struct route_broker_data batch[ROUTE_BROKER_BATCH];
 	struct broker_client *bc;
 	void *obj;
+	int count;
+	int i;
 
 	client = route_broker_client_create("kernel");
 
 	while (true) {
-		while ((obj = route_broker_client_get_data(client, &bc))) {
+		count = route_broker_client_get_batch(client, batch,
+						      ROUTE_BROKER_BATCH);
+		for (i = 0; i < count; i++) {
+			obj = batch[i].obj;
+			bc = batch[i].bc;
 			if (obj_kernel_publish(obj, NULL)) {
 				client->errors++;
 				broker_log_err("publish %s: "
@@ -0,0 +1,363 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+/*
+ * The table is split into groups of 16 slots, each with a control byte
+ * per slot holding 7 bits of the hash if the slot is in use. A lookup
+ * compares the control bytes of a whole group in one go, and only looks
+ * at the routes where those bits match. Probing goes from group to
+ * group, and stops at a group with an empty slot.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "route_broker_internal.h"
+#include "route_hashtbl.h"
+
+#define RHT_GROUP 16
+#define RHT_MIN_SIZE 64
+
+/* Control bytes. In use slots have the top bit set. */
+#define RHT_EMPTY   0x00
+#define RHT_DELETED 0x01
+#define RHT_FULL    0x80
+
+/* Slots of the old table moved over by each change while resizing */
+#define RHT_MIGRATE_STEP 32
+
+struct rht {
+	uint8_t *ctrl;
+	struct rib_route **slots;
+	size_t size;
+	size_t used;
+	size_t deleted;
+};
+
+struct route_hashtbl {
+	struct rht cur;
+	/* Table being moved over to cur, and how far that has got */
+	struct rht old;
+	size_t migrated;
+};
+
+/* FNV-1a */
+uint32_t route_key_hash(const uint8_t *key, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= *key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Spread the bits of the route hash, the top bits of which are the same
+ * for all the routes in a shard.
+ */
+static inline uint64_t rht_mix(const struct rib_route *route)
+{
+	return route->hash * 0x9e3779b97f4a7c15ull;
+}
+
+static inline uint8_t rht_h2(uint64_t mix)
+{
+	return RHT_FULL | (mix >> 57);
+}
+
+static inline size_t rht_start(const struct rht *t, uint64_t mix)
+{
+	return (mix >> 20) & (t->size - 1) & ~(size_t)(RHT_GROUP - 1);
+}
+
+/* Bit mask of the slots in the group with the given control byte */
+static inline uint32_t rht_match(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < RHT_GROUP; i++)
+		if (ctrl[i] == c)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+/* Bit mask of the slots in the group that are not in use */
+static inline uint32_t rht_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+	return ~_mm_movemask_epi8(group) & 0xffff;
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < RHT_GROUP; i++)
+		if (!(ctrl[i] & RHT_FULL))
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+static inline bool rht_equal(const struct rib_route *route,
+			     const struct rib_route *key)
+{
+	return route->hash == key->hash && route->key_len == key->key_len &&
+		!memcmp(route->key, key->key, key->key_len);
+}
+
+/*
+ * Empty is 0 so the control bytes come zeroed from calloc, which for a
+ * large table means fresh pages rather than a memset. They are loaded a
+ * group at a time, malloc gives at least 16 byte alignment.
+ */
+static int rht_alloc(struct rht *t, size_t size)
+{
+	t->ctrl = calloc(size, 1);
+	if (!t->ctrl)
+		return -ENOMEM;
+	t->slots = malloc(size * sizeof(*t->slots));
+	if (!t->slots) {
+		free(t->ctrl);
+		t->ctrl = NULL;
+		return -ENOMEM;
+	}
+	t->size = size;
+	t->used = 0;
+	t->deleted = 0;
+	return 0;
+}
+
+static void rht_free(struct rht *t)
+{
+	free(t->ctrl);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Index of the slot holding the key, or -1 */
+static ssize_t rht_find(const struct rht *t, const struct rib_route *key,
+			uint64_t mix)
+{
+	size_t pos, step = 0;
+	uint8_t h2 = rht_h2(mix);
+	uint32_t match;
+	size_t slot;
+
+	if (!t->used)
+		return -1;
+
+	pos = rht_start(t, mix);
+	while (true) {
+		match = rht_match(t->ctrl + pos, h2);
+		while (match) {
+			slot = pos + __builtin_ctz(match);
+			if (rht_equal(t->slots[slot], key))
+				return slot;
+			match &= match - 1;
+		}
+		if (rht_match(t->ctrl + pos, RHT_EMPTY))
+			return -1;
+		step += RHT_GROUP;
+		pos = (pos + step) & (t->size - 1);
+	}
+}
+
+/* Add a route that is known not to be in the table, which has room */
+static void rht_insert(struct rht *t, struct rib_route *route, uint64_t mix)
+{
+	size_t pos, step = 0;
+	uint32_t match;
+	size_t slot;
+
+	pos = rht_start(t, mix);
+	while (!(match = rht_match_free(t->ctrl + pos))) {
+		step += RHT_GROUP;
+		pos = (pos + step) & (t->size - 1);
+	}
+
+	slot = pos + __builtin_ctz(match);
+	if (t->ctrl[slot] == RHT_DELETED)
+		t->deleted--;
+	t->ctrl[slot] = rht_h2(mix);
+	t->slots[slot] = route;
+	t->used++;
+}
+
+static void rht_remove(struct rht *t, size_t slot)
+{
+	const uint8_t *group = t->ctrl + (slot & ~(size_t)(RHT_GROUP - 1));
+
+	/*
+	 * No probe goes past a group with an empty slot in it, so if this
+	 * one has one then nothing needs to go on past this slot either.
+	 */
+	if (rht_match(group, RHT_EMPTY)) {
+		t->ctrl[slot] = RHT_EMPTY;
+	} else {
+		t->ctrl[slot] = RHT_DELETED;
+		t->deleted++;
+	}
+	t->used--;
+}
+
+/* Move up to 'count' slots of the old table over */
+static void rht_migrate(struct route_hashtbl *tbl, size_t count)
+{
+	struct rht *old = &tbl->old;
+	size_t slot;
+
+	while (count-- && tbl->migrated < old->size) {
+		slot = tbl->migrated++;
+		if (!(old->ctrl[slot] & RHT_FULL))
+			continue;
+
+		rht_insert(&tbl->cur, old->slots[slot],
+			   rht_mix(old->slots[slot]));
+		/* So that lookups in the old table no longer find it */
+		old->ctrl[slot] = RHT_DELETED;
+		old->used--;
+	}
+
+	if (old->size && tbl->migrated == old->size)
+		rht_free(old);
+}
+
+/*
+ * Start moving to a new table, twice the size unless most of the slots
+ * in use are deleted ones, in which case it is the same size.
+ */
+static int rht_resize(struct route_hashtbl *tbl)
+{
+	struct rht new;
+	size_t size = tbl->cur.size;
+
+	if (tbl->old.size)
+		rht_migrate(tbl, tbl->old.size);
+
+	if (!size)
+		size = RHT_MIN_SIZE;
+	else if (tbl->cur.used >= size / 2)
+		size *= 2;
+
+	if (rht_alloc(&new, size))
+		return -ENOMEM;
+
+	tbl->old = tbl->cur;
+	tbl->cur = new;
+	tbl->migrated = 0;
+	rht_migrate(tbl, RHT_MIGRATE_STEP);
+	return 0;
+}
+
+struct route_hashtbl *route_hashtbl_create(void)
+{
+	return calloc(1, sizeof(struct route_hashtbl));
+}
+
+void route_hashtbl_destroy(struct route_hashtbl *tbl)
+{
+	if (!tbl)
+		return;
+
+	rht_free(&tbl->cur);
+	rht_free(&tbl->old);
+	free(tbl);
+}
+
+struct rib_route *route_hashtbl_lookup(struct route_hashtbl *tbl,
+				       const struct rib_route *key)
+{
+	uint64_t mix = rht_mix(key);
+	ssize_t slot;
+
+	slot = rht_find(&tbl->cur, key, mix);
+	if (slot >= 0)
+		return tbl->cur.slots[slot];
+
+	slot = rht_find(&tbl->old, key, mix);
+	if (slot >= 0)
+		return tbl->old.slots[slot];
+
+	return NULL;
+}
+
+int route_hashtbl_set(struct route_hashtbl *tbl, struct rib_route *route)
+{
+	uint64_t mix = rht_mix(route);
+	ssize_t slot;
+
+	if (tbl->old.size)
+		rht_migrate(tbl, RHT_MIGRATE_STEP);
+
+	slot = rht_find(&tbl->cur, route, mix);
+	if (slot >= 0) {
+		tbl->cur.slots[slot] = route;
+		return 0;
+	}
+
+	slot = rht_find(&tbl->old, route, mix);
+	if (slot >= 0) {
+		tbl->old.slots[slot] = route;
+		return 0;
+	}
+
+	/* Keep at least an eighth of the slots empty */
+	if ((tbl->cur.used + tbl->cur.deleted + 1) * 8 > tbl->cur.size * 7 &&
+	    rht_resize(tbl))
+		return -ENOMEM;
+
+	rht_insert(&tbl->cur, route, mix);
+	return 0;
+}
+
+struct rib_route *route_hashtbl_delete(struct route_hashtbl *tbl,
+				       const struct rib_route *key)
+{
+	uint64_t mix = rht_mix(key);
+	struct rib_route *route;
+	ssize_t slot;
+
+	if (tbl->old.size)
+		rht_migrate(tbl, RHT_MIGRATE_STEP);
+
+	slot = rht_find(&tbl->cur, key, mix);
+	if (slot >= 0) {
+		route = tbl->cur.slots[slot];
+		rht_remove(&tbl->cur, slot);
+		return route;
+	}
+
+	slot = rht_find(&tbl->old, key, mix);
+	if (slot >= 0) {
+		route = tbl->old.slots[slot];
+		rht_remove(&tbl->old, slot);
+		return route;
+	}
+
+	return NULL;
+}
+
+size_t route_hashtbl_count(struct route_hashtbl *tbl)
+{
+	return tbl->cur.used + tbl->old.used;
+}
@@ -0,0 +1,46 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+#ifndef __ROUTE_HASHTBL_H__
+#define __ROUTE_HASHTBL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct rib_route;
+struct route_hashtbl;
+
+/* Hash of a route key, to be kept in the route */
+uint32_t route_key_hash(const uint8_t *key, size_t len);
+
+/*
+ * Open addressing hash of routes, keyed on the key held in each route.
+ * The table only holds pointers to the routes, and is not locked.
+ *
+ * When the table needs to grow a new one is made, and the routes are
+ * moved over from the old one a few at a time as the table is changed,
+ * so no one change has to move them all.
+ */
+struct route_hashtbl *route_hashtbl_create(void);
+void route_hashtbl_destroy(struct route_hashtbl *tbl);
+
+/* The route with the same key as 'key', or NULL */
+struct rib_route *route_hashtbl_lookup(struct route_hashtbl *tbl,
+				       const struct rib_route *key);
+
+/*
+ * Add the route, or replace the one with the same key.
+ * Returns 0 or -ENOMEM.
+ */
+int route_hashtbl_set(struct route_hashtbl *tbl, struct rib_route *route);
+
+/* Remove the route with the same key as 'key'. Returns it, or NULL */
+struct rib_route *route_hashtbl_delete(struct route_hashtbl *tbl,
+				       const struct rib_route *key);
+
+size_t route_hashtbl_count(struct route_hashtbl *tbl);
+
+#endif /* __ROUTE_HASHTBL_H__ */
@@ -0,0 +1,361 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "route_pool.h"
+
+/* The smallest class is 32 bytes including the header */
+#define ROUTE_POOL_MIN_SHIFT 5
+
+/* Objects moved between a thread cache and the shared lists at once */
+#define ROUTE_POOL_BATCH 64
+#define ROUTE_POOL_CACHE_MAX (2 * ROUTE_POOL_BATCH)
+
+#define ROUTE_POOL_SLAB_SIZE (64 * 1024)
+
+/* Keeps the objects 16 byte aligned, as malloc would */
+struct route_pool_hdr {
+	uint32_t cls;
+	uint32_t pad[3];
+};
+
+/* A free object, laid over the whole of it, header included */
+struct route_pool_obj {
+	struct route_pool_obj *next;
+	/* Only used in the first object of a batch on a shared list */
+	struct route_pool_obj *next_batch;
+	uint32_t count;
+};
+
+struct route_pool_slab {
+	struct route_pool_slab *next;
+	uint64_t pad;
+};
+
+/* The shared free lists, and the slabs, of a class */
+struct route_pool_class {
+	pthread_mutex_t mutex;
+	struct route_pool_obj *batches;
+	struct route_pool_slab *slabs;
+	uint64_t slab_count;
+	uint64_t objects;
+	uint64_t free;
+};
+
+/*
+ * Only ever changed by the thread that owns the cache, but read by
+ * others for the stats, so the counts are stored atomically.
+ */
+struct route_pool_cache_class {
+	struct route_pool_obj *head;
+	uint32_t count;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+struct route_pool_cache {
+	LIST_ENTRY(route_pool_cache) caches;
+	struct route_pool_cache_class cls[ROUTE_POOL_CLASSES];
+};
+
+static struct route_pool_class route_pool[ROUTE_POOL_CLASSES] = {
+	[0 ... ROUTE_POOL_CLASSES - 1] = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER
+	}
+};
+
+/* Protects the list of caches, and the counts of those gone */
+static pthread_mutex_t route_pool_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, route_pool_cache) route_pool_caches;
+static uint64_t route_pool_gone_allocs[ROUTE_POOL_CLASSES];
+static uint64_t route_pool_gone_frees[ROUTE_POOL_CLASSES];
+
+static uint64_t route_pool_large_allocs;
+static uint64_t route_pool_large_frees;
+
+static pthread_once_t route_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t route_pool_key;
+static __thread struct route_pool_cache *route_pool_cache;
+
+#define route_pool_set(field, value) \
+	__atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static inline size_t route_pool_class_size(int cls)
+{
+	return (size_t)1 << (cls + ROUTE_POOL_MIN_SHIFT);
+}
+
+static inline int route_pool_class(size_t size)
+{
+	size += sizeof(struct route_pool_hdr);
+	if (size <= route_pool_class_size(0))
+		return 0;
+	return 64 - __builtin_clzl(size - 1) - ROUTE_POOL_MIN_SHIFT;
+}
+
+/* Carve a new slab into batches on the shared list. Called locked. */
+static void route_pool_slab_add(int cls)
+{
+	struct route_pool_class *pc = &route_pool[cls];
+	size_t size = route_pool_class_size(cls);
+	size_t count = ROUTE_POOL_SLAB_SIZE / size;
+	struct route_pool_slab *slab;
+	struct route_pool_obj *obj;
+	uint8_t *next;
+	size_t i;
+
+	if (count < ROUTE_POOL_BATCH)
+		count = ROUTE_POOL_BATCH;
+
+	slab = malloc(sizeof(*slab) + count * size);
+	if (!slab)
+		return;
+	slab->next = pc->slabs;
+	pc->slabs = slab;
+	pc->slab_count++;
+	pc->objects += count;
+	pc->free += count;
+
+	next = (uint8_t *)(slab + 1);
+	for (i = 0; i < count; i++, next += size) {
+		obj = (struct route_pool_obj *)next;
+		if (i % ROUTE_POOL_BATCH == 0) {
+			obj->count = count - i < ROUTE_POOL_BATCH ?
+				count - i : ROUTE_POOL_BATCH;
+			obj->next_batch = pc->batches;
+			pc->batches = obj;
+		}
+		obj->next = (i + 1) % ROUTE_POOL_BATCH && i + 1 < count ?
+			(struct route_pool_obj *)(next + size) : NULL;
+	}
+}
+
+static struct route_pool_obj *route_pool_batch_get(int cls, uint32_t *count)
+{
+	struct route_pool_class *pc = &route_pool[cls];
+	struct route_pool_obj *batch;
+
+	pthread_mutex_lock(&pc->mutex);
+	if (!pc->batches)
+		route_pool_slab_add(cls);
+	batch = pc->batches;
+	if (batch) {
+		pc->batches = batch->next_batch;
+		pc->free -= batch->count;
+		*count = batch->count;
+	}
+	pthread_mutex_unlock(&pc->mutex);
+	return batch;
+}
+
+static void route_pool_batch_put(int cls, struct route_pool_obj *batch,
+				 uint32_t count)
+{
+	struct route_pool_class *pc = &route_pool[cls];
+
+	batch->count = count;
+	pthread_mutex_lock(&pc->mutex);
+	batch->next_batch = pc->batches;
+	pc->batches = batch;
+	pc->free += count;
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+/* Give back the objects cached by a thread as it exits */
+static void route_pool_cache_destroy(void *arg)
+{
+	struct route_pool_cache *cache = arg;
+	struct route_pool_cache_class *cc;
+	int cls;
+
+	pthread_mutex_lock(&route_pool_cache_mutex);
+	LIST_REMOVE(cache, caches);
+	for (cls = 0; cls < ROUTE_POOL_CLASSES; cls++) {
+		cc = &cache->cls[cls];
+		route_pool_gone_allocs[cls] += cc->allocs;
+		route_pool_gone_frees[cls] += cc->frees;
+	}
+	pthread_mutex_unlock(&route_pool_cache_mutex);
+
+	for (cls = 0; cls < ROUTE_POOL_CLASSES; cls++) {
+		cc = &cache->cls[cls];
+		if (cc->head)
+			route_pool_batch_put(cls, cc->head, cc->count);
+	}
+
+	route_pool_cache = NULL;
+	free(cache);
+}
+
+static void route_pool_key_create(void)
+{
+	pthread_key_create(&route_pool_key, route_pool_cache_destroy);
+}
+
+static struct route_pool_cache *route_pool_cache_get(void)
+{
+	struct route_pool_cache *cache = route_pool_cache;
+
+	if (cache)
+		return cache;
+
+	pthread_once(&route_pool_once, route_pool_key_create);
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_lock(&route_pool_cache_mutex);
+	LIST_INSERT_HEAD(&route_pool_caches, cache, caches);
+	pthread_mutex_unlock(&route_pool_cache_mutex);
+
+	pthread_setspecific(route_pool_key, cache);
+	route_pool_cache = cache;
+	return cache;
+}
+
+static void *route_pool_alloc_large(size_t size)
+{
+	struct route_pool_hdr *hdr;
+
+	hdr = malloc(sizeof(*hdr) + size);
+	if (!hdr)
+		return NULL;
+
+	hdr->cls = ROUTE_POOL_CLASSES;
+	__atomic_add_fetch(&route_pool_large_allocs, 1, __ATOMIC_RELAXED);
+	return hdr + 1;
+}
+
+void *route_pool_alloc(size_t size)
+{
+	struct route_pool_cache_class *cc;
+	struct route_pool_cache *cache;
+	struct route_pool_hdr *hdr;
+	struct route_pool_obj *obj;
+	int cls = route_pool_class(size);
+	uint32_t count;
+
+	if (cls >= ROUTE_POOL_CLASSES)
+		return route_pool_alloc_large(size);
+
+	cache = route_pool_cache_get();
+	if (!cache)
+		return route_pool_alloc_large(size);
+
+	cc = &cache->cls[cls];
+	if (!cc->head) {
+		cc->head = route_pool_batch_get(cls, &count);
+		if (!cc->head)
+			return NULL;
+		route_pool_set(cc->count, count);
+	}
+
+	obj = cc->head;
+	cc->head = obj->next;
+	route_pool_set(cc->count, cc->count - 1);
+	route_pool_set(cc->allocs, cc->allocs + 1);
+
+	hdr = (struct route_pool_hdr *)obj;
+	hdr->cls = cls;
+	return hdr + 1;
+}
+
+void route_pool_free(void *ptr)
+{
+	struct route_pool_cache_class *cc;
+	struct route_pool_cache *cache;
+	struct route_pool_hdr *hdr;
+	struct route_pool_obj *obj, *tail;
+	int cls;
+	int i;
+
+	if (!ptr)
+		return;
+
+	hdr = (struct route_pool_hdr *)ptr - 1;
+	cls = hdr->cls;
+	if (cls == ROUTE_POOL_CLASSES) {
+		__atomic_add_fetch(&route_pool_large_frees, 1,
+				   __ATOMIC_RELAXED);
+		free(hdr);
+		return;
+	}
+
+	obj = (struct route_pool_obj *)hdr;
+	cache = route_pool_cache_get();
+	if (!cache) {
+		obj->next = NULL;
+		route_pool_batch_put(cls, obj, 1);
+		return;
+	}
+
+	cc = &cache->cls[cls];
+	obj->next = cc->head;
+	cc->head = obj;
+	route_pool_set(cc->count, cc->count + 1);
+	route_pool_set(cc->frees, cc->frees + 1);
+
+	if (cc->count <= ROUTE_POOL_CACHE_MAX)
+		return;
+
+	/* Hand a batch back, for the threads that are allocating */
+	tail = cc->head;
+	for (i = 1; i < ROUTE_POOL_BATCH; i++)
+		tail = tail->next;
+	obj = cc->head;
+	cc->head = tail->next;
+	tail->next = NULL;
+	route_pool_set(cc->count, cc->count - ROUTE_POOL_BATCH);
+	route_pool_batch_put(cls, obj, ROUTE_POOL_BATCH);
+}
+
+void route_pool_get_stats(struct route_pool_stats *stats)
+{
+	struct route_pool_cache_class *cc;
+	struct route_pool_cache *cache;
+	struct route_pool_class *pc;
+	int cls;
+
+	memset(stats, 0, (ROUTE_POOL_CLASSES + 1) * sizeof(*stats));
+
+	for (cls = 0; cls < ROUTE_POOL_CLASSES; cls++) {
+		pc = &route_pool[cls];
+		stats[cls].size = route_pool_class_size(cls) -
+			sizeof(struct route_pool_hdr);
+		pthread_mutex_lock(&pc->mutex);
+		stats[cls].slabs = pc->slab_count;
+		stats[cls].objects = pc->objects;
+		stats[cls].free = pc->free;
+		pthread_mutex_unlock(&pc->mutex);
+	}
+
+	pthread_mutex_lock(&route_pool_cache_mutex);
+	for (cls = 0; cls < ROUTE_POOL_CLASSES; cls++) {
+		stats[cls].allocs = route_pool_gone_allocs[cls];
+		stats[cls].frees = route_pool_gone_frees[cls];
+	}
+	LIST_FOREACH(cache, &route_pool_caches, caches) {
+		for (cls = 0; cls < ROUTE_POOL_CLASSES; cls++) {
+			cc = &cache->cls[cls];
+			stats[cls].cached += __atomic_load_n(&cc->count,
+							     __ATOMIC_RELAXED);
+			stats[cls].allocs += __atomic_load_n(&cc->allocs,
+							     __ATOMIC_RELAXED);
+			stats[cls].frees += __atomic_load_n(&cc->frees,
+							    __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&route_pool_cache_mutex);
+
+	stats[ROUTE_POOL_CLASSES].allocs =
+		__atomic_load_n(&route_pool_large_allocs, __ATOMIC_RELAXED);
+	stats[ROUTE_POOL_CLASSES].frees =
+		__atomic_load_n(&route_pool_large_frees, __ATOMIC_RELAXED);
+}
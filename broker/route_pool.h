@@ -0,0 +1,48 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+#ifndef __ROUTE_POOL_H__
+#define __ROUTE_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory for the routes and the copies of the objects in them, which are
+ * allocated and freed at the rate routes are published. Each size class
+ * is carved out of slabs that are kept for reuse, and every thread keeps
+ * a cache of free objects per class, so that most allocations and frees
+ * take no lock. Objects move between the thread caches and the shared
+ * free lists a batch at a time, which is how objects freed by clients
+ * get back to the publishers.
+ *
+ * Allocations above the largest class go to malloc.
+ */
+#define ROUTE_POOL_CLASSES 8
+
+void *route_pool_alloc(size_t size);
+void route_pool_free(void *ptr);
+
+struct route_pool_stats {
+	/* Largest allocation in the class, 0 for those that use malloc */
+	size_t size;
+	uint64_t slabs;
+	/* Objects carved from the slabs */
+	uint64_t objects;
+	/* Free objects on the shared free lists and in the thread caches */
+	uint64_t free;
+	uint64_t cached;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+/*
+ * Fills in ROUTE_POOL_CLASSES + 1 entries, one per class and then one
+ * for the allocations that use malloc.
+ */
+void route_pool_get_stats(struct route_pool_stats *stats);
+
+#endif /* __ROUTE_POOL_H__ */
@@ -0,0 +1,301 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+/*
+ * Measure how fast routes can be published into the broker, by one and
+ * by several producers, and with a full table show being run (to a slow
+ * reader) at the same time. Consumers are kept draining the broker
+ * throughout. Route i is published at priority i % ROUTE_PRIORITY_MAX,
+ * and producer p publishes the routes where i % producers == p.
+ *
+ * A lag limit can be given, so that consumers which fall behind are
+ * resynced rather than being walked through every change.
+ *
+ * Last of all a set of other routes are flapped, added and then deleted
+ * again, as when a peer goes up and down, and the number of messages the
+ * consumers are sent for them is counted.
+ *
+ * broker_bench [routes] [rounds] [producers] [consumers] [lag limit]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <czmq.h>
+
+#include "broker.h"
+#include "route_broker_internal.h"
+#include "netlink_create.h"
+
+#define BENCH_NL_LEN 256
+
+static char *route_bufs;
+static char *flap_bufs;
+static int route_count = 100000;
+static int round_count = 5;
+static int producer_count = 3;
+static int consumer_count = 2;
+static uint64_t lag_limit;
+
+struct producer {
+	pthread_t thread;
+	int id;
+	int producers;
+	uint64_t worst;
+};
+
+static bool consumer_stop;
+static bool show_stop;
+static uint64_t show_count;
+static uint64_t show_lines;
+static uint64_t consumed;
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct nlmsghdr *route_buf(int i)
+{
+	return (struct nlmsghdr *)(route_bufs + (size_t)i * BENCH_NL_LEN);
+}
+
+/* The add of flap route i, followed by its delete */
+static struct nlmsghdr *flap_buf(int i, bool del)
+{
+	return (struct nlmsghdr *)(flap_bufs +
+				   ((size_t)i * 2 + del) * BENCH_NL_LEN);
+}
+
+static void *consumer(void *arg)
+{
+	struct route_broker_data data[ROUTE_BROKER_BATCH];
+	struct route_broker_client *client;
+	int count;
+	int i;
+
+	client = route_broker_client_create("bench");
+	assert(client);
+
+	while (!__atomic_load_n(&consumer_stop, __ATOMIC_RELAXED)) {
+		count = route_broker_client_get_batch(client, data,
+						      ROUTE_BROKER_BATCH);
+		__atomic_add_fetch(&consumed, count, __ATOMIC_RELAXED);
+		for (i = 0; i < count; i++)
+			route_broker_client_free_data(client, data[i].obj);
+	}
+
+	route_broker_client_delete(client);
+	return NULL;
+}
+
+/* A reader that takes a while over each line, like a busy terminal */
+static void slow_out(void *arg, const char *fmt, ...)
+{
+	show_lines++;
+	if (!(show_lines % 64))
+		usleep(10);
+}
+
+static void *shower(void *arg)
+{
+	while (!__atomic_load_n(&show_stop, __ATOMIC_RELAXED)) {
+		route_broker_show(slow_out, NULL);
+		show_count++;
+	}
+	return NULL;
+}
+
+static void *producer(void *arg)
+{
+	struct producer *prod = arg;
+	uint64_t t;
+	int r, i;
+
+	for (r = 0; r < round_count; r++) {
+		for (i = prod->id; i < route_count; i += prod->producers) {
+			t = now_nsec();
+			route_broker_publish(route_buf(i),
+					     i % ROUTE_PRIORITY_MAX);
+			t = now_nsec() - t;
+			if (t > prod->worst)
+				prod->worst = t;
+		}
+	}
+	return NULL;
+}
+
+/* Publish every route 'round_count' times, and report the rate */
+static void run(const char *name, int producers)
+{
+	struct producer prod[producers];
+	uint64_t start, end, worst = 0;
+	int p;
+
+	start = now_nsec();
+	for (p = 0; p < producers; p++) {
+		prod[p].id = p;
+		prod[p].producers = producers;
+		prod[p].worst = 0;
+		pthread_create(&prod[p].thread, NULL, producer, &prod[p]);
+	}
+	for (p = 0; p < producers; p++) {
+		pthread_join(prod[p].thread, NULL);
+		if (prod[p].worst > worst)
+			worst = prod[p].worst;
+	}
+	end = now_nsec();
+
+	printf("%-16s %2d producers %10.0f routes/s  worst publish %8.3f ms\n",
+	       name, producers,
+	       (double)route_count * round_count * 1e9 / (end - start),
+	       worst / 1e6);
+}
+
+/* Wait for the consumers to have had everything */
+static uint64_t drain(void)
+{
+	uint64_t last, now = __atomic_load_n(&consumed, __ATOMIC_RELAXED);
+
+	do {
+		last = now;
+		usleep(100000);
+		now = __atomic_load_n(&consumed, __ATOMIC_RELAXED);
+	} while (now != last);
+	return now;
+}
+
+/*
+ * Add and then delete each of the flap routes, 'round_count' times, and
+ * report how many messages that sent to each consumer.
+ */
+static void flap(int flaps)
+{
+	uint64_t start, end, before;
+	int r, i;
+
+	before = drain();
+	start = now_nsec();
+	for (r = 0; r < round_count; r++) {
+		for (i = 0; i < flaps; i++) {
+			route_broker_publish(flap_buf(i, false),
+					     i % ROUTE_PRIORITY_MAX);
+			route_broker_publish(flap_buf(i, true),
+					     i % ROUTE_PRIORITY_MAX);
+		}
+	}
+	end = now_nsec();
+
+	printf("%-16s %d routes %10.0f changes/s  %6.3f messages per flap\n",
+	       "flap", flaps,
+	       (double)flaps * round_count * 2 * 1e9 / (end - start),
+	       (double)(drain() - before) /
+	       ((uint64_t)flaps * round_count * consumer_count));
+}
+
+int route_broker_dataplane_ctrl_init(
+	const struct object_broker_client_init *client)
+{
+	return 0;
+}
+
+void route_broker_dataplane_ctrl_shutdown(void)
+{
+}
+
+void route_broker_kernel_shutdown(void)
+{
+}
+
+int route_broker_kernel_init(object_broker_client_publish_cb publish)
+{
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *consumer_thread;
+	pthread_t show_thread;
+	int rc;
+	int i;
+
+	if (argc > 1)
+		route_count = atoi(argv[1]);
+	if (argc > 2)
+		round_count = atoi(argv[2]);
+	if (argc > 3)
+		producer_count = atoi(argv[3]);
+	if (argc > 4)
+		consumer_count = atoi(argv[4]);
+	if (argc > 5)
+		lag_limit = strtoull(argv[5], NULL, 0);
+
+	route_broker_topic_gen = route_topic;
+	route_broker_key_gen = route_key_gen;
+	route_broker_copy_obj = rib_nl_copy;
+	route_broker_free_obj = rib_nl_free;
+	route_broker_obj_type = route_obj_type;
+	route_broker_obj_size = rib_nl_size;
+
+	route_bufs = calloc(route_count, BENCH_NL_LEN);
+	assert(route_bufs);
+	for (i = 0; i < route_count; i++)
+		netlink_add_route((char *)route_buf(i),
+				  "%d.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+				  10 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+
+	flap_bufs = calloc(route_count, 2 * BENCH_NL_LEN);
+	assert(flap_bufs);
+	for (i = 0; i < route_count; i++) {
+		netlink_add_route((char *)flap_buf(i, false),
+				  "%d.%d.%d.0/24 nh 4.4.4.3 int:dp2T0",
+				  100 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+		netlink_del_route((char *)flap_buf(i, true),
+				  "%d.%d.%d.0/24 nh 4.4.4.3 int:dp2T0",
+				  100 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+	}
+
+	rc = route_broker_init(0);
+	assert(rc == 0);
+	route_broker_set_lag_limit(lag_limit);
+
+	consumer_thread = calloc(consumer_count, sizeof(*consumer_thread));
+	assert(consumer_thread);
+	for (i = 0; i < consumer_count; i++)
+		pthread_create(&consumer_thread[i], NULL, consumer, NULL);
+	for (i = 0; i < route_count; i++)
+		route_broker_publish(route_buf(i), i % ROUTE_PRIORITY_MAX);
+
+	printf("%d routes, %d rounds of updates, %d consumers\n",
+	       route_count, round_count, consumer_count);
+	run("no show", 1);
+	run("no show", producer_count);
+
+	pthread_create(&show_thread, NULL, shower, NULL);
+	run("with show", producer_count);
+	__atomic_store_n(&show_stop, true, __ATOMIC_RELAXED);
+	pthread_join(show_thread, NULL);
+	printf("%" PRIu64 " shows, %" PRIu64 " lines\n", show_count,
+	       show_lines);
+
+	flap(route_count);
+
+	/* Consumers only wake for data, so give them one more route */
+	__atomic_store_n(&consumer_stop, true, __ATOMIC_RELAXED);
+	route_broker_publish(flap_buf(0, false), 0);
+	for (i = 0; i < consumer_count; i++)
+		pthread_join(consumer_thread[i], NULL);
+	free(consumer_thread);
+	return 0;
+}
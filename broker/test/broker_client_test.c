@@ -42,8 +42,11 @@ static void add_routes(int count)
 	}
 }
 
+/* broker_client_test [cfgfile] */
 int main(int argc, char **argv)
 {
+	const char *cfgfile = argc > 1 ? argv[1] : "test_cfgfile";
+	struct object_broker_client_init dp_client = { 0 };
 	int rc;
 	pid_t pid;
 	struct broker_obj *b_obj;
@@ -51,19 +54,28 @@ int main(int argc, char **argv)
 	int i;
 	int status;
 
-	rc = route_broker_init();
+	rc = route_broker_init(0);
 	assert(rc == 0);
 	route_broker_topic_gen = route_topic;
+	route_broker_key_gen = route_key_gen;
 	route_broker_copy_obj = rib_nl_copy;
 	route_broker_free_obj = rib_nl_free;
+	route_broker_obj_type = route_obj_type;
+	route_broker_obj_size = rib_nl_size;
 
 	/*
 	 * Create the routing side of it - the broker should open up its control
 	 * socket and then wait for the dp.
 	 */
 	printf("Initialising broker\n ");
-	rc = route_broker_dataplane_ctrl_init("test_cfgfile",
-					      rib_nl_dp_publish_route, 0);
+	dp_client.cfg_file = cfgfile;
+	dp_client.type = OB_CLIENT_DP_ZSOCK;
+	dp_client.client_publish = rib_nl_dp_publish_route;
+	dp_client.client_publish_batch = rib_nl_dp_publish_batch;
+	dp_client.client_publish_deflate = rib_nl_dp_publish_deflate;
+	dp_client.client_deflate_dict =
+		rib_nl_dp_deflate_dict(&dp_client.client_deflate_dict_len);
+	rc = route_broker_dataplane_ctrl_init(&dp_client);
 	assert(rc == 0);
 
 	/* Now create the dp side of it. */
@@ -94,8 +106,8 @@ int main(int argc, char **argv)
 	printf("b_obj is %s\n", b_obj ? "set" : "unset");
 	assert(b_obj);
 
-	/* Insert some routes */
-	add_routes(10);
+	/* Insert some routes, enough for the dp to be sent a compressed batch */
+	add_routes(40);
 
 	printf("about to wait for pid %d\n", pid);
 	if (waitpid(pid, &status, 0) < 0)
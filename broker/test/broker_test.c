@@ -12,10 +12,13 @@
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <linux/rtnetlink.h>
+#include <libmnl/libmnl.h>
 #include <czmq.h>
 
 #include "broker.h"
 #include "route_broker_internal.h"
+#include "route_pool.h"
 #include "netlink_create.h"
 #include "cli.h"
 
@@ -25,6 +28,8 @@ static int consumed_count;
 /* use this to slow consumer, will only take them when this is positive */
 static int available;
 static int client_count;
+/* Clients are not markers in the object list when using the seq log */
+static bool seq_log;
 
 struct route_broker_client *client;
 
@@ -77,6 +82,18 @@ struct route_verify {
 	const char *data;
 };
 
+/* Check the route has the given topic, which is not kept in the route */
+static void verify_route_topic(struct rib_route *route, const char *key)
+{
+	char topic[ROUTE_TOPIC_LEN];
+	bool del;
+	int rc;
+
+	rc = route_topic(route->data->obj, topic, sizeof(topic), &del);
+	assert(rc > 0);
+	assert(!strcmp(topic, key));
+}
+
 /*
  * Types is a -1 terminated array of the types/client
  *
@@ -94,6 +111,11 @@ void verify_seq(const int *types, const struct route_verify *r_vals)
 	b_obj = route_broker_seq_first(&pri);
 
 	while (*types != -(ROUTE_BROKER_TYPES_MAX + 1)) {
+		if (seq_log && *types == BROKER_TEST_CLIENT) {
+			types++;
+			continue;
+		}
+
 		/* Is the next object the correct type? */
 		if (b_obj->flags & BROKER_FLAGS_OBJ) {
 			/* -ve value means marked for del */
@@ -108,9 +130,9 @@ void verify_seq(const int *types, const struct route_verify *r_vals)
 			case ROUTE_BROKER_ROUTE:
 				route = broker_obj_to_rib_route(b_obj);
 				assert(route);
-				assert(!strcmp(r_vals->key, route->topic));
+				verify_route_topic(route, r_vals->key);
 				nl = (struct nlmsghdr *)r_vals->data;
-				assert(!memcmp(r_vals->data, route->data,
+				assert(!memcmp(r_vals->data, route->data->obj,
 					       nl->nlmsg_len));
 				r_vals++;
 				break;
@@ -149,6 +171,9 @@ char R1_buf[1024];
 char R2_buf[1024];
 char R3_buf[1024];
 
+char n1_buf[1024];
+char N1_buf[1024];
+
 /* Ordered list for ease of viewing with priority: c, r, R */
 static int obj_none[] = { -M };
 static int obj_r[] = { r, -M };
@@ -156,20 +181,25 @@ static int obj_r[] = { r, -M };
 static int obj_rr[] = { r, r, -M };
 
 static int obj_ccc[] = { C, C, C, -M };
+static int obj_cccc[] = { C, C, C, C, -M };
 static int obj_rrr[] = { r, r, r, -M };
+static int obj_rrccc[] = { r, r, C, C, C, -M };
 
 static int obj_ccrc[] = { C, C, r, C, -M };
+static int obj_crcc[] = { C, r, C, C, -M };
 static int obj_rccc[] = { r, C, C, C, -M };
 static int obj_Rccc[] = { R, C, C, C, -M };
 
 static int obj_ccrrc[] = { C, C, r, r, C, -M };
 static int obj_crcrc[] = { C, r, C, r, C, -M };
 static int obj_rccrc[] = { r, C, C, r, C, -M };
-static int obj_Rccrc[] = { R, C, C, r, C, -M };
+static int obj_cccrr[] = { C, C, C, r, r, -M };
+static int obj_Rcccr[] = { R, C, C, C, r, -M };
 static int obj_RRccc[] = { R, R, C, C, C, -M };
 
 static int obj_ccrrrc[] = { C, C, r, r, r, C, -M };
 static int obj_crrcrc[] = { C, r, r, C, r, C, -M };
+static int obj_rrccrc[] = { r, r, C, C, r, C, -M };
 static int obj_crrccr[] = { C, r, r, C, C, r, -M };
 static int obj_crrrcc[] = { C, r, r, r, C, C, -M };
 static int obj_rcrccr[] = { r, C, r, C, C, r, -M };
@@ -178,20 +208,21 @@ static int obj_rcrrcc[] = { r, C, r, r, C, C, -M };
 static int obj_rrcrcc[] = { r, r, C, r, C, C, -M };
 static int obj_rrrccc[] = { r, r, r, C, C, C, -M };
 static int obj_Rcrrcc[] = { R, C, r, r, C, C, -M };
-static int obj_Rccrrc[] = { R, C, C, r, r, C, -M };
-static int obj_Rrrccc[] = { R, r, r, C, C, C, -M };
+static int obj_cccrrr[] = { C, C, C, r, r, r, -M };
+static int obj_Rcccrr[] = { R, C, C, C, r, r, -M };
 static int obj_RRcrcc[] = { R, R, C, r, C, C, -M };
-static int obj_RRrccc[] = { R, R, r, C, C, C, -M };
 static int obj_RRRccc[] = { R, R, R, C, C, C, -M };
 
 /* Ordered list for ease of viewing with priority: r, R */
 static struct route_verify no_routes[1];
 static struct route_verify r1[2];
+static struct route_verify R1[2];
 static struct route_verify R2[2];
 static struct route_verify R3[2];
 
 static struct route_verify r1r2[3];
 static struct route_verify r2r1[3];
+static struct route_verify r1r3[3];
 static struct route_verify r3r2[3];
 static struct route_verify R2r3[3];
 static struct route_verify R2R1[3];
@@ -205,12 +236,10 @@ static struct route_verify r3r1r2[4];
 static struct route_verify r3r2r1[4];
 
 static struct route_verify R1r3r2[4];
-static struct route_verify R1R2R3[4];
 static struct route_verify R1R3r2[4];
 static struct route_verify R2R1r3[4];
 static struct route_verify R2R1R3[4];
-static struct route_verify R2R3r1[4];
-static struct route_verify R3r1r2[4];
+static struct route_verify R3r2r1[4];
 static struct route_verify R3R2R1[4];
 
 static void build_route_buffers(void)
@@ -222,6 +251,8 @@ static void build_route_buffers(void)
 	netlink_del_route(R1_buf, "1.1.1.0/24 nh 4.4.4.2 int:dp2T0");
 	netlink_del_route(R2_buf, "1.1.2.0/24 nh 4.4.4.2 int:dp2T0");
 	netlink_del_route(R3_buf, "1.1.3.0/24 nh 4.4.4.2 int:dp2T0");
+	netlink_add_nexthop(n1_buf, 1);
+	netlink_del_nexthop(N1_buf, 1);
 
 	no_routes[0].key = NULL;
 	no_routes[0].data = NULL;
@@ -231,6 +262,11 @@ static void build_route_buffers(void)
 	r1[1].key = NULL;
 	r1[1].data = NULL;
 
+	R1[0].key = k1;
+	R1[0].data = R1_buf;
+	R1[1].key = NULL;
+	R1[1].data = NULL;
+
 	R2[0].key = k2;
 	R2[0].data = R2_buf;
 	R2[1].key = NULL;
@@ -269,6 +305,13 @@ static void build_route_buffers(void)
 	R2R1[2].key = NULL;
 	R2R1[2].data = NULL;
 
+	r1r3[0].key = k1;
+	r1r3[0].data = r1_buf;
+	r1r3[1].key = k3;
+	r1r3[1].data = r3_buf;
+	r1r3[2].key = NULL;
+	r1r3[2].data = NULL;
+
 	r3r2[0].key = k3;
 	r3r2[0].data = r3_buf;
 	r3r2[1].key = k2;
@@ -292,15 +335,6 @@ static void build_route_buffers(void)
 	r1r2r3[3].key = NULL;
 	r1r2r3[3].data = NULL;
 
-	R1R2R3[0].key = k1;
-	R1R2R3[0].data = R1_buf;
-	R1R2R3[1].key = k2;
-	R1R2R3[1].data = R2_buf;
-	R1R2R3[2].key = k3;
-	R1R2R3[2].data = R3_buf;
-	R1R2R3[3].key = NULL;
-	R1R2R3[3].data = NULL;
-
 	r1r3r2[0].key = k1;
 	r1r3r2[0].data = r1_buf;
 	r1r3r2[1].key = k3;
@@ -364,15 +398,6 @@ static void build_route_buffers(void)
 	R2R1R3[3].key = NULL;
 	R2R1R3[3].data = NULL;
 
-	R2R3r1[0].key = k2;
-	R2R3r1[0].data = R2_buf;
-	R2R3r1[1].key = k3;
-	R2R3r1[1].data = R3_buf;
-	R2R3r1[2].key = k1;
-	R2R3r1[2].data = r1_buf;
-	R2R3r1[3].key = NULL;
-	R2R3r1[3].data = NULL;
-
 	r3r1r2[0].key = k3;
 	r3r1r2[0].data = r3_buf;
 	r3r1r2[1].key = k1;
@@ -400,14 +425,14 @@ static void build_route_buffers(void)
 	R3R2R1[3].key = NULL;
 	R3R2R1[3].data = NULL;
 
-	R3r1r2[0].key = k3;
-	R3r1r2[0].data = R3_buf;
-	R3r1r2[1].key = k1;
-	R3r1r2[1].data = r1_buf;
-	R3r1r2[2].key = k2;
-	R3r1r2[2].data = r2_buf;
-	R3r1r2[3].key = NULL;
-	R3r1r2[3].data = NULL;
+	R3r2r1[0].key = k3;
+	R3r2r1[0].data = R3_buf;
+	R3r2r1[1].key = k2;
+	R3r2r1[1].data = r2_buf;
+	R3r2r1[2].key = k1;
+	R3r2r1[2].data = r1_buf;
+	R3r2r1[3].key = NULL;
+	R3r2r1[3].data = NULL;
 }
 
 static void add_route_1(int pri)
@@ -440,33 +465,73 @@ static void del_route_3(int pri)
 	route_broker_publish((struct nlmsghdr *)R3_buf, pri);
 }
 
+static void add_nhg_1(void)
+{
+	route_broker_publish((struct nlmsghdr *)n1_buf, ROUTE_OTHER);
+}
+
+static void del_nhg_1(void)
+{
+	route_broker_publish((struct nlmsghdr *)N1_buf, ROUTE_OTHER);
+}
+
+/* Let the consumer take 'count' objects, in as few batches as it can */
+static void consume(int count)
+{
+	available = count;
+	while (available > 0)
+		usleep(1);
+}
+
 /* Starting with 3 routes, and a client at the bottom. */
 static void consume1(void)
 {
-	available = 1;
-	while (available == 1)
-		usleep(1);
+	consume(1);
 }
 
+/* Topics of the most recently consumed objects */
+#define CONSUMED_TOPICS 8
+static char consumed_topic[CONSUMED_TOPICS][ROUTE_TOPIC_LEN];
+static bool consumed_del[CONSUMED_TOPICS];
+
 static void *test_consumer(void *arg)
 {
-	struct nlmsghdr *nl;
-	struct broker_client *bc;
+	struct route_broker_data data[ROUTE_BROKER_BATCH];
+	int count;
+	int i;
 
-	client = route_broker_client_create("test");
+	client = route_broker_client_create_flush("test");
 	client_count++;
 
 	while (true) {
-		while ((available > 0)
-		       && (nl = route_broker_client_get_data(client, &bc))) {
-			char buf[ROUTE_TOPIC_LEN];
+		while ((count = available) > 0) {
 			bool delete = false;
 
-			route_topic(nl, buf, ROUTE_TOPIC_LEN, &delete);
+			if (count > ROUTE_BROKER_BATCH)
+				count = ROUTE_BROKER_BATCH;
+			count = route_broker_client_get_batch(client, data,
+							      count);
+			if (!count)
+				break;
 
-			consumed_count++;
-			available--;
-			route_broker_client_free_data(client, nl);
+			for (i = 0; i < count; i++) {
+				if (((struct nlmsghdr *)data[i].obj)->nlmsg_type ==
+				    NLMSG_OVERRUN)
+					strcpy(consumed_topic[consumed_count %
+							      CONSUMED_TOPICS],
+					       "flush");
+				else
+					route_topic(data[i].obj,
+						    consumed_topic[consumed_count %
+								   CONSUMED_TOPICS],
+						    ROUTE_TOPIC_LEN, &delete);
+				consumed_del[consumed_count %
+					     CONSUMED_TOPICS] = delete;
+				consumed_count++;
+				route_broker_client_free_data(client,
+							      data[i].obj);
+			}
+			available -= count;
 		}
 		if (finished)
 			break;
@@ -475,6 +540,56 @@ static void *test_consumer(void *arg)
 	pthread_exit(0);
 }
 
+/*
+ * Add and delete routes, each had by a client of our own in between,
+ * while the test client is stalled. Their deletes must not be kept for
+ * it.
+ */
+#define CHURN_ROUTES 64
+static void churn_stalled(int pri)
+{
+	struct route_broker_data data[ROUTE_BROKER_BATCH];
+	struct route_broker_client *other;
+	char buf[1024];
+	int count;
+	int i;
+	int j;
+
+	other = route_broker_client_create("other");
+	assert(other);
+	for (i = 0; i < CHURN_ROUTES; i++) {
+		netlink_add_route(buf, "3.0.%d.0/24 nh 4.4.4.2 int:dp2T0", i);
+		route_broker_publish((struct nlmsghdr *)buf, pri);
+		count = route_broker_client_try_batch(other, data,
+						      ROUTE_BROKER_BATCH);
+		for (j = 0; j < count; j++)
+			route_broker_client_free_data(other, data[j].obj);
+
+		netlink_del_route(buf, "3.0.%d.0/24 nh 4.4.4.2 int:dp2T0", i);
+		route_broker_publish((struct nlmsghdr *)buf, pri);
+		count = route_broker_client_try_batch(other, data,
+						      ROUTE_BROKER_BATCH);
+		for (j = 0; j < count; j++)
+			route_broker_client_free_data(other, data[j].obj);
+		assert(route_broker[pri]->tomb_count <= 1);
+	}
+	route_broker_client_delete(other);
+}
+
+/* Check the topic of the n'th most recently consumed object */
+static void verify_consumed(int n, const char *key)
+{
+	assert(!strcmp(consumed_topic[(consumed_count - n) % CONSUMED_TOPICS],
+		       key));
+}
+
+/* As above, and check whether it was a delete */
+static void verify_consumed_del(int n, const char *key, bool del)
+{
+	verify_consumed(n, key);
+	assert(consumed_del[(consumed_count - n) % CONSUMED_TOPICS] == del);
+}
+
 static void new_consumer(void)
 {
 	int rc;
@@ -495,9 +610,97 @@ static void delete_consumer(void)
 	assert(rc == 0);
 }
 
-int route_broker_dataplane_ctrl_init(const char *cfgfile,
-				     object_broker_client_publish_cb publish,
-				     uint32_t data_format)
+/*
+ * Check a snapshot entry is for the given route, in the given state, with
+ * the data it had then
+ */
+static void verify_snapshot_ent(const struct broker_snapshot_ent *ent,
+				const char *key, bool del, const char *buf)
+{
+	struct rib_route *route = broker_obj_to_rib_route(ent->obj);
+	struct rib_data *data = ent->data;
+	const struct nlmsghdr *nl = (const struct nlmsghdr *)buf;
+
+	verify_route_topic(route, key);
+	assert(!(ent->flags & BROKER_FLAGS_DELETE) == !del);
+	assert(data && !memcmp(data->obj, buf, nl->nlmsg_len));
+}
+
+static void verify_snapshot(void)
+{
+	struct broker *broker = route_broker[ROUTE_CONNECTED];
+	struct broker_snapshot_ent ents[4];
+	struct broker_snapshot *snap;
+	unsigned int n;
+
+	snap = broker_snapshot_start(broker);
+	assert(snap);
+
+	n = broker_snapshot_next(snap, ents, 1);
+	assert(n == 1);
+	verify_snapshot_ent(&ents[0], k3, false, r3_buf);
+	broker_snapshot_put(broker, ents, n);
+
+	/* Change the routes that have not been handed out yet */
+	add_route_1(ROUTE_CONNECTED);
+	del_route_2(ROUTE_CONNECTED);
+
+	n = broker_snapshot_next(snap, ents, 4);
+	assert(n == 2);
+	/* The deleted route is handed out as it was, not as its delete */
+	verify_snapshot_ent(&ents[0], k2, false, r2_buf);
+	verify_snapshot_ent(&ents[1], k1, false, r1_buf);
+	broker_snapshot_put(broker, ents, n);
+
+	n = broker_snapshot_next(snap, ents, 4);
+	assert(n == 0);
+	broker_snapshot_end(snap);
+}
+
+static int show_lines;
+
+static void count_lines(void *arg, const char *fmt, ...)
+{
+	show_lines++;
+}
+
+/*
+ * Change more routes than a show keeps before it gets to them. The rest
+ * of the level is not shown, rather than all of them being kept.
+ */
+#define SAVED_ROUTES (ROUTE_BROKER_SHOW_SAVED_MAX + 8)
+static void verify_show_saved_max(const struct route_broker_show_filter *f)
+{
+	struct route_broker_show_cursor *cursor;
+	char buf[1024];
+	int i;
+
+	for (i = 0; i < SAVED_ROUTES; i++) {
+		netlink_add_route(buf, "5.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+				  i / 256, i % 256);
+		route_broker_publish((struct nlmsghdr *)buf, ROUTE_CONNECTED);
+	}
+
+	cursor = route_broker_show_start(f, NULL);
+	assert(cursor);
+	assert(route_broker_show_page(cursor, count_lines, NULL, 1));
+
+	for (i = 0; i < SAVED_ROUTES; i++) {
+		netlink_del_route(buf, "5.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+				  i / 256, i % 256);
+		route_broker_publish((struct nlmsghdr *)buf, ROUTE_CONNECTED);
+	}
+
+	show_lines = 0;
+	while (route_broker_show_page(cursor, count_lines, NULL, 64))
+		;
+	/* Just the line saying why */
+	assert(show_lines == 1);
+	route_broker_show_end(cursor);
+}
+
+int route_broker_dataplane_ctrl_init(
+	const struct object_broker_client_init *client)
 {
 	return 0;
 }
@@ -515,17 +718,241 @@ int route_broker_kernel_init(object_broker_client_publish_cb publish)
 	return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * Shared objects are handed to every client as they are, and can be
+ * held on to past being freed. Otherwise each client gets a copy.
+ */
+static void verify_shared(void)
+{
+	struct route_broker_client *c1, *c2;
+	struct route_broker_data d1, d2;
+	const struct route_attrs *attrs;
+	char topic[ROUTE_TOPIC_LEN];
+	struct nlmsghdr *obj;
+	bool del;
+	int rc;
+	int n;
+
+	c1 = route_broker_client_create("shared1");
+	c2 = route_broker_client_create("shared2");
+	assert(c1 && c2);
+
+	add_route_1(ROUTE_CONNECTED);
+	n = route_broker_client_get_batch(c1, &d1, 1);
+	assert(n == 1);
+	n = route_broker_client_get_batch(c2, &d2, 1);
+	assert(n == 1);
+
+	if (route_broker_obj_size) {
+		assert(d1.obj == d2.obj);
+		assert(route_broker_data_hold(d1.obj));
+		/* Along with where its attributes are */
+		attrs = route_broker_data_attrs(d1.obj);
+		assert(attrs);
+		assert(attrs->dst && !attrs->src && !attrs->nhg_id);
+	} else {
+		assert(d1.obj != d2.obj);
+		assert(!route_broker_data_hold(d1.obj));
+		assert(!route_broker_data_attrs(d1.obj));
+	}
+	obj = d1.obj;
+	route_broker_client_free_data(c1, d1.obj);
+	route_broker_client_free_data(c2, d2.obj);
+	route_broker_client_delete(c1);
+	route_broker_client_delete(c2);
+
+	consume(1);
+	del_route_1(ROUTE_CONNECTED);
+	consume(1);
+	verify_seq(obj_ccc, no_routes);
+
+	/* Still there after the route has gone */
+	if (route_broker_obj_size) {
+		rc = route_topic(obj, topic, sizeof(topic), &del);
+		assert(rc > 0);
+		assert(!strcmp(topic, k1));
+		route_broker_data_release(obj);
+	}
+}
+
+/*
+ * Attributes are found wherever they are in a message, even past 64k,
+ * and a message with one too short or running past the end is refused.
+ */
+static void verify_route_attrs(void)
 {
+	static char buf[100000];
+	static char pad[40000];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct nlattr *attr;
+	char topic[ROUTE_TOPIC_LEN];
+	uint16_t table = 100;
+	bool del;
 	int rc;
 
-	rc = route_broker_init();
+	netlink_add_route(buf, "10.0.0.0/24 nh 4.4.4.2 int:dp2T0");
+	mnl_attr_put(nlh, RTA_UNSPEC, sizeof(pad), pad);
+	mnl_attr_put(nlh, RTA_UNSPEC, sizeof(pad), pad);
+	mnl_attr_put_u32(nlh, RTA_TABLE, table);
+	assert(nlh->nlmsg_len > UINT16_MAX);
+	rc = route_topic(nlh, topic, sizeof(topic), &del);
+	assert(rc > 0);
+	assert(!strcmp(topic, "r 10.0.0.0/24 0 100"));
+
+	/* A table too short to hold one */
+	netlink_add_route(buf, "10.0.0.0/24 nh 4.4.4.2 int:dp2T0");
+	mnl_attr_put_u16(nlh, RTA_TABLE, table);
+	assert(route_topic(nlh, topic, sizeof(topic), &del) < 0);
+
+	/* An attribute longer than what is left of the message */
+	netlink_add_route(buf, "10.0.0.0/24 nh 4.4.4.2 int:dp2T0");
+	attr = mnl_nlmsg_get_payload_tail(nlh);
+	mnl_attr_put_u32(nlh, RTA_TABLE, table);
+	attr->nla_len += 8;
+	assert(route_topic(nlh, topic, sizeof(topic), &del) < 0);
+}
+
+/* Add and delete a route 'count' times, consuming each change */
+static void route_churn(int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		add_route_1(ROUTE_CONNECTED);
+		consume(1);
+		del_route_1(ROUTE_CONNECTED);
+		consume(1);
+	}
+}
+
+/* Routes for the scheduling tests, the a's and b's at different levels */
+#define SCHED_ROUTES 4
+static char sched_buf[2][SCHED_ROUTES][1024];
+static char sched_del_buf[2][SCHED_ROUTES][1024];
+static char sched_key[2][SCHED_ROUTES][ROUTE_TOPIC_LEN];
+
+static void sched_publish(int set, int i, bool del, int pri)
+{
+	char *buf = del ? sched_del_buf[set][i] : sched_buf[set][i];
+
+	route_broker_publish((struct nlmsghdr *)buf, pri);
+}
+
+/*
+ * With the levels taking turns, a run of changes at a high priority
+ * does not hold up those at a lower one. There is a level more than
+ * usual, and the b's are published past the last one so go in it.
+ */
+static void run_sched_tests(enum route_broker_sched_type type)
+{
+	struct route_broker_level_stats stats[ROUTE_BROKER_LEVELS_MAX];
+	struct route_broker_sched sched = {
+		.type = type,
+		.levels = ROUTE_PRIORITY_MAX + 1,
+	};
+	/* Two a's to every b, until there are only b's left */
+	const char *order = "aabaabbb";
+	int next[2] = { 0, 0 };
+	uint32_t cost = 1;
+	int last = ROUTE_PRIORITY_MAX;
+	int set;
+	int rc;
+	int i;
+
+	for (set = 0; set < 2; set++) {
+		for (i = 0; i < SCHED_ROUTES; i++) {
+			netlink_add_route(sched_buf[set][i],
+					  "2.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+					  set + 1, i);
+			netlink_del_route(sched_del_buf[set][i],
+					  "2.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+					  set + 1, i);
+			snprintf(sched_key[set][i], ROUTE_TOPIC_LEN,
+				 "r 2.%d.%d.0/24 0 254", set + 1, i);
+		}
+	}
+
+	/* The routes are all the same size */
+	if (type == ROUTE_SCHED_DRR)
+		cost = ((struct nlmsghdr *)sched_buf[0][0])->nlmsg_len;
+	sched.quantum[ROUTE_CONNECTED] = 2 * cost;
+	sched.quantum[last] = cost;
+
+	seq_log = false;
+	finished = false;
+	available = 0;
+	rc = route_broker_init_sched(0, &sched);
 	assert(rc == 0);
-	route_broker_topic_gen = route_topic;
-	route_broker_copy_obj = rib_nl_copy;
-	route_broker_free_obj = rib_nl_free;
+	assert(ROUTE_BROKER_LEVELS == ROUTE_PRIORITY_MAX + 2);
+	new_consumer();
 
-	build_route_buffers();
+	for (i = 0; i < SCHED_ROUTES; i++) {
+		sched_publish(0, i, false, ROUTE_CONNECTED);
+		sched_publish(1, i, false, ROUTE_PRIORITY_LEVELS_MAX);
+	}
+	assert(route_broker[last]->id == SCHED_ROUTES);
+
+	consume(2 * SCHED_ROUTES);
+	for (i = 0; i < 2 * SCHED_ROUTES; i++) {
+		set = order[i] - 'a';
+		verify_consumed(2 * SCHED_ROUTES - i,
+				sched_key[set][next[set]++]);
+	}
+
+	/*
+	 * A nexthop group delete goes in the last level, and has to wait
+	 * for the routes before it in the others, even past their turn.
+	 */
+	add_nhg_1();
+	consume(1);
+	for (i = 0; i < 3; i++)
+		sched_publish(0, i, false, ROUTE_CONNECTED);
+	del_nhg_1();
+	consume(4);
+	verify_consumed_del(1, "nhg 1", true);
+
+	route_broker_get_level_stats(stats);
+	assert(stats[ROUTE_CONNECTED].served == SCHED_ROUTES + 3);
+	assert(stats[last].served == SCHED_ROUTES + 1);
+	assert(stats[ROUTE_BROKER_NHG_LEVEL].served == 1);
+	assert(stats[ROUTE_IGP].served == 0);
+
+	for (i = 0; i < SCHED_ROUTES; i++) {
+		sched_publish(0, i, true, ROUTE_CONNECTED);
+		sched_publish(1, i, true, last);
+	}
+	consume(2 * SCHED_ROUTES);
+	verify_seq(obj_cccc, no_routes);
+
+	delete_consumer();
+	route_broker_client_delete(client);
+	client_count--;
+
+	rc = route_broker_destroy();
+	assert(rc == 0);
+	assert(client_count == 0);
+}
+
+static void run_tests(unsigned int flags)
+{
+	struct route_pool_stats pool_before[ROUTE_POOL_CLASSES + 1];
+	struct route_pool_stats pool_after[ROUTE_POOL_CLASSES + 1];
+	struct object_broker_msg batch[4];
+	struct route_broker_show_cursor *cursor;
+	struct route_broker_show_filter filter;
+	struct route_broker_show_pos pos;
+	struct broker *broker;
+	uint64_t dels, upds;
+	size_t log_size;
+	int rc;
+	int i;
+
+	seq_log = flags & BROKER_CREATE_SEQ_LOG;
+	finished = false;
+	available = 0;
+
+	rc = route_broker_init(flags);
+	assert(rc == 0);
 
 	/*
 	 * Start testing.
@@ -539,15 +966,16 @@ int main(int argc, char **argv)
 	add_route_2(ROUTE_CONNECTED);
 	verify_seq(obj_rr, r2r1);
 
+	/* No client has seen it, so it is updated where it is */
 	add_route_1(ROUTE_CONNECTED);
-	verify_seq(obj_rr, r1r2);
+	verify_seq(obj_rr, r2r1);
 
 	add_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_rrr, r3r1r2);
+	verify_seq(obj_rrr, r3r2r1);
 
 	/* Delete routes - no consumers so immediate delete */
 	del_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_rr, r1r2);
+	verify_seq(obj_rr, r2r1);
 
 	del_route_2(ROUTE_CONNECTED);
 	verify_seq(obj_r, r1);
@@ -563,43 +991,37 @@ int main(int argc, char **argv)
 	verify_seq(obj_rr, r2r1);
 
 	add_route_1(ROUTE_CONNECTED);
-	verify_seq(obj_rr, r1r2);
+	verify_seq(obj_rr, r2r1);
 
 	add_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_rrr, r3r1r2);
+	verify_seq(obj_rrr, r3r2r1);
 
 	available = 0;
 	new_consumer();
 	/*
-	 * Current status is we have a broker with 3 routes to be consumed. If
-	 * they get marked as deleted now then they have to stay there until
-	 * there are no clients below as we can't tell (in the general case) if
-	 * the client below already had an add for this object.
+	 * Current status is we have a broker with 3 routes to be consumed.
+	 * The client has not got to any of them, so deleting them now takes
+	 * them out there and then, rather than leaving a delete for it.
 	 *
 	 *  1.1.3.0
-	 *  1.1.1.0
 	 *  1.1.2.0
+	 *  1.1.1.0
 	 *  client
 	 */
-	verify_seq(obj_rrrccc, r3r1r2);
+	verify_seq(obj_rrrccc, r3r2r1);
 
 	del_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_Rrrccc, R3r1r2);
+	verify_seq(obj_rrccc, r2r1);
 
 	del_route_2(ROUTE_CONNECTED);
-	verify_seq(obj_RRrccc, R2R3r1);
-	assert(rc == 0);
+	verify_seq(obj_rccc, r1);
 
 	del_route_1(ROUTE_CONNECTED);
-	verify_seq(obj_RRRccc, R1R2R3);
+	verify_seq(obj_ccc, no_routes);
 
 	/* Wait for the consumer to finsh (note it did not consume these) */
 	delete_consumer();
 
-	/*
-	 * this client delete should trigger the delete of the routes marked
-	 * as deleted
-	 */
 	route_broker_client_delete(client);
 	client_count--;
 
@@ -619,28 +1041,28 @@ int main(int argc, char **argv)
 	verify_seq(obj_rr, r2r1);
 
 	add_route_1(ROUTE_CONNECTED);
-	verify_seq(obj_rr, r1r2);
+	verify_seq(obj_rr, r2r1);
 
 	add_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_rrr, r3r1r2);
+	verify_seq(obj_rrr, r3r2r1);
 
 	new_consumer();
 
 	/* Start consuming */
-	verify_seq(obj_rrrccc, r3r1r2);
+	verify_seq(obj_rrrccc, r3r2r1);
 
 	consume1();
-	verify_seq(obj_rrcrcc, r3r1r2);
+	verify_seq(obj_rrcrcc, r3r2r1);
 
 	consume1();
-	verify_seq(obj_rcrrcc, r3r1r2);
+	verify_seq(obj_rcrrcc, r3r2r1);
 
 	consume1();
-	verify_seq(obj_crrrcc, r3r1r2);
+	verify_seq(obj_crrrcc, r3r2r1);
 
 	/* mark objects as to be deleted */
 	del_route_3(ROUTE_CONNECTED);
-	verify_seq(obj_Rcrrcc, R3r1r2);
+	verify_seq(obj_Rcrrcc, R3r2r1);
 
 	del_route_1(ROUTE_CONNECTED);
 	verify_seq(obj_RRcrcc, R1R3r2);
@@ -711,7 +1133,7 @@ int main(int argc, char **argv)
 	 * Delete routes, giving them lower priority
 	 * (everything is now at priority CONNECTED)
 	 */
-	del_route_1(ROUTE_OTHER);
+	del_route_1(ROUTE_CONNECTED);
 	verify_seq(obj_Rcrrcc, R1r3r2);
 
 	del_route_2(ROUTE_OTHER);
@@ -743,15 +1165,19 @@ int main(int argc, char **argv)
 	add_route_3(ROUTE_OTHER);
 	verify_seq(obj_ccrrrc, r3r2r1);
 
+	/* The client has to have had them to be told they have gone */
+	consume(3);
+	verify_seq(obj_cccrrr, r3r2r1);
+
 	/* Delete at higher priority */
 	del_route_1(ROUTE_CONNECTED);
-	verify_seq(obj_Rccrrc, R1r3r2);
+	verify_seq(obj_Rcccrr, R1r3r2);
 
 	consume1();
-	verify_seq(obj_ccrrc, r3r2);
+	verify_seq(obj_cccrr, r3r2);
 
 	del_route_2(ROUTE_CONNECTED);
-	verify_seq(obj_Rccrc, R2r3);
+	verify_seq(obj_Rcccr, R2r3);
 
 	del_route_3(ROUTE_CONNECTED);
 	verify_seq(obj_RRccc, R3R2);
@@ -762,13 +1188,341 @@ int main(int argc, char **argv)
 	consume1();
 	verify_seq(obj_ccc, no_routes);
 
+	/*
+	 * Keep updating the same route so that the client positions have to
+	 * cope with the object moving many times (and the seq log having to
+	 * be compacted).
+	 */
+	for (i = 0; i < 1000; i++)
+		add_route_1(ROUTE_CONNECTED);
+	verify_seq(obj_rccc, r1);
+
+	consume1();
+	verify_seq(obj_crcc, r1);
+
+	del_route_1(ROUTE_CONNECTED);
+	verify_seq(obj_Rccc, R1);
+
+	consume1();
+	verify_seq(obj_ccc, no_routes);
+
+	/* A batch takes everything at a higher priority level first */
+	add_route_1(ROUTE_CONNECTED);
+	add_route_2(ROUTE_OTHER);
+	add_route_3(ROUTE_CONNECTED);
+	verify_seq(obj_rrccrc, r3r1r2);
+
+	consume(3);
+	verify_seq(obj_crrccr, r3r1r2);
+	verify_consumed(3, k1);
+	verify_consumed(2, k3);
+	verify_consumed(1, k2);
+
+	del_route_1(ROUTE_CONNECTED);
+	del_route_2(ROUTE_OTHER);
+	del_route_3(ROUTE_CONNECTED);
+	consume(3);
+	verify_seq(obj_ccc, no_routes);
+
+	/*
+	 * A snapshot sees the routes as they were when it was taken, even
+	 * if they change part way through walking it.
+	 */
+	add_route_1(ROUTE_CONNECTED);
+	add_route_2(ROUTE_CONNECTED);
+	add_route_3(ROUTE_CONNECTED);
+	verify_snapshot();
+	/* The client had not got to route 2, so that has gone altogether */
+	verify_seq(obj_rrccc, r1r3);
+
+	/*
+	 * Header and client for each level, plus the routes and total,
+	 * then the pools.
+	 */
+	show_lines = 0;
+	route_broker_show(count_lines, NULL);
+	assert(show_lines == 1 + 2 * ROUTE_BROKER_LEVELS + 2 + 1 +
+	       1 + ROUTE_POOL_CLASSES + 1);
+
+	/*
+	 * A paged show, filtered down to the one level, picks up in a new
+	 * show from where the last one got to, and shows what was added
+	 * in between.
+	 */
+	memset(&filter, 0, sizeof(filter));
+	filter.levels = 1 << ROUTE_CONNECTED;
+	filter.family = AF_INET;
+	filter.table = RT_TABLE_MAIN;
+	cursor = route_broker_show_start(&filter, NULL);
+	assert(cursor);
+	show_lines = 0;
+	assert(route_broker_show_page(cursor, count_lines, NULL, 1));
+	assert(show_lines == 2 + 1);
+	route_broker_show_get_pos(cursor, &pos);
+	assert(pos.level == ROUTE_CONNECTED);
+	route_broker_show_end(cursor);
+
+	/* It goes straight on, rather than walking route 1 again */
+	add_route_2(ROUTE_CONNECTED);
+	cursor = route_broker_show_start(&filter, &pos);
+	assert(cursor);
+	show_lines = 0;
+	assert(route_broker_show_page(cursor, count_lines, NULL, 1));
+	assert(show_lines == 2 + 1);
+	assert(route_broker_show_page(cursor, count_lines, NULL, 1));
+	assert(show_lines == 2 + 2);
+	while (route_broker_show_page(cursor, count_lines, NULL, 1))
+		;
+	assert(show_lines == 2 + 2);
+	route_broker_show_end(cursor);
+	del_route_2(ROUTE_CONNECTED);
+
+	/* Where it got to has gone and come back, so that is shown again */
+	del_route_1(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	cursor = route_broker_show_start(&filter, &pos);
+	assert(cursor);
+	show_lines = 0;
+	while (route_broker_show_page(cursor, count_lines, NULL, 1))
+		;
+	assert(show_lines == 2 + 2);
+	route_broker_show_end(cursor);
+
+	/* A show left part way keeps only so many of the objects changed */
+	verify_show_saved_max(&filter);
+
+	/* Just the level header when nothing matches */
+	filter.family = AF_INET6;
+	cursor = route_broker_show_start(&filter, NULL);
+	assert(cursor);
+	show_lines = 0;
+	assert(!route_broker_show_page(cursor, count_lines, NULL, 8));
+	assert(show_lines == 2);
+	route_broker_show_end(cursor);
+
+	/* Never seen by the client, so there is nothing for it to consume */
+	del_route_1(ROUTE_CONNECTED);
+	del_route_3(ROUTE_CONNECTED);
+	verify_seq(obj_ccc, no_routes);
+
+	/* A nexthop group is delivered before the routes using it */
+	add_route_1(ROUTE_CONNECTED);
+	add_nhg_1();
+	consume(2);
+	verify_consumed_del(2, "nhg 1", false);
+	verify_consumed_del(1, k1, false);
+
+	/* and deleted after them */
+	del_nhg_1();
+	del_route_1(ROUTE_CONNECTED);
+	consume(2);
+	verify_consumed_del(2, k1, true);
+	verify_consumed_del(1, "nhg 1", true);
+	verify_seq(obj_ccc, no_routes);
+
+	/* Deleting and re-adding before it is consumed only sends the add */
+	add_nhg_1();
+	del_nhg_1();
+	add_nhg_1();
+	consume(1);
+	verify_consumed_del(1, "nhg 1", false);
+	verify_seq(obj_ccc, no_routes);
+
+	del_nhg_1();
+	consume(1);
+	verify_consumed_del(1, "nhg 1", true);
+
+	/*
+	 * Deleted before it is consumed, but after a route that may be
+	 * using it, it is still sent before the route, and deleted after.
+	 */
+	add_nhg_1();
+	add_route_1(ROUTE_CONNECTED);
+	del_nhg_1();
+	consume(3);
+	verify_consumed_del(3, "nhg 1", false);
+	verify_consumed_del(2, k1, false);
+	verify_consumed_del(1, "nhg 1", true);
+	del_route_1(ROUTE_CONNECTED);
+	consume(1);
+	verify_consumed_del(1, k1, true);
+	assert(route_broker[ROUTE_BROKER_NHG_LEVEL]->tomb_count == 0);
+	verify_seq(obj_ccc, no_routes);
+
+	/*
+	 * A client that gets too far behind is told to flush, then catches
+	 * up with the routes as they are, however often they changed in the
+	 * meantime. No deletes are kept for it.
+	 */
+	route_broker_set_lag_limit(4);
+	add_route_1(ROUTE_CONNECTED);
+	add_route_2(ROUTE_CONNECTED);
+	add_route_3(ROUTE_CONNECTED);
+	consume(1);
+	del_route_1(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	del_route_1(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	del_route_1(ROUTE_CONNECTED);
+	assert(client->client[ROUTE_CONNECTED]->flags & BROKER_CLIENT_OVERRUN);
+	assert(route_broker[ROUTE_CONNECTED]->tomb_count == 0);
+	verify_seq(obj_rrccc, r3r2);
+
+	/*
+	 * Routes another client has had leave deletes behind, which go
+	 * once it has had those too, however long this one stalls.
+	 */
+	churn_stalled(ROUTE_CONNECTED);
+
+	consume(3);
+	verify_consumed(3, "flush");
+	verify_consumed_del(2, k3, false);
+	verify_consumed_del(1, k2, false);
+	assert(client->client[ROUTE_CONNECTED]->resyncs == 1);
+	route_broker_set_lag_limit(0);
+	assert(route_broker[ROUTE_CONNECTED]->tomb_count == 0);
+
+	del_route_2(ROUTE_CONNECTED);
+	del_route_3(ROUTE_CONNECTED);
+	consume(2);
+	verify_consumed_del(2, k2, true);
+	verify_consumed_del(1, k3, true);
+	assert(!broker_client_resyncing(client->client[ROUTE_CONNECTED]));
+	verify_seq(obj_ccc, no_routes);
+
+	/*
+	 * Routes that come and go do not grow the log, even if none stay,
+	 * however many times over they fill it.
+	 */
+	log_size = route_broker[ROUTE_CONNECTED]->seq_log_size;
+	for (i = 0; i < 1000 + 4 * (int)log_size; i++) {
+		add_route_1(ROUTE_CONNECTED);
+		del_route_1(ROUTE_CONNECTED);
+	}
+	if (seq_log)
+		assert(route_broker[ROUTE_CONNECTED]->seq_log_size <=
+		       (log_size > 128 ? log_size : 128));
+	verify_seq(obj_ccc, no_routes);
+
+	/*
+	 * A route that flaps before the client gets to it is never sent,
+	 * and updates to it are picked up where it is.
+	 */
+	broker = route_broker[ROUTE_CONNECTED];
+	dels = broker->unseen_dels;
+	upds = broker->unseen_upds;
+	add_route_1(ROUTE_CONNECTED);
+	del_route_1(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	add_route_2(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	verify_seq(obj_rrccc, r2r1);
+	assert(broker->unseen_dels == dels + 1);
+	assert(broker->unseen_upds == upds + 1);
+
+	consume(2);
+	verify_consumed_del(2, k1, false);
+	verify_consumed_del(1, k2, false);
+
+	/*
+	 * Once it has been had an update moves it, but another before the
+	 * client gets to that is picked up where it is.
+	 */
+	add_route_1(ROUTE_CONNECTED);
+	add_route_2(ROUTE_CONNECTED);
+	add_route_1(ROUTE_CONNECTED);
+	verify_seq(obj_rrccc, r2r1);
+	assert(broker->unseen_upds == upds + 2);
+	consume(2);
+	verify_consumed_del(2, k1, false);
+	verify_consumed_del(1, k2, false);
+
+	/* Once it has been had, a delete has to be sent */
+	del_route_1(ROUTE_CONNECTED);
+	del_route_2(ROUTE_CONNECTED);
+	verify_seq(obj_RRccc, R2R1);
+	consume(2);
+	assert(broker->unseen_dels == dels + 1);
+	verify_seq(obj_ccc, no_routes);
+
+	/* A batch ends up the same as publishing one at a time */
+	batch[0].obj = r1_buf;
+	batch[1].obj = r2_buf;
+	batch[2].obj = R1_buf;
+	batch[3].obj = r1_buf;
+	for (i = 0; i < 4; i++)
+		batch[i].pri = ROUTE_CONNECTED;
+	object_broker_publish_batch(batch, 4);
+	verify_seq(obj_rrccc, r1r2);
+	consume(2);
+	verify_consumed_del(2, k2, false);
+	verify_consumed_del(1, k1, false);
+
+	batch[0].obj = R1_buf;
+	batch[1].obj = R2_buf;
+	object_broker_publish_batch(batch, 2);
+	verify_seq(obj_RRccc, R2R1);
+	consume(2);
+	verify_seq(obj_ccc, no_routes);
+
+	verify_shared();
+
+	/* Once warmed up, churning routes takes nothing more from malloc */
+	route_churn(1000);
+	route_pool_get_stats(pool_before);
+	route_churn(1000);
+	route_pool_get_stats(pool_after);
+	for (i = 0; i <= ROUTE_POOL_CLASSES; i++) {
+		assert(pool_after[i].slabs == pool_before[i].slabs);
+		assert(pool_after[i].allocs - pool_before[i].allocs ==
+		       pool_after[i].frees - pool_before[i].frees);
+	}
+	assert(pool_after[ROUTE_POOL_CLASSES].allocs ==
+	       pool_before[ROUTE_POOL_CLASSES].allocs);
+	verify_seq(obj_ccc, no_routes);
+
 	/* Final tidy */
+	delete_consumer();
 	route_broker_client_delete(client);
 	client_count--;
 
 	rc = route_broker_destroy();
 	assert(rc == 0);
 	assert(client_count == 0);
+}
+
+static const struct nlmsghdr flush_msg = {
+	.nlmsg_len = sizeof(struct nlmsghdr),
+	.nlmsg_type = NLMSG_OVERRUN,
+};
+
+int main(int argc, char **argv)
+{
+	route_broker_topic_gen = route_topic;
+	route_broker_key_gen = route_key_gen;
+	route_broker_copy_obj = rib_nl_copy;
+	route_broker_free_obj = rib_nl_free;
+	route_broker_obj_type = route_obj_type;
+	route_broker_obj_size = rib_nl_size;
+	route_broker_flush_obj = &flush_msg;
+
+	build_route_buffers();
+	verify_route_attrs();
+
+	run_tests(0);
+	run_tests(BROKER_CREATE_SEQ_LOG);
+
+	run_sched_tests(ROUTE_SCHED_WRR);
+	run_sched_tests(ROUTE_SCHED_DRR);
+
+	/*
+	 * Routes found by their topics rather than binary keys, and each
+	 * client given its own copy of the objects.
+	 */
+	route_broker_key_gen = NULL;
+	route_broker_obj_size = NULL;
+	run_tests(0);
+
 	printf("All test passed\n");
 	return 0;
 }
@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+/*
+ * Measure the CPU used per route sent to dataplanes that take batches,
+ * for a few numbers of dataplanes. Each dataplane is a broker client
+ * with a PUSH socket, drained by a PULL socket over inproc, all run from
+ * the one thread as a worker would run them.
+ *
+ * In step, the routes are published a chunk at a time and each chunk is
+ * sent to all the dataplanes, so they are all at the same place and can
+ * be sent the same frames. Apart, each dataplane is sent all the routes
+ * before the next is started, so each has frames packed of its own.
+ *
+ * dp_fanout_bench [routes] [dataplanes ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <czmq.h>
+
+#include "broker.h"
+#include "route_broker_internal.h"
+#include "netlink_create.h"
+
+#define BENCH_NL_LEN 256
+#define BENCH_CHUNK 1000
+
+struct bench_dp {
+	struct route_broker_client *client;
+	zsock_t *push;
+	zsock_t *pull;
+};
+
+static char *route_bufs;
+static int route_count = 100000;
+
+static uint64_t cpu_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct nlmsghdr *route_buf(int i)
+{
+	return (struct nlmsghdr *)(route_bufs + (size_t)i * BENCH_NL_LEN);
+}
+
+/*
+ * Each dataplane gets an endpoint of its own, never reused, as libzmq lets
+ * go of an inproc endpoint some time after its socket is closed.
+ */
+static void dp_create(struct bench_dp *dp)
+{
+	static int endpoint;
+	int rc;
+
+	dp->client = route_broker_client_create("bench");
+	assert(dp->client);
+
+	dp->pull = zsock_new_pull(NULL);
+	assert(dp->pull);
+	rc = zsock_bind(dp->pull, "inproc://fanout-%d", endpoint);
+	assert(rc == 0);
+
+	dp->push = zsock_new(ZMQ_PUSH);
+	assert(dp->push);
+	zsock_set_sndhwm(dp->push, 0);
+	rc = zsock_connect(dp->push, "inproc://fanout-%d", endpoint++);
+	assert(rc == 0);
+}
+
+static void dp_destroy(struct bench_dp *dp)
+{
+	route_broker_client_delete(dp->client);
+	zsock_destroy(&dp->push);
+	zsock_destroy(&dp->pull);
+}
+
+/* Send the dataplane a batch, and take it at the other end */
+static int dp_send(struct bench_dp *dp)
+{
+	struct route_broker_data data[ROUTE_BROKER_BATCH];
+	void *objs[ROUTE_BROKER_BATCH];
+	zframe_t *frame;
+	int count;
+	int sent;
+	int i;
+
+	count = route_broker_client_try_batch(dp->client, data,
+					      ROUTE_BROKER_BATCH);
+	for (i = 0; i < count; i++)
+		objs[i] = data[i].obj;
+	for (i = 0; i < count; i += sent) {
+		sent = rib_nl_dp_publish_batch(objs + i, count - i, dp->push);
+		assert(sent > 0);
+	}
+	for (i = 0; i < count; i++)
+		route_broker_client_free_data(dp->client, data[i].obj);
+
+	while (zsock_events(dp->pull) & ZMQ_POLLIN) {
+		frame = zframe_recv(dp->pull);
+		zframe_destroy(&frame);
+	}
+	return count;
+}
+
+static void bench(int dps, bool in_step)
+{
+	struct bench_dp *dp;
+	uint64_t start, sent = 0;
+	int more;
+	int i, j;
+
+	dp = calloc(dps, sizeof(*dp));
+	assert(dp);
+	for (i = 0; i < dps; i++)
+		dp_create(&dp[i]);
+
+	/* Start from where the broker is now */
+	for (i = 0; i < dps; i++)
+		while (dp_send(&dp[i]))
+			;
+
+	start = cpu_nsec();
+	for (i = 0; i < route_count; i++) {
+		route_broker_publish(route_buf(i), i % ROUTE_PRIORITY_MAX);
+		if (!in_step || ((i + 1) % BENCH_CHUNK && i + 1 < route_count))
+			continue;
+		do {
+			more = 0;
+			for (j = 0; j < dps; j++)
+				more += dp_send(&dp[j]);
+			sent += more;
+		} while (more);
+	}
+	for (i = 0; i < dps && !in_step; i++)
+		while ((more = dp_send(&dp[i])))
+			sent += more;
+
+	printf("%3d dataplanes %-8s %8.1f ns/route %8.1f ns/route/dp\n",
+	       dps, in_step ? "in step" : "apart",
+	       (double)(cpu_nsec() - start) / route_count,
+	       (double)(cpu_nsec() - start) / sent);
+
+	for (i = 0; i < dps; i++)
+		dp_destroy(&dp[i]);
+	free(dp);
+}
+
+int route_broker_dataplane_ctrl_init(
+	const struct object_broker_client_init *client)
+{
+	return 0;
+}
+
+void route_broker_dataplane_ctrl_shutdown(void)
+{
+}
+
+void route_broker_kernel_shutdown(void)
+{
+}
+
+int route_broker_kernel_init(object_broker_client_publish_cb publish)
+{
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_dps[] = { 1, 8, 32 };
+	int rc;
+	int i;
+
+	if (argc > 1)
+		route_count = atoi(argv[1]);
+
+	route_broker_topic_gen = route_topic;
+	route_broker_key_gen = route_key_gen;
+	route_broker_copy_obj = rib_nl_copy;
+	route_broker_free_obj = rib_nl_free;
+	route_broker_obj_type = route_obj_type;
+	route_broker_obj_size = rib_nl_size;
+
+	route_bufs = calloc(route_count, BENCH_NL_LEN);
+	assert(route_bufs);
+	for (i = 0; i < route_count; i++)
+		netlink_add_route((char *)route_buf(i),
+				  "%d.%d.%d.0/24 nh 4.4.4.2 int:dp2T0",
+				  10 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+
+	rc = route_broker_init(0);
+	assert(rc == 0);
+
+	printf("%d routes\n", route_count);
+	if (argc < 3) {
+		for (i = 0; i < 3; i++) {
+			bench(default_dps[i], true);
+			bench(default_dps[i], false);
+		}
+	}
+	for (i = 2; i < argc; i++) {
+		bench(atoi(argv[i]), true);
+		bench(atoi(argv[i]), false);
+	}
+
+	rib_nl_dp_publish_flush();
+	free(route_bufs);
+	return 0;
+}
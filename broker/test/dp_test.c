@@ -11,19 +11,32 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <czmq.h>
+#include <zlib.h>
 
 #include "broker.h"
 #include "route_broker_internal.h"
 #include "netlink_create.h"
 #include "cli.h"
 
+/* Given in the ACCEPT when large batches are to be compressed */
+static zframe_t *deflate_dict;
+
+/*
+ * Ask for batches of routes in each frame, to give credit for them, for
+ * large ones to be compressed, and to resume after the routes 'applied'
+ * if 'batch'
+ */
 static char *connect_to_broker_ctrl(zsock_t **ctrl_sock, const char *ep,
-				    const char *uuid)
+				    const char *uuid, bool batch,
+				    uint64_t applied)
 {
 	zmsg_t *msg;
 	int rc = 0;
 	zframe_t *frame;
 	uint32_t prot_version = 0;
+	uint32_t formats = OB_DATA_FORMAT_BATCH | OB_DATA_FORMAT_CREDIT |
+		OB_DATA_FORMAT_DEFLATE | OB_DATA_FORMAT_RESUME;
+	uint32_t data_format;
 	char *uuid_reply;
 	char *str;
 
@@ -47,6 +60,15 @@ static char *connect_to_broker_ctrl(zsock_t **ctrl_sock, const char *ep,
 	rc = zmsg_addstr(msg, uuid);
 	assert(rc >= 0);
 
+	if (batch) {
+		frame = zframe_new(&formats, sizeof(uint32_t));
+		assert(frame);
+		zmsg_append(msg, &frame);
+		frame = zframe_new(&applied, sizeof(uint64_t));
+		assert(frame);
+		zmsg_append(msg, &frame);
+	}
+
 	rc = zmsg_send(&msg, *ctrl_sock);
 	assert(rc >= 0);
 
@@ -66,10 +88,84 @@ static char *connect_to_broker_ctrl(zsock_t **ctrl_sock, const char *ep,
 	str = zmsg_popstr(msg);
 	assert(str);
 
+	frame = zmsg_pop(msg);
+	assert(frame && zframe_size(frame) == sizeof(uint32_t));
+	memcpy(&data_format, zframe_data(frame), sizeof(uint32_t));
+	assert(!!(data_format & OB_DATA_FORMAT_BATCH) == batch);
+	assert(!!(data_format & OB_DATA_FORMAT_CREDIT) == batch);
+	assert(!!(data_format & OB_DATA_FORMAT_DEFLATE) == batch);
+	assert(!!(data_format & OB_DATA_FORMAT_RESUME) == batch);
+	assert(!!(data_format & OB_DATA_FORMAT_RESUMED) == (applied > 0));
+	zframe_destroy(&frame);
+
+	zframe_destroy(&deflate_dict);
+	if (batch) {
+		deflate_dict = zmsg_pop(msg);
+		assert(deflate_dict && zframe_size(deflate_dict));
+	}
+
 	zmsg_destroy(&msg);
 	return str;
 }
 
+/* Give the broker credit for the routes taken */
+static void send_credit(zsock_t *ctrl_sock, const char *uuid, uint32_t credit)
+{
+	zmsg_t *msg;
+	zframe_t *frame;
+	uint32_t prot_version = 0;
+	int rc;
+
+	msg = zmsg_new();
+	assert(msg);
+
+	rc = zmsg_addstr(msg, "CREDIT");
+	assert(rc >= 0);
+
+	frame = zframe_new(&prot_version, sizeof(uint32_t));
+	assert(frame);
+	zmsg_append(msg, &frame);
+
+	rc = zmsg_addstr(msg, uuid);
+	assert(rc >= 0);
+
+	frame = zframe_new(&credit, sizeof(uint32_t));
+	assert(frame);
+	zmsg_append(msg, &frame);
+
+	rc = zmsg_send(&msg, ctrl_sock);
+	assert(rc >= 0);
+}
+
+/* Inflate a compressed batch, returning its length */
+static int inflate_batch(zframe_t *frame, uint8_t *buf, size_t size)
+{
+	struct ob_deflate_hdr hdr;
+	z_stream zs = { 0 };
+	int rc;
+
+	assert(zframe_size(frame) > sizeof(hdr));
+	memcpy(&hdr, zframe_data(frame), sizeof(hdr));
+	assert(hdr.zero == 0 && hdr.len <= size);
+
+	rc = inflateInit(&zs);
+	assert(rc == Z_OK);
+	zs.next_in = zframe_data(frame) + sizeof(hdr);
+	zs.avail_in = zframe_size(frame) - sizeof(hdr);
+	zs.next_out = buf;
+	zs.avail_out = size;
+
+	rc = inflate(&zs, Z_FINISH);
+	assert(rc == Z_NEED_DICT);
+	rc = inflateSetDictionary(&zs, zframe_data(deflate_dict),
+				  zframe_size(deflate_dict));
+	assert(rc == Z_OK);
+	rc = inflate(&zs, Z_FINISH);
+	assert(rc == Z_STREAM_END && zs.total_out == hdr.len);
+	inflateEnd(&zs);
+	return hdr.len;
+}
+
 static void
 connect_to_broker_data(zsock_t **data_sock, const char *data_url,
 		       const char *uuid)
@@ -88,7 +184,11 @@ connect_to_broker_data(zsock_t **data_sock, const char *data_url,
  * Use the control ep passed in in the args
  * use the dp id passed in in the args
  * register with the ctrl channel, and then set up the data channel and
- * pull routes.
+ * pull routes. The first time round one route comes in each frame, then
+ * after restarting batches are asked for, compressed if large, and credit
+ * is given back for the routes in each as it is taken. Then the session
+ * is resumed as if only some of those routes had been applied, and the
+ * rest come again.
  */
 int main(int argc, char **argv)
 {
@@ -98,8 +198,16 @@ int main(int argc, char **argv)
 	zsock_t *data_sock;
 	char *data_url;
 	uint32_t data_msg_count = 0;
+	uint32_t frame_msg_count;
+	uint32_t deflated_count = 0;
+	static uint8_t buf[1024 * 1024];
+	struct nlmsghdr *nlh;
+	zframe_t *frame;
 	zmsg_t *msg;
+	int len;
 	int restart_count = 0;
+	uint64_t applied = 0;
+	uint32_t expected = 40;
 
 	ep = argv[1];
 	uuid = argv[2];
@@ -109,7 +217,8 @@ int main(int argc, char **argv)
 	printf("dp: EP  : %s\n", ep);
 	printf("dp: uuid: %s\n", uuid);
 
-	data_url = connect_to_broker_ctrl(&ctrl_sock, ep, uuid);
+	data_url = connect_to_broker_ctrl(&ctrl_sock, ep, uuid,
+					  restart_count > 0, applied);
 	printf("dp: data: %s\n", data_url);
 
 	connect_to_broker_data(&data_sock, data_url, uuid);
@@ -121,24 +230,50 @@ int main(int argc, char **argv)
 	printf("dp: trying to pull data\n");
 	while ((msg = zmsg_recv(data_sock))) {
 		assert(msg);
-		data_msg_count++;
+		frame = zmsg_first(msg);
+		assert(frame);
+		nlh = (struct nlmsghdr *)zframe_data(frame);
+		len = zframe_size(frame);
+		if (len >= (int)sizeof(uint32_t) && nlh->nlmsg_len == 0) {
+			assert(restart_count > 0);
+			len = inflate_batch(frame, buf, sizeof(buf));
+			nlh = (struct nlmsghdr *)buf;
+			deflated_count++;
+		}
+		for (frame_msg_count = 0; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len))
+			frame_msg_count++;
+		assert(frame_msg_count == 1 || restart_count > 0);
+		data_msg_count += frame_msg_count;
 		zmsg_destroy(&msg);
-		printf("Message received\n");
+		printf("Message received, %u routes\n", frame_msg_count);
+		if (restart_count > 0)
+			send_credit(ctrl_sock, uuid, frame_msg_count);
 
-		if (data_msg_count == 10)
+		if (data_msg_count == expected)
 			break;
 	}
 
 	/* Close sockets */
 	zsock_destroy(&data_sock);
 	zsock_destroy(&ctrl_sock);
-	printf("DP shutting down - processed %d messages\n", data_msg_count);
+	printf("DP shutting down - processed %d messages, %u compressed\n",
+	       data_msg_count, deflated_count);
 
+	assert(data_msg_count == expected);
 	if (restart_count == 0) {
 		restart_count++;
 		data_msg_count = 0;
 		goto init;
 	}
+	if (restart_count == 1) {
+		restart_count++;
+		data_msg_count = 0;
+		applied = 30;
+		expected = 10;
+		goto init;
+	}
 
+	zframe_destroy(&deflate_dict);
 	return 0;
 }
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/nexthop.h>
 #include <linux/socket.h>
 #include <libmnl/libmnl.h>
 #include <netinet/in.h>
@@ -862,3 +863,32 @@ struct nlmsghdr *netlink_add_route(char *buf, const char *format, ...)
 
 	return dp_test_netlink_route(cmd, RTM_NEWROUTE, false, buf);
 }
+
+static struct nlmsghdr *dp_test_netlink_nexthop(uint32_t id, uint16_t nl_type,
+						char *buf)
+{
+	struct nlmsghdr *nlh;
+	struct nhmsg *nhm;
+
+	memset(buf, 0, DP_TEST_TMP_BUF);
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = nl_type;
+	nlh->nlmsg_flags = NLM_F_ACK;
+
+	nhm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nhmsg));
+	nhm->nh_family = AF_UNSPEC;
+	nhm->nh_protocol = RTPROT_UNSPEC;
+
+	mnl_attr_put_u32(nlh, NHA_ID, id);
+	return nlh;
+}
+
+struct nlmsghdr *netlink_del_nexthop(char *buf, uint32_t id)
+{
+	return dp_test_netlink_nexthop(id, RTM_DELNEXTHOP, buf);
+}
+
+struct nlmsghdr *netlink_add_nexthop(char *buf, uint32_t id)
+{
+	return dp_test_netlink_nexthop(id, RTM_NEWNEXTHOP, buf);
+}
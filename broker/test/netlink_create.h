@@ -8,3 +8,5 @@
 
 struct nlmsghdr *netlink_add_route(char *buf, const char *format, ...);
 struct nlmsghdr *netlink_del_route(char *buf, const char *format, ...);
+struct nlmsghdr *netlink_add_nexthop(char *buf, uint32_t id);
+struct nlmsghdr *netlink_del_nexthop(char *buf, uint32_t id);
@@ -0,0 +1,209 @@
+/*-
+ * Copyright (c) 2021, AT&T Intellectual Property. All rights reserved.
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ */
+
+/*
+ * Compare the route hash table with the czmq zhash it replaced, for
+ * tables of a few sizes. Routes are keyed the way route_key_gen keys
+ * them, and zhash is given the text topic as it was before.
+ *
+ * route_hashtbl_bench [routes ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <czmq.h>
+
+#include "route_broker_internal.h"
+#include "route_hashtbl.h"
+
+/* About the size of an IPv4 route key */
+#define BENCH_KEY_LEN 24
+#define BENCH_TOPIC_LEN 64
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct rib_route *route_create(uint32_t i)
+{
+	struct rib_route *route;
+
+	route = calloc(1, sizeof(*route) + BENCH_KEY_LEN);
+	assert(route);
+	route->key_len = BENCH_KEY_LEN;
+	/* type, family, dst_len, table and then the address */
+	route->key[0] = 1;
+	route->key[1] = 2;
+	route->key[2] = 24;
+	route->key[8] = 254;
+	memcpy(route->key + 20, &i, sizeof(i));
+	route->hash = route_key_hash(route->key, route->key_len);
+	return route;
+}
+
+static void report(const char *name, const char *op, int count,
+		   uint64_t nsec)
+{
+	printf("%-14s %-12s %8.1f ns/op\n", name, op, (double)nsec / count);
+}
+
+static void bench_hashtbl(struct rib_route **routes, struct rib_route **miss,
+			  int count)
+{
+	struct route_hashtbl *tbl;
+	uint64_t start, t, worst = 0;
+	int rc;
+	int i;
+
+	tbl = route_hashtbl_create();
+	assert(tbl);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++) {
+		t = now_nsec();
+		rc = route_hashtbl_set(tbl, routes[i]);
+		t = now_nsec() - t;
+		assert(rc == 0);
+		if (t > worst)
+			worst = t;
+	}
+	report("route_hashtbl", "insert", count, now_nsec() - start);
+	assert(route_hashtbl_count(tbl) == (size_t)count);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		assert(route_hashtbl_lookup(tbl, routes[i]) == routes[i]);
+	report("route_hashtbl", "lookup", count, now_nsec() - start);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		assert(!route_hashtbl_lookup(tbl, miss[i]));
+	report("route_hashtbl", "lookup miss", count, now_nsec() - start);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		assert(route_hashtbl_delete(tbl, routes[i]) == routes[i]);
+	report("route_hashtbl", "delete", count, now_nsec() - start);
+	assert(route_hashtbl_count(tbl) == 0);
+
+	printf("%-14s %-12s %8.1f us\n", "route_hashtbl", "worst insert",
+	       worst / 1e3);
+	route_hashtbl_destroy(tbl);
+}
+
+static void bench_zhash(char **topics, char **miss, struct rib_route **routes,
+			int count)
+{
+	zhash_t *hash;
+	uint64_t start, t, worst = 0;
+	int rc;
+	int i;
+
+	hash = zhash_new();
+	assert(hash);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++) {
+		t = now_nsec();
+		rc = zhash_insert(hash, topics[i], routes[i]);
+		t = now_nsec() - t;
+		assert(rc == 0);
+		if (t > worst)
+			worst = t;
+	}
+	report("zhash", "insert", count, now_nsec() - start);
+	assert(zhash_size(hash) == (size_t)count);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		assert(zhash_lookup(hash, topics[i]) == routes[i]);
+	report("zhash", "lookup", count, now_nsec() - start);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		assert(!zhash_lookup(hash, miss[i]));
+	report("zhash", "lookup miss", count, now_nsec() - start);
+
+	start = now_nsec();
+	for (i = 0; i < count; i++)
+		zhash_delete(hash, topics[i]);
+	report("zhash", "delete", count, now_nsec() - start);
+	assert(zhash_size(hash) == 0);
+
+	printf("%-14s %-12s %8.1f us\n", "zhash", "worst insert", worst / 1e3);
+	zhash_destroy(&hash);
+}
+
+static char *topic_create(uint32_t i)
+{
+	char *topic = malloc(BENCH_TOPIC_LEN);
+
+	assert(topic);
+	snprintf(topic, BENCH_TOPIC_LEN, "%d.%d.%d.%d/24 254",
+		 (i >> 24) & 0xff, (i >> 16) & 0xff, (i >> 8) & 0xff,
+		 i & 0xff);
+	return topic;
+}
+
+static void bench(int count)
+{
+	struct rib_route **routes, **miss_routes;
+	char **topics, **miss_topics;
+	int i;
+
+	routes = calloc(count, sizeof(*routes));
+	miss_routes = calloc(count, sizeof(*miss_routes));
+	topics = calloc(count, sizeof(*topics));
+	miss_topics = calloc(count, sizeof(*miss_topics));
+	assert(routes && miss_routes && topics && miss_topics);
+
+	/* Keys with the top bit set are never inserted */
+	for (i = 0; i < count; i++) {
+		routes[i] = route_create(i << 8);
+		miss_routes[i] = route_create((i << 8) | 0x80000000);
+		topics[i] = topic_create(i << 8);
+		miss_topics[i] = topic_create((i << 8) | 0x80000000);
+	}
+
+	printf("%d routes\n", count);
+	bench_hashtbl(routes, miss_routes, count);
+	bench_zhash(topics, miss_topics, routes, count);
+
+	for (i = 0; i < count; i++) {
+		free(routes[i]);
+		free(miss_routes[i]);
+		free(topics[i]);
+		free(miss_topics[i]);
+	}
+	free(routes);
+	free(miss_routes);
+	free(topics);
+	free(miss_topics);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2) {
+		bench(100000);
+		bench(1000000);
+		bench(4000000);
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+		bench(atoi(argv[i]));
+	return 0;
+}
@@ -17,11 +17,16 @@
 #include <netinet/in.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <string.h>
 
 #ifdef RTNLGRP_RTDMN
 #include <linux/rtg_domains.h>
 #endif /* RTNLGRP_RTDMN */
 
+#ifdef RTM_NEWNEXTHOP
+#include <linux/nexthop.h>
+#endif /* RTM_NEWNEXTHOP */
+
 #ifdef RTNLGRP_MPLS_ROUTE
 #include <linux/mpls.h>
 #include <linux/mpls_iptunnel.h>
@@ -30,17 +35,159 @@
 
 #include "route_broker_internal.h"
 
-/* All zero's in IPv4 or IPv6 */
-static const char anyaddr[16];
+enum route_key_type {
+	ROUTE_KEY_ROUTE = 1,
+	ROUTE_KEY_MROUTE,
+	ROUTE_KEY_MPLS,
+	ROUTE_KEY_NHG,
+};
+
+/*
+ * The fields that identify an object, packed so that they can be used
+ * directly as a binary key. Only as much of addr as the family needs is
+ * part of the key, and the rest of it is not filled in.
+ */
+struct route_key {
+	uint8_t type;
+	uint8_t family;
+	uint8_t dst_len;
+	uint8_t src_len;
+	uint8_t scope;
+	uint8_t pad[3];
+	uint32_t table;
+	uint32_t rd_id;
+	/* Label for mpls, id for a nexthop group, iif for multicast */
+	uint32_t id;
+	uint32_t oif;
+	/* Destination, then source for multicast */
+	uint8_t addr[32];
+};
+
+/* Where in the message the attribute is, or NULL if it is not there */
+static inline const struct nlattr *
+route_attr(const struct nlmsghdr *nlh, uint32_t offset)
+{
+	if (!offset)
+		return NULL;
+	return (const struct nlattr *)((const char *)nlh + offset);
+}
+
+static inline uint32_t route_attr_u32(const struct nlmsghdr *nlh,
+				      uint32_t offset)
+{
+	return mnl_attr_get_u32(route_attr(nlh, offset));
+}
+
+/* The field for an attribute of a route message, if it is one we use */
+static uint32_t *route_attrs_field(struct route_attrs *attrs, uint16_t type,
+				   size_t *min_len)
+{
+	*min_len = sizeof(uint32_t);
+	switch (type) {
+	case RTA_DST:
+		/* An address, or a label for mpls, checked when used */
+		*min_len = 0;
+		return &attrs->dst;
+	case RTA_SRC:
+		*min_len = 0;
+		return &attrs->src;
+	case RTA_TABLE:
+		return &attrs->table;
+	case RTA_IIF:
+		return &attrs->iif;
+	case RTA_OIF:
+		return &attrs->oif;
+#ifdef RTNLGRP_RTDMN
+	case RTA_RTG_DOMAIN:
+		return &attrs->rtg_domain;
+#endif
+	}
+	return NULL;
+}
+
+#ifdef RTM_NEWNEXTHOP
+static uint32_t *nexthop_attrs_field(struct route_attrs *attrs, uint16_t type,
+				     size_t *min_len)
+{
+	*min_len = sizeof(uint32_t);
+	if (type == NHA_ID)
+		return &attrs->nhg_id;
+	return NULL;
+}
+#endif /* RTM_NEWNEXTHOP */
+
+int route_attrs_scan(const struct nlmsghdr *nlh, struct route_attrs *attrs)
+{
+	uint32_t *(*field)(struct route_attrs *attrs, uint16_t type,
+			   size_t *min_len);
+	const struct nlattr *attr;
+	uint32_t *offset;
+	size_t min_len;
+	size_t hdrlen;
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		hdrlen = sizeof(struct rtmsg);
+		field = route_attrs_field;
+		break;
+#ifdef RTM_NEWNEXTHOP
+	case RTM_NEWNEXTHOP:
+	case RTM_DELNEXTHOP:
+		hdrlen = sizeof(struct nhmsg);
+		field = nexthop_attrs_field;
+		break;
+#endif /* RTM_NEWNEXTHOP */
+	default:
+		return -1;
+	}
+
+	if (nlh->nlmsg_len < MNL_NLMSG_HDRLEN + MNL_ALIGN(hdrlen))
+		return -1;
+
+	memset(attrs, 0, sizeof(*attrs));
+	mnl_attr_for_each(attr, nlh, hdrlen) {
+		offset = field(attrs, mnl_attr_get_type(attr), &min_len);
+		if (!offset)
+			continue;
+		/* Too short to hold what it is meant to */
+		if (mnl_attr_get_payload_len(attr) < min_len)
+			return -1;
+		*offset = (const char *)attr - (const char *)nlh;
+	}
+
+	/* The walk stops at an attribute that runs past the end */
+	if ((const char *)attr < (const char *)mnl_nlmsg_get_payload_tail(nlh))
+		return -1;
+
+	attrs->scanned = true;
+	return 0;
+}
 
-static int route_attr(const struct nlattr *attr, void *data)
+/* Copy an address into the key, returns the length it takes up */
+static size_t route_key_addr(uint8_t *dst, const struct nlattr *attr,
+			     size_t alen)
 {
-	const struct nlattr **tb = data;
-	unsigned int type = mnl_attr_get_type(attr);
+	size_t len = 0;
 
-	if (type <= RTA_MAX)
-		tb[type] = attr;
-	return MNL_CB_OK;
+	if (attr) {
+		len = mnl_attr_get_payload_len(attr);
+		if (len > alen)
+			len = alen;
+		memcpy(dst, mnl_attr_get_payload(attr), len);
+	}
+	memset(dst + len, 0, alen - len);
+	return alen;
+}
+
+static size_t route_key_addr_len(int af)
+{
+	switch (af) {
+	case AF_INET:
+	case RTNL_FAMILY_IPMR:
+		return 4;
+	}
+	return 16;
 }
 
 static const char *mroute_ntop(int af, const void *src,
@@ -56,60 +203,56 @@ static const char *mroute_ntop(int af, const void *src,
 	return NULL;
 }
 
-static int mroute_topic(const struct nlmsghdr *nlh, char *buf, size_t len,
-			const struct rtmsg *rtm)
+static int mroute_key(const struct nlmsghdr *nlh,
+		      const struct route_attrs *attrs, struct route_key *key,
+		      const struct rtmsg *rtm)
 {
-	struct nlattr *tb[RTA_MAX + 1] = { NULL };
-	int ifindex = 0, oifindex = 0;
-	const void *mcastgrp, *origin;
-	char b1[INET6_ADDRSTRLEN], b2[INET6_ADDRSTRLEN];
-	uint32_t tableid;
+	size_t alen = route_key_addr_len(rtm->rtm_family);
 
 	if (rtm->rtm_table == RT_TABLE_LOCAL)
 		return -1;
 
-	if (mnl_attr_parse(nlh, sizeof(*rtm), route_attr, tb) != MNL_CB_OK)
-		return -1;
+	key->type = ROUTE_KEY_MROUTE;
+	key->src_len = rtm->rtm_src_len;
 
-	if (tb[RTA_DST])
-		mcastgrp = mnl_attr_get_payload(tb[RTA_DST]);
-	else
-		mcastgrp = anyaddr;
+	if (attrs->iif)
+		key->id = route_attr_u32(nlh, attrs->iif);
 
-	if (tb[RTA_SRC])
-		origin = mnl_attr_get_payload(tb[RTA_SRC]);
-	else
-		origin = anyaddr;
+	if (attrs->oif)
+		key->oif = route_attr_u32(nlh, attrs->oif);
 
-	if (tb[RTA_IIF])
-		ifindex = mnl_attr_get_u32(tb[RTA_IIF]);
+	if (attrs->table)
+		key->table = route_attr_u32(nlh, attrs->table);
 
-	if (tb[RTA_OIF])
-		oifindex = mnl_attr_get_u32(tb[RTA_OIF]);
+	if (attrs->rtg_domain)
+		key->rd_id = route_attr_u32(nlh, attrs->rtg_domain);
 
-	if (tb[RTA_TABLE])
-		tableid = mnl_attr_get_u32(tb[RTA_TABLE]);
-	else
-		tableid = rtm->rtm_table;
+	route_key_addr(key->addr, route_attr(nlh, attrs->dst), alen);
+	route_key_addr(key->addr + alen, route_attr(nlh, attrs->src), alen);
+	return offsetof(struct route_key, addr) + 2 * alen;
+}
 
-#ifdef RTNLGRP_RTDMN
-	unsigned int rd_id = VRF_ID_MAIN;
-	if (tb[RTA_RTG_DOMAIN])
-		rd_id = mnl_attr_get_u32(tb[RTA_RTG_DOMAIN]);
+static int mroute_topic(const struct route_key *key, char *buf, size_t len)
+{
+	size_t alen = route_key_addr_len(key->family);
+	char b1[INET6_ADDRSTRLEN], b2[INET6_ADDRSTRLEN];
 
+#ifdef RTNLGRP_RTDMN
 	return snprintf(buf, len, "route %d %d %s/%u %s/%u %u %u",
-			ifindex, oifindex,
-			mroute_ntop(rtm->rtm_family, mcastgrp, b1, sizeof(b1)),
-			rtm->rtm_dst_len,
-			mroute_ntop(rtm->rtm_family, origin, b2, sizeof(b2)),
-			rtm->rtm_src_len, rd_id, tableid);
+			(int)key->id, (int)key->oif,
+			mroute_ntop(key->family, key->addr, b1, sizeof(b1)),
+			key->dst_len,
+			mroute_ntop(key->family, key->addr + alen, b2,
+				    sizeof(b2)),
+			key->src_len, key->rd_id, key->table);
 #else
 	return snprintf(buf, len, "route %d %d %s/%u %s/%u %u",
-			ifindex, oifindex,
-			mroute_ntop(rtm->rtm_family, mcastgrp, b1, sizeof(b1)),
-			rtm->rtm_dst_len,
-			mroute_ntop(rtm->rtm_family, origin, b2, sizeof(b2)),
-			rtm->rtm_src_len, tableid);
+			(int)key->id, (int)key->oif,
+			mroute_ntop(key->family, key->addr, b1, sizeof(b1)),
+			key->dst_len,
+			mroute_ntop(key->family, key->addr + alen, b2,
+				    sizeof(b2)),
+			key->src_len, key->table);
 #endif
 }
 
@@ -119,32 +262,65 @@ static inline uint32_t mpls_ls_get_label(uint32_t ls)
 	return (ntohl(ls) & MPLS_LS_LABEL_MASK) >> MPLS_LS_LABEL_SHIFT;
 }
 
-static int mplsroute_topic(const struct nlmsghdr *nlh, char *buf, size_t len,
-			   const struct rtmsg *rtm)
+static int mplsroute_key(const struct nlmsghdr *nlh,
+			 const struct route_attrs *attrs,
+			 struct route_key *key)
 {
-	struct nlattr *tb[RTA_MAX + 1] = { NULL };
-	uint32_t in_label;
+	const struct nlattr *dst = route_attr(nlh, attrs->dst);
 
-	if (mnl_attr_parse(nlh, sizeof(*rtm), route_attr, tb) != MNL_CB_OK)
+	if (!dst || mnl_attr_get_payload_len(dst) < sizeof(uint32_t))
 		return -1;
 
-	if (tb[RTA_DST])
-		in_label = mnl_attr_get_u32(tb[RTA_DST]);
-	else
+	key->type = ROUTE_KEY_MPLS;
+	key->dst_len = 0;
+	key->table = 0;
+	key->id = mpls_ls_get_label(mnl_attr_get_u32(dst));
+	return offsetof(struct route_key, addr);
+}
+#endif /* RTNLGRP_MPLS_ROUTE */
+
+#ifdef RTM_NEWNEXTHOP
+static int nexthop_key(const struct nlmsghdr *nlh,
+		       const struct route_attrs *attrs, struct route_key *key)
+{
+	if (!attrs->nhg_id)
 		return -1;
 
-	return snprintf(buf, len, "route-mpls %u", mpls_ls_get_label(in_label));
+	memset(key, 0, offsetof(struct route_key, addr));
+	key->type = ROUTE_KEY_NHG;
+	key->id = route_attr_u32(nlh, attrs->nhg_id);
+	return offsetof(struct route_key, addr);
 }
-#endif /* RTNLGRP_MPLS_ROUTE */
+#endif /* RTM_NEWNEXTHOP */
 
-int route_topic(void *obj, char *buf, size_t len, bool *del)
+enum object_broker_obj_type route_obj_type(void *obj)
 {
 	const struct nlmsghdr *nlh = obj;
+
+	switch (nlh->nlmsg_type) {
+#ifdef RTM_NEWNEXTHOP
+	case RTM_NEWNEXTHOP:
+	case RTM_DELNEXTHOP:
+		return OB_OBJ_NEXTHOP_GROUP;
+#endif /* RTM_NEWNEXTHOP */
+	default:
+		return OB_OBJ_ROUTE;
+	}
+}
+
+/*
+ * Make the key for a message from the attributes found in it. Returns
+ * the length of the key, or -1 if it is ignored.
+ */
+static int route_key_parse(const struct nlmsghdr *nlh,
+			   const struct route_attrs *attrs,
+			   struct route_key *key, bool *del)
+{
 	const struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
-	struct nlattr *tb[RTA_MAX + 1] = { NULL };
-	const void *dest;
-	char b1[INET6_ADDRSTRLEN];
-	uint32_t tableid;
+	size_t alen;
+
+	if (!attrs->scanned)
+		return -1;
 
 	switch (nlh->nlmsg_type) {
 	case RTM_NEWROUTE:
@@ -153,17 +329,33 @@ int route_topic(void *obj, char *buf, size_t len, bool *del)
 	case RTM_DELROUTE:
 		*del = true;
 		break;
+#ifdef RTM_NEWNEXTHOP
+	case RTM_NEWNEXTHOP:
+		*del = false;
+		return nexthop_key(nlh, attrs, key);
+	case RTM_DELNEXTHOP:
+		*del = true;
+		return nexthop_key(nlh, attrs, key);
+#endif /* RTM_NEWNEXTHOP */
 	default:
 		return -1;
 	}
 
+	memset(key, 0, offsetof(struct route_key, addr));
+	key->family = rtm->rtm_family;
+	key->dst_len = rtm->rtm_dst_len;
+	key->table = rtm->rtm_table;
+#ifdef RTNLGRP_RTDMN
+	key->rd_id = VRF_ID_MAIN;
+#endif
+
 #ifdef RTNLGRP_MPLS_ROUTE
 	if (rtm->rtm_family == AF_MPLS)
-		return mplsroute_topic(nlh, buf, len, rtm);
+		return mplsroute_key(nlh, attrs, key);
 #endif /* RTNLGRP_MPLS_ROUTE */
 
 	if (rtm->rtm_type == RTN_MULTICAST)
-		return mroute_topic(nlh, buf, len, rtm);
+		return mroute_key(nlh, attrs, key, rtm);
 
 	if (rtm->rtm_type == RTN_BROADCAST)
 		return -1;
@@ -172,33 +364,120 @@ int route_topic(void *obj, char *buf, size_t len, bool *del)
 	if (rtm->rtm_flags & RTM_F_CLONED)
 		return -1;
 
-	if (mnl_attr_parse(nlh, sizeof(*rtm), route_attr, tb) != MNL_CB_OK)
-		return -1;
+	key->type = ROUTE_KEY_ROUTE;
+	key->scope = rtm->rtm_scope;
 
-	if (tb[RTA_DST])
-		dest = mnl_attr_get_payload(tb[RTA_DST]);
-	else
-		dest = anyaddr;
+	if (attrs->table)
+		key->table = route_attr_u32(nlh, attrs->table);
 
-	if (tb[RTA_TABLE])
-		tableid = mnl_attr_get_u32(tb[RTA_TABLE]);
-	else
-		tableid = rtm->rtm_table;
+	if (attrs->rtg_domain)
+		key->rd_id = route_attr_u32(nlh, attrs->rtg_domain);
 
-#ifdef RTNLGRP_RTDMN
-	unsigned int rd_id = VRF_ID_MAIN;
-	if (tb[RTA_RTG_DOMAIN])
-		rd_id = mnl_attr_get_u32(tb[RTA_RTG_DOMAIN]);
+	alen = route_key_addr_len(rtm->rtm_family);
+	route_key_addr(key->addr, route_attr(nlh, attrs->dst), alen);
+	return offsetof(struct route_key, addr) + alen;
+}
+
+/* The text form of a key, as used for showing it */
+static int route_key_topic(const struct route_key *key, char *buf, size_t len)
+{
+	char b1[INET6_ADDRSTRLEN];
 
+	switch (key->type) {
+	case ROUTE_KEY_MROUTE:
+		return mroute_topic(key, buf, len);
+	case ROUTE_KEY_MPLS:
+		return snprintf(buf, len, "route-mpls %u", key->id);
+	case ROUTE_KEY_NHG:
+		return snprintf(buf, len, "nhg %u", key->id);
+	}
+
+#ifdef RTNLGRP_RTDMN
 	return snprintf(buf, len,
 			"r %s/%u %u %u %u",
-			inet_ntop(rtm->rtm_family, dest, b1, sizeof(b1)),
-			rtm->rtm_dst_len, rtm->rtm_scope, tableid, rd_id);
+			inet_ntop(key->family, key->addr, b1, sizeof(b1)),
+			key->dst_len, key->scope, key->table, key->rd_id);
 #else
 	return snprintf(buf, len,
 			"r %s/%u %u %u",
-			inet_ntop(rtm->rtm_family, dest, b1, sizeof(b1)),
-			rtm->rtm_dst_len, rtm->rtm_scope, tableid);
-
+			inet_ntop(key->family, key->addr, b1, sizeof(b1)),
+			key->dst_len, key->scope, key->table);
 #endif
 }
+
+int route_key_gen_attrs(void *obj, struct route_attrs *attrs, void *buf,
+			size_t len, bool *del)
+{
+	struct route_key key;
+	int key_len;
+
+	if (!attrs->scanned && route_attrs_scan(obj, attrs))
+		return -1;
+
+	key_len = route_key_parse(obj, attrs, &key, del);
+	if (key_len <= 0 || (size_t)key_len > len)
+		return -1;
+
+	memcpy(buf, &key, key_len);
+	return key_len;
+}
+
+int route_topic_attrs(void *obj, struct route_attrs *attrs, char *buf,
+		      size_t len, bool *del)
+{
+	struct route_key key;
+
+	if (!attrs->scanned && route_attrs_scan(obj, attrs))
+		return -1;
+
+	if (route_key_parse(obj, attrs, &key, del) <= 0)
+		return -1;
+
+	return route_key_topic(&key, buf, len);
+}
+
+int route_attrs_family_table(const void *obj, const struct route_attrs *attrs,
+			     uint8_t *family, uint32_t *table)
+{
+	const struct nlmsghdr *nlh = obj;
+	const struct rtmsg *rtm;
+#ifdef RTM_NEWNEXTHOP
+	const struct nhmsg *nhm;
+#endif /* RTM_NEWNEXTHOP */
+
+	if (!attrs->scanned)
+		return -1;
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		rtm = mnl_nlmsg_get_payload(nlh);
+		*family = rtm->rtm_family;
+		*table = attrs->table ? route_attr_u32(nlh, attrs->table) :
+			rtm->rtm_table;
+		return 0;
+#ifdef RTM_NEWNEXTHOP
+	case RTM_NEWNEXTHOP:
+	case RTM_DELNEXTHOP:
+		nhm = mnl_nlmsg_get_payload(nlh);
+		*family = nhm->nh_family;
+		*table = 0;
+		return 0;
+#endif /* RTM_NEWNEXTHOP */
+	}
+	return -1;
+}
+
+int route_key_gen(void *obj, void *buf, size_t len, bool *del)
+{
+	struct route_attrs attrs = { .scanned = false };
+
+	return route_key_gen_attrs(obj, &attrs, buf, len, del);
+}
+
+int route_topic(void *obj, char *buf, size_t len, bool *del)
+{
+	struct route_attrs attrs = { .scanned = false };
+
+	return route_topic_attrs(obj, &attrs, buf, len, del);
+}
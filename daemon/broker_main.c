@@ -18,6 +18,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -32,6 +33,10 @@ static struct option options[] = {
 	{ "debug",	no_argument,		NULL,	'd' },
 	{ "user",	required_argument,	NULL,	'u' },
 	{ "group",	required_argument,	NULL,	'g' },
+	{ "lag-limit",	required_argument,	NULL,	'l' },
+	{ "sched",	required_argument,	NULL,	's' },
+	{ "quantum",	required_argument,	NULL,	'q' },
+	{ "seq-log",	no_argument,		NULL,	'S' },
 	{ 0 }
 };
 
@@ -146,6 +151,39 @@ broker_netlink_socket(void)
 	return nl;
 }
 
+static void
+broker_parse_sched(struct route_broker_sched *sched, const char *type)
+{
+	if (!strcmp(type, "strict"))
+		sched->type = ROUTE_SCHED_STRICT;
+	else if (!strcmp(type, "wrr"))
+		sched->type = ROUTE_SCHED_WRR;
+	else if (!strcmp(type, "drr"))
+		sched->type = ROUTE_SCHED_DRR;
+	else {
+		fprintf(stderr, "unknown scheduling: %s\n", type);
+		exit(1);
+	}
+}
+
+/* A comma separated quantum per priority level, from the highest */
+static void
+broker_parse_quantum(struct route_broker_sched *sched, char *list)
+{
+	char *saveptr = NULL;
+	char *q;
+	int i = 0;
+
+	for (q = strtok_r(list, ",", &saveptr); q;
+	     q = strtok_r(NULL, ",", &saveptr)) {
+		if (i == ROUTE_PRIORITY_LEVELS_MAX) {
+			fprintf(stderr, "too many quanta\n");
+			exit(1);
+		}
+		sched->quantum[i++] = strtoul(q, NULL, 0);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct route_broker_init init = {
@@ -153,6 +191,7 @@ int main(int argc, char **argv)
 		.log_error = broker_log_error,
 	};
 	struct pollfd fds[2] = {};
+	bool showing = false;
 	char *group = NULL;
 	char *user = NULL;
 	ssize_t n;
@@ -161,7 +200,8 @@ int main(int argc, char **argv)
 	int nl;
 	int p;
 
-	while ((opt = getopt_long(argc, argv, "dg:u:", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "dg:l:q:Ss:u:", options,
+				  NULL)) != -1) {
 		switch (opt) {
 		case 'd':
 			broker_debug = 1;
@@ -169,6 +209,18 @@ int main(int argc, char **argv)
 		case 'g':
 			group = optarg;
 			break;
+		case 'l':
+			init.lag_limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			broker_parse_quantum(&init.sched, optarg);
+			break;
+		case 'S':
+			init.seq_log = true;
+			break;
+		case 's':
+			broker_parse_sched(&init.sched, optarg);
+			break;
 		case 'u':
 			user = optarg;
 			break;
@@ -177,6 +229,14 @@ int main(int argc, char **argv)
 			fprintf(stderr, "  -d,--debug   debugging\n");
 			fprintf(stderr, "  -u,--user    user to run as\n");
 			fprintf(stderr, "  -g,--group   additional group\n");
+			fprintf(stderr,
+				"  -l,--lag-limit  resync flushable dataplanes this far behind\n");
+			fprintf(stderr,
+				"  -s,--sched   strict, wrr or drr across priorities\n");
+			fprintf(stderr,
+				"  -q,--quantum per priority, as q1,q2,...\n");
+			fprintf(stderr,
+				"  -S,--seq-log track clients in a sequence log\n");
 			exit(1);
 		}
 	}
@@ -217,10 +277,12 @@ int main(int argc, char **argv)
 
 	/* Get a dump of existing kernel routes */
 	broker_dump_routes();
+	showing = broker_show_page();
 
 	for (;;) {
+		/* A show going on is output between messages */
 		fds[0].revents = fds[1].revents = 0;
-		p = poll(fds, 2, -1);
+		p = poll(fds, 2, showing ? 0 : -1);
 		if (p < 0) {
 			perror("poll");
 			route_broker_shutdown_all();
@@ -265,6 +327,8 @@ int main(int argc, char **argv)
 				break;
 			}
 		}
+
+		showing = broker_show_page();
 	}
 
 	route_broker_shutdown_all();
@@ -8,6 +8,9 @@
 #include <arpa/inet.h>
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
+#ifdef RTM_NEWNEXTHOP
+#include <linux/nexthop.h>
+#endif /* RTM_NEWNEXTHOP */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +25,10 @@
 static const char * const nlmsg_type_str[] = {
 	[RTM_NEWROUTE] = "newroute",
 	[RTM_DELROUTE] = "delroute",
+#ifdef RTM_NEWNEXTHOP
+	[RTM_NEWNEXTHOP] = "newnexthop",
+	[RTM_DELNEXTHOP] = "delnexthop",
+#endif /* RTM_NEWNEXTHOP */
 };
 
 static const char *nlmsg_type2str(uint type)
@@ -167,7 +174,8 @@ dump_rtmsg(const struct nlmsghdr *nlh)
 	mnl_attr_parse(nlh, sizeof(*rtm), dump_rtattr, rtm);
 }
 
-static void
+/* Returns the priority to publish the route at, or -1 to drop it */
+static int
 process_rtnl(const struct nlmsghdr *nlh)
 {
 	enum route_priority route_priority;
@@ -177,7 +185,7 @@ process_rtnl(const struct nlmsghdr *nlh)
 		fprintf(stderr, "[%s(%u), len %u]: too short\n",
 			nlmsg_type2str(nlh->nlmsg_type), nlh->nlmsg_type,
 			nlh->nlmsg_len);
-		return;
+		return -1;
 	}
 
 	if (broker_debug)
@@ -215,27 +223,78 @@ process_rtnl(const struct nlmsghdr *nlh)
 			nlh->nlmsg_pid != 0 && rtm->rtm_type == RTN_UNSPEC)
 		rtm->rtm_type = RTN_UNICAST;
 
-	route_broker_publish(nlh, route_priority);
+	return route_priority;
+}
+
+#ifdef RTM_NEWNEXTHOP
+/*
+ * Nexthop groups go into their own level in the broker, ahead of the
+ * routes that use them, so the priority given here is not used.
+ */
+static int
+process_nexthop(const struct nlmsghdr *nlh)
+{
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nhmsg))) {
+		fprintf(stderr, "[%s(%u), len %u]: too short\n",
+			nlmsg_type2str(nlh->nlmsg_type), nlh->nlmsg_type,
+			nlh->nlmsg_len);
+		return -1;
+	}
+
+	return ROUTE_OTHER;
 }
+#endif /* RTM_NEWNEXTHOP */
+
+/*
+ * The messages in a buffer are published to the broker together, which
+ * is cheaper than one at a time. More than this many are published as
+ * more than one batch.
+ */
+#define BROKER_PUBLISH_BATCH 256
 
 static void
 process_nlmsg(void *buf, size_t len)
 {
+	struct object_broker_msg msgs[BROKER_PUBLISH_BATCH];
+	unsigned int count = 0;
 	struct nlmsghdr *nlh;
+	int pri;
 
 	for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		pri = -1;
 		switch (nlh->nlmsg_type) {
 		case RTM_NEWROUTE:
 			/* Must be a replace or dataplane won't update */
 			nlh->nlmsg_flags |= NLM_F_REPLACE;
 			/*FALLTHRU*/
 		case RTM_DELROUTE:
-			process_rtnl(nlh);
+			pri = process_rtnl(nlh);
+			break;
+#ifdef RTM_NEWNEXTHOP
+		case RTM_NEWNEXTHOP:
+			nlh->nlmsg_flags |= NLM_F_REPLACE;
+			/*FALLTHRU*/
+		case RTM_DELNEXTHOP:
+			pri = process_nexthop(nlh);
 			break;
+#endif /* RTM_NEWNEXTHOP */
 		default:
 			break;
 		}
+		if (pri < 0)
+			continue;
+
+		if (count == ARRAY_SIZE(msgs)) {
+			object_broker_publish_batch(msgs, count);
+			count = 0;
+		}
+		msgs[count].obj = nlh;
+		msgs[count].pri = pri;
+		count++;
 	}
+
+	if (count)
+		object_broker_publish_batch(msgs, count);
 }
 
 ssize_t
@@ -294,7 +353,7 @@ broker_process_fpm(int fd)
 	process_nlmsg(fpm_msg_data(fpm), fpm_msg_data_len(fpm));
 
 	if (broker_debug)
-		route_broker_show(broker_log_debug, NULL);
+		broker_show();
 
 	return n;
 }
@@ -318,7 +377,7 @@ broker_process_nl(int fd)
 	process_nlmsg(buf, n);
 
 	if (broker_debug)
-		route_broker_show(broker_log_debug, NULL);
+		broker_show();
 
 	return n;
 }
@@ -327,13 +386,16 @@ static int
 dump_route(const struct nlmsghdr *nlh, void *arg)
 {
 	struct rtmsg *rtm = NLMSG_DATA(nlh);
+	int pri;
 
 	/* Handle kernel routes only - others come from FPM */
 	if (nlh->nlmsg_type == RTM_NEWROUTE &&
 	    nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*rtm))) {
-		if (rtm->rtm_protocol == RTPROT_KERNEL)
-			process_rtnl(nlh);
-		else if (broker_debug) {
+		if (rtm->rtm_protocol == RTPROT_KERNEL) {
+			pri = process_rtnl(nlh);
+			if (pri >= 0)
+				route_broker_publish(nlh, pri);
+		} else if (broker_debug) {
 			fprintf(stderr, "ignore non-kernel dump of %u bytes:\n",
 				nlh->nlmsg_len);
 			dump_rtmsg(nlh);
@@ -403,6 +465,54 @@ broker_dump_routes(void)
 
 	if (broker_debug) {
 		fprintf(stderr, "Dump complete\n");
-		route_broker_show(broker_log_debug, NULL);
+		broker_show();
+	}
+}
+
+/*
+ * The debug show of the broker is output a page at a time between
+ * messages, so that a slow terminal does not hold up the routes. Once
+ * the first has finished, each show is of what changed since the last.
+ */
+#define BROKER_SHOW_PAGE 64
+
+static struct route_broker_show_cursor *broker_show_cursor;
+static struct route_broker_show_pos broker_show_pos;
+static bool broker_show_shown;
+static bool broker_show_again;
+
+void
+broker_show(void)
+{
+	if (broker_show_cursor) {
+		broker_show_again = true;
+		return;
+	}
+
+	broker_show_cursor = route_broker_show_start(
+		NULL, broker_show_shown ? &broker_show_pos : NULL);
+	if (!broker_show_cursor)
+		fprintf(stderr, "No memory to show the broker\n");
+}
+
+bool
+broker_show_page(void)
+{
+	if (!broker_show_cursor)
+		return false;
+
+	if (route_broker_show_page(broker_show_cursor, broker_log_debug, NULL,
+				   BROKER_SHOW_PAGE))
+		return true;
+
+	route_broker_show_get_pos(broker_show_cursor, &broker_show_pos);
+	route_broker_show_end(broker_show_cursor);
+	broker_show_cursor = NULL;
+	broker_show_shown = true;
+
+	if (broker_show_again) {
+		broker_show_again = false;
+		broker_show();
 	}
+	return broker_show_cursor != NULL;
 }
@@ -7,6 +7,8 @@
 #ifndef _BROKERD_H_
 #define _BROKERD_H_
 
+#include <stdbool.h>
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a)	(sizeof(a)/sizeof((a)[0]))
 #endif
@@ -16,6 +18,13 @@ extern int broker_debug;
 ssize_t broker_process_nl(int fd);
 ssize_t broker_process_fpm(int fd);
 void broker_dump_routes(void);
+/*
+ * Start a show of the broker, or another once the one going has
+ * finished, and output the next page of it. Returns true while there is
+ * more to show.
+ */
+void broker_show(void);
+bool broker_show_page(void);
 
 void broker_log_debug(void *arg, const char *fmt, ...);
 void broker_log_error(void *arg, const char *fmt, ...);